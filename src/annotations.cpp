@@ -0,0 +1,46 @@
+#include "annotations.hpp"
+#include "heap.hpp"
+#include <unordered_map>
+
+namespace {
+
+// The entries of the annotated cells. A node-based map, so that entries do
+// not move as others are added.
+std::unordered_map<const Cons*, Annotations::Entry>& table = *new std::unordered_map<const Cons*, Annotations::Entry>;
+
+}
+
+Annotations::Entry* Annotations::find(const Cons* form)
+{
+    if (!form->annotated)
+        return nullptr;
+    auto it = table.find(form);
+    return it == table.end() ? nullptr : &it->second;
+}
+
+Annotations::Entry& Annotations::at(const Cons* form)
+{
+    form->annotated = true;
+    return table[form];
+}
+
+void Annotations::forget(const Cons* form)
+{
+    // The entry dies outside the table, as the forms that die with it
+    // forget theirs.
+    auto node = table.extract(form);
+}
+
+void Annotations::trace(const Cons* form, Tracer& tracer)
+{
+    Entry* entry = find(form);
+    if (!entry)
+        return;
+    tracer.mark(entry->macro);
+    tracer.mark(entry->expansion);
+    tracer.mark(entry->resolved);
+    tracer.mark(entry->original);
+    if (entry->let_scope)
+        for (const Ref<Symbol>& symbol : entry->let_scope->symbols)
+            tracer.mark(symbol);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "environment.hpp"
+#include "objects.hpp"
+#include <vector>
+
+class Tracer;
+
+// Side table from list cells to what evaluating them has worked out, so
+// that it is not worked out again the next time. Each cell has at most one
+// entry, with a field for every kind of fact, which the modules that find
+// them fill in; a new kind gets a field here rather than a table of its own.
+//
+// Cells in the table have Cons::annotated set, and are dropped from it when
+// they die, so that a later cell at the same address finds nothing. Where
+// the reader found a form is kept apart, by the SourceMap, as nearly every
+// list read has a location and little else.
+namespace Annotations {
+struct Entry {
+    // For a macro call, kept by Expansions: the macro that expanded it,
+    // which keeps its address from being reused, the expansion as the macro
+    // made it, and the expansion resolved for the frames of scopes, from
+    // the innermost out. The scopes are held so that their addresses are
+    // not reused either.
+    Ref<Procedure> macro;
+    Ref<Object> expansion;
+    Ref<Object> resolved;
+    std::vector<Ref<Environment::Scope>> scopes;
+    // For a call the Resolver rebuilt with resolved arguments, the form it
+    // was rebuilt from, as read.
+    Ref<Object> original;
+    // For the list of bindings of a let form evaluated as read, the Scope
+    // every evaluation of the form binds its lexical variables in.
+    Ref<Environment::Scope> let_scope;
+};
+
+// The entry of form, or null if it has none.
+Entry* find(const Cons* form);
+// The entry of form, made empty if it has none. Stays where it is until
+// form dies, whatever else is added.
+Entry& at(const Cons* form);
+void forget(const Cons* form);
+// Marks the objects in the entry of form.
+void trace(const Cons* form, Tracer& tracer);
+};
@@ -0,0 +1,59 @@
+
+#include "argument_stack.hpp"
+#include "heap.hpp"
+#include <algorithm>
+
+ArgumentStack& ArgumentStack::current()
+{
+    static thread_local ArgumentStack stack;
+    return stack;
+}
+
+void ArgumentStack::trace(Tracer& tracer) const
+{
+    for (const Segment& each : this->segments)
+        for (size_t i = 0; i < each.size; i++)
+            tracer.mark(each.slots[i]);
+}
+
+// --------------------------------------------------------------------------------
+
+ArgumentStack::Frame::Frame(size_t _size)
+    : stack(ArgumentStack::current())
+    , previous_segment(stack.segment)
+    , previous_top(stack.top)
+    , size(_size)
+{
+    static constexpr size_t min_segment = 1024;
+
+    std::vector<Segment>& segments = this->stack.segments;
+    if (segments.empty())
+        segments.push_back({ std::make_unique<Ref<Object>[]>(min_segment), min_segment });
+
+    // A frame that does not fit in what is left of the segment starts the
+    // next one that is large enough, dropping any that are too small.
+    if (this->stack.top + this->size > segments[this->stack.segment].size) {
+        size_t next = this->stack.segment + 1;
+        if (next < segments.size() && segments[next].size < this->size)
+            segments.erase(segments.begin() + next, segments.end());
+        if (next == segments.size()) {
+            size_t segment_size = std::max(min_segment, this->size);
+            segments.push_back({ std::make_unique<Ref<Object>[]>(segment_size), segment_size });
+        }
+        this->stack.segment = next;
+        this->stack.top = 0;
+    }
+
+    this->slots = segments[this->stack.segment].slots.get() + this->stack.top;
+    this->stack.top += this->size;
+}
+
+ArgumentStack::Frame::~Frame()
+{
+    // Slots written through data() hold references too, such as the
+    // temporaries of the VM.
+    for (size_t i = 0; i < this->size; i++)
+        this->slots[i] = nullptr;
+    this->stack.segment = this->previous_segment;
+    this->stack.top = this->previous_top;
+}
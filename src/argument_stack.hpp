@@ -0,0 +1,59 @@
+
+#pragma once
+
+#include "objects.hpp"
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <vector>
+
+// Stack of the arguments of the calls in progress, so calls pass them as
+// spans instead of building vectors. Each frame is contiguous and never
+// moves while it lives. The storage is kept once grown, so a call only
+// allocates when it goes deeper or wider than any call before it.
+class ArgumentStack {
+private:
+    struct Segment {
+        std::unique_ptr<Ref<Object>[]> slots;
+        size_t size;
+    };
+
+    std::vector<Segment> segments;
+    size_t segment = 0; // Segment holding the top frame
+    size_t top = 0; // First free slot of that segment
+
+    ArgumentStack() = default;
+
+public:
+    // Stack of the calling thread.
+    static ArgumentStack& current();
+
+    // Marks what every slot holds. Slots outside frames are empty.
+    void trace(Tracer& tracer) const;
+
+    // Room for the arguments of one call. Its slots start empty, are filled
+    // with push or through data(), and are all released when it is
+    // destroyed. Frames must be destroyed in the reverse order they were
+    // created in.
+    class Frame {
+    private:
+        ArgumentStack& stack;
+        size_t previous_segment;
+        size_t previous_top;
+        Ref<Object>* slots;
+        size_t size;
+        size_t count = 0; // Pushed so far
+
+    public:
+        Frame(size_t size);
+        Frame(const Frame&) = delete;
+        Frame& operator=(const Frame&) = delete;
+        ~Frame();
+
+        void push(Ref<Object> obj) { this->slots[this->count++] = std::move(obj); }
+        std::span<const Ref<Object>> arguments() const { return { this->slots, this->count }; }
+        // The slots themselves, for frames that hold the variables of a call
+        // or let form rather than arguments.
+        Ref<Object>* data() { return this->slots; }
+    };
+};
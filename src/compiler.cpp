@@ -0,0 +1,538 @@
+
+#include "compiler.hpp"
+#include "expansions.hpp"
+#include "hash_cons.hpp"
+#include "heap.hpp"
+#include "package.hpp"
+#include "resolver.hpp"
+#include "special_operator.hpp"
+#include "vm.hpp"
+#include <limits>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+namespace {
+
+bool compiling = true;
+
+// The bodies added by add_translation, by the bytes of their code.
+std::unordered_map<std::string, TranslatedCode>& translations = *new std::unordered_map<std::string, TranslatedCode>;
+
+std::string bytes_of(std::span<const Instruction> code)
+{
+    std::string bytes;
+    for (const Instruction& in : code) {
+        for (uint16_t field : { static_cast<uint16_t>(in.op), in.a, in.b, in.c }) {
+            bytes += static_cast<char>(field & 0xff);
+            bytes += static_cast<char>(field >> 8);
+        }
+    }
+    return bytes;
+}
+
+// Special operators with instructions of their own.
+struct Operators {
+    const Symbol* progn;
+    const Symbol* quote;
+    const Symbol* branch;
+    const Symbol* quasiquote;
+};
+
+const Operators& operators()
+{
+    static const Operators operators = [] {
+        auto find = [](std::string_view name) { return Package::almaPackage->find_symbol(name)->get(); };
+        return Operators { find("progn"), find("quote"), find("if"), find("quasiquote") };
+    }();
+    return operators;
+}
+
+// Name of the symbol at the head of list, as quasiquote recognizes its
+// quote, unquote and slice-unquote forms, or empty if there is none.
+std::string_view head_name(const std::vector<Ref<Object>>& list)
+{
+    return Object::is<Symbol>(list[0]) ? std::string_view(Object::as<Symbol>(list[0])->name) : std::string_view();
+}
+
+// How a quasiquote template expands.
+enum class Template {
+    Constant, // To a copy of itself
+    Variable, // Evaluating what it unquotes
+    Unsupported, // In a way left to the tree walker
+};
+
+Template classify(const Ref<Object>& obj)
+{
+    if (!Object::is<Cons>(obj))
+        return Template::Constant;
+    std::optional<std::vector<Ref<Object>>> list = Object::as<Cons>(obj)->elements();
+    if (!list)
+        return Template::Unsupported;
+    std::string_view head = head_name(*list);
+    if (head == "quasiquote")
+        return Template::Unsupported;
+    if (head == "unquote" || head == "slice-unquote")
+        return list->size() == 2 ? Template::Variable : Template::Unsupported;
+    if (head == "quote" && list->size() != 2)
+        return Template::Unsupported;
+
+    Template result = Template::Constant;
+    for (size_t i = head == "quote" ? 1 : 0; i < list->size(); i++) {
+        Template element = classify((*list)[i]);
+        if (element == Template::Unsupported)
+            return element;
+        if (element == Template::Variable)
+            result = element;
+    }
+    return result;
+}
+
+bool is_splice(const Ref<Object>& obj)
+{
+    if (!Object::is<Cons>(obj))
+        return false;
+    std::optional<std::vector<Ref<Object>>> list = Object::as<Cons>(obj)->elements();
+    return list && head_name(*list) == "slice-unquote";
+}
+
+class Compilation {
+private:
+    // A frame the body runs in, and the register of its first variable.
+    struct Level {
+        const Environment::Scope* scope;
+        uint32_t base;
+    };
+
+    // Where a Function instruction goes when its symbol names no function:
+    // an Eval of the whole call.
+    struct Fallback {
+        size_t function;
+        size_t resume;
+        uint32_t target;
+        Ref<Object> form;
+        const Cons* blame;
+    };
+
+    Bytecode& bytecode;
+    std::vector<Level> chain; // Captured variables, parameters, then let forms
+    std::vector<const Cons*> located; // Forms with a location around the one being compiled
+    std::unordered_map<const Object*, uint32_t> constant_indexes;
+    std::vector<Fallback> fallbacks;
+    uint32_t top; // First free register
+    size_t expanding = 0; // Macro calls being compiled around the form
+    bool failed = false;
+
+    static constexpr uint32_t max_operand = std::numeric_limits<uint16_t>::max();
+
+    size_t emit(Op op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0)
+    {
+        if (a > max_operand || b > max_operand || c > max_operand)
+            this->failed = true;
+        this->bytecode.code.push_back({ op, static_cast<uint16_t>(a), static_cast<uint16_t>(b), static_cast<uint16_t>(c) });
+        this->bytecode.forms.push_back(this->located.empty() ? nullptr : this->located.back());
+        return this->bytecode.code.size() - 1;
+    }
+    uint32_t here() const { return this->bytecode.code.size(); }
+    void patch(size_t instruction, uint32_t target)
+    {
+        if (target > max_operand)
+            this->failed = true;
+        Instruction& patched = this->bytecode.code[instruction];
+        (patched.op == Op::Jump ? patched.a : patched.op == Op::JumpIfFalse ? patched.b : patched.c) = target;
+    }
+
+    uint32_t constant(const Ref<Object>& obj)
+    {
+        auto [it, inserted] = this->constant_indexes.emplace(obj.get(), this->bytecode.constants.size());
+        if (inserted)
+            this->bytecode.constants.push_back(obj);
+        return it->second;
+    }
+
+    uint32_t reserve(uint32_t count)
+    {
+        uint32_t base = this->top;
+        this->top += count;
+        this->bytecode.registers = std::max(this->bytecode.registers, this->top);
+        return base;
+    }
+
+    void eval(const Ref<Object>& form, uint32_t target) { this->emit(Op::Eval, target, this->constant(form)); }
+
+    void compile(const Ref<Object>& form, uint32_t target)
+    {
+        switch (Object::type_of(form)) {
+        case Object::Type::LexicalVariable: {
+            const LexicalVariable* variable = Object::as<LexicalVariable>(form);
+            size_t level = this->chain.size() - 1 - variable->depth;
+            if (level == 0)
+                this->emit(Op::Captured, target, variable->index);
+            else
+                this->emit(Op::Var, target, this->chain[level].base + variable->index);
+            break;
+        }
+        case Object::Type::GlobalVariable:
+            this->emit(Op::Global, target, this->constant(Object::as<GlobalVariable>(form)->symbol));
+            break;
+        case Object::Type::Integer:
+        case Object::Type::String:
+        case Object::Type::Nil:
+        case Object::Type::Fixnum:
+            this->emit(Op::Const, target, this->constant(form));
+            break;
+        case Object::Type::Cons: {
+            const Cons* cons = Object::as<Cons>(form);
+            if (cons->located)
+                this->located.push_back(cons);
+            this->compile_form(form, target);
+            if (cons->located)
+                this->located.pop_back();
+            break;
+        }
+        default:
+            this->eval(form, target);
+        }
+    }
+
+    void compile_form(const Ref<Object>& form, uint32_t target)
+    {
+        std::optional<std::vector<Ref<Object>>> elements = Object::as<Cons>(form)->elements();
+        if (!elements)
+            return this->eval(form, target);
+        std::span<const Ref<Object>> args = std::span<const Ref<Object>>(*elements).subspan(1);
+
+        const Ref<Object>& head = (*elements)[0];
+        if (Object::is<Procedure>(head)) {
+            Procedure* procedure = Object::as<Procedure>(head);
+            if (auto let = dynamic_cast<resolved_let*>(procedure); let && let->specials.empty()
+                && this->chain.size() - 2 < max_scopes)
+                return this->compile_let(*let, args, target);
+            if (dynamic_cast<resolved_lambda*>(procedure) && args.empty())
+                return (void)this->emit(Op::Closure, target, this->constant(head));
+            return this->eval(form, target);
+        }
+        if (!Object::is<Symbol>(head))
+            return this->eval(form, target);
+
+        const Symbol* symbol = Object::as<Symbol>(head);
+        const Operators& ops = operators();
+        if (symbol == ops.quote && args.size() == 1)
+            return (void)this->emit(Op::Const, target, this->constant(args[0]));
+        if (symbol == ops.progn)
+            return this->compile_body(args, target);
+        if (symbol == ops.branch && (args.size() == 2 || args.size() == 3))
+            return this->compile_if(args, target);
+        if (symbol == ops.quasiquote && args.size() == 1)
+            return this->compile_quasiquote(form, args[0], target);
+        // A call rebuilt before its name was defined as a macro is expanded
+        // from its arguments as read, by the tree walker.
+        if (Object::is<Macro>(symbol->function) && !Resolver::original(Object::as<Cons>(form))
+            && this->expanding < max_expansions)
+            return this->compile_expansion(form, Object::cast<Symbol>(head), args, target);
+        if (symbol->function && !Object::is<Function>(symbol->function))
+            return this->eval(form, target);
+        this->compile_call(form, Object::cast<Symbol>(head), args, target);
+    }
+
+    // The scopes of the frames the body runs in, from the innermost out.
+    std::vector<const Environment::Scope*> scopes() const
+    {
+        std::vector<const Environment::Scope*> scopes;
+        for (auto level = this->chain.rbegin(); level != this->chain.rend(); level++)
+            scopes.push_back(level->scope);
+        return scopes;
+    }
+
+    // A call of the macro symbol names, compiled as its expansion, which is
+    // made now unless the tree walker or an earlier compilation made it.
+    // Should the macro fail, the call is left to fail when it runs.
+    void compile_expansion(const Ref<Object>& form, const Ref<Symbol>& symbol,
+        std::span<const Ref<Object>> args, uint32_t target)
+    {
+        const Cons* call = Object::as<Cons>(form);
+        Ref<Procedure> macro = symbol->function;
+        std::vector<const Environment::Scope*> scopes = this->scopes();
+        Ref<Object> expansion = Expansions::find(call, macro.get(), scopes);
+        if (!expansion) {
+            try {
+                // The code being compiled holds objects the collector does
+                // not see.
+                Heap::Hold hold;
+                Environment env;
+                expansion = static_cast<Macro*>(macro.get())->expand(env, args);
+            } catch (const std::runtime_error&) {
+                return this->eval(form, target);
+            }
+            expansion = Expansions::record(call, macro, expansion, scopes);
+        }
+
+        this->bytecode.macros.push_back({ symbol, macro });
+        this->expanding++;
+        this->compile(expansion, target);
+        this->expanding--;
+    }
+
+    void compile_body(std::span<const Ref<Object>> forms, uint32_t target)
+    {
+        if (forms.empty())
+            this->emit(Op::Const, target, this->constant(Object::nil()));
+        for (const Ref<Object>& form : forms)
+            this->compile(form, target);
+    }
+
+    void compile_if(std::span<const Ref<Object>> args, uint32_t target)
+    {
+        uint32_t test = this->reserve(1);
+        this->compile(args[0], test);
+        this->top = test;
+        size_t to_else = this->emit(Op::JumpIfFalse, test);
+        this->compile(args[1], target);
+        size_t to_end = this->emit(Op::Jump);
+        this->patch(to_else, this->here());
+        if (args.size() == 3)
+            this->compile(args[2], target);
+        else
+            this->emit(Op::Const, target, this->constant(Object::nil()));
+        this->patch(to_end, this->here());
+    }
+
+    void compile_let(const resolved_let& let, std::span<const Ref<Object>> args, uint32_t target)
+    {
+        uint32_t count = let.scope->symbols.size();
+        uint32_t base = this->reserve(count);
+        for (uint32_t i = 0; i < count; i++)
+            this->compile(args[i], base + i);
+
+        if (args.size() == count) {
+            this->emit(Op::Const, target, this->constant(Object::nil()));
+        } else {
+            uint32_t scope = this->bytecode.scopes.size();
+            this->bytecode.scopes.push_back(let.scope.get());
+            this->emit(Op::Enter, scope, base);
+            this->chain.push_back({ let.scope.get(), base });
+            this->compile_body(args.subspan(count), target);
+            this->chain.pop_back();
+            this->emit(Op::Leave, base, count);
+        }
+        this->top = base;
+    }
+
+    void compile_call(const Ref<Object>& form, const Ref<Symbol>& symbol,
+        std::span<const Ref<Object>> args, uint32_t target)
+    {
+        uint32_t base = this->reserve(args.size() + 1);
+        size_t function = this->emit(Op::Function, base, this->constant(symbol));
+        for (size_t i = 0; i < args.size(); i++)
+            this->compile(args[i], base + 1 + i);
+        this->emit(Op::Call, target, base, args.size());
+        this->fallbacks.push_back({ function, this->here(), target, form,
+            this->located.empty() ? nullptr : this->located.back() });
+        this->top = base;
+    }
+
+    // (quasiquote template)
+    void compile_quasiquote(const Ref<Object>& form, const Ref<Object>& templ, uint32_t target)
+    {
+        switch (classify(templ)) {
+        case Template::Constant:
+            return this->expand_constant(templ, target);
+        case Template::Variable:
+            if (!is_splice(templ) && this->expand(templ, target))
+                return;
+            [[fallthrough]];
+        case Template::Unsupported:
+            this->eval(form, target);
+        }
+    }
+
+    // Atoms expand to themselves, lists to a copy, which is shared when
+    // constants are hash-consed.
+    void expand_constant(const Ref<Object>& templ, uint32_t target)
+    {
+        if (!Object::is<Cons>(templ))
+            this->emit(Op::Const, target, this->constant(templ));
+        else if (HashCons::enabled())
+            this->emit(Op::Const, target, this->constant(HashCons::canonical(VM::copy(templ))));
+        else
+            this->emit(Op::Copy, target, this->constant(templ));
+    }
+
+    void expand_element(const Ref<Object>& templ, uint32_t target, bool& ok)
+    {
+        if (classify(templ) == Template::Constant)
+            this->expand_constant(templ, target);
+        else
+            ok = ok && this->expand(templ, target);
+    }
+
+    // Compiles the expansion of a variable template other than a
+    // slice-unquote form. False if it has one where it cannot be spliced.
+    bool expand(const Ref<Object>& templ, uint32_t target)
+    {
+        std::vector<Ref<Object>> list = *Object::as<Cons>(templ)->elements();
+        std::string_view head = head_name(list);
+        if (head == "unquote") {
+            this->compile(list[1], target);
+            return true;
+        }
+        if (head == "quote") {
+            if (is_splice(list[1]))
+                return false;
+            uint32_t base = this->reserve(2);
+            bool ok = true;
+            this->emit(Op::Const, base, this->constant(list[0]));
+            this->expand_element(list[1], base + 1, ok);
+            this->emit(Op::List, target, base, 2);
+            this->top = base;
+            return ok;
+        }
+
+        bool ok = true;
+        size_t splices = 0;
+        for (const Ref<Object>& element : list)
+            splices += is_splice(element);
+        if (splices == 0) {
+            uint32_t base = this->reserve(list.size());
+            for (size_t i = 0; i < list.size(); i++)
+                this->expand_element(list[i], base + i, ok);
+            this->emit(Op::List, target, base, list.size());
+            this->top = base;
+            return ok;
+        }
+
+        // Runs of elements between splices are made lists of their own, and
+        // all of them appended.
+        std::vector<std::pair<size_t, size_t>> segments;
+        for (size_t i = 0; i < list.size();) {
+            size_t end = i + 1;
+            if (!is_splice(list[i]))
+                while (end < list.size() && !is_splice(list[end]))
+                    end++;
+            segments.push_back({ i, end });
+            i = end;
+        }
+        uint32_t base = this->reserve(segments.size());
+        for (size_t s = 0; s < segments.size(); s++) {
+            auto [begin, end] = segments[s];
+            if (is_splice(list[begin])) {
+                this->compile(Object::as<Cons>(list[begin])->next()->car, base + s);
+                this->emit(Op::Splice, base + s);
+                continue;
+            }
+            uint32_t elements = this->reserve(end - begin);
+            for (size_t i = begin; i < end; i++)
+                this->expand_element(list[i], elements + i - begin, ok);
+            this->emit(Op::List, base + s, elements, end - begin);
+            this->top = elements;
+        }
+        this->emit(Op::Append, target, base, segments.size());
+        this->top = base;
+        return ok;
+    }
+
+public:
+    Compilation(Bytecode& _bytecode, const LambdaCode& code)
+        : bytecode(_bytecode)
+        , top(code.params->symbols.size())
+    {
+        this->chain.push_back({ code.captures.get(), 0 });
+        this->chain.push_back({ code.params.get(), 0 });
+        this->bytecode.registers = std::max(code.params->symbols.size(), code.specials.size());
+
+        uint32_t result = this->reserve(1);
+        this->compile_body(code.body, result);
+        this->emit(Op::Return, result);
+
+        // Out of the way of the calls that do find their function.
+        for (const Fallback& fallback : this->fallbacks) {
+            this->patch(fallback.function, this->here());
+            this->located.push_back(fallback.blame);
+            this->eval(fallback.form, fallback.target);
+            this->located.pop_back();
+            this->patch(this->emit(Op::Jump), fallback.resume);
+        }
+        if (this->here() > max_operand)
+            this->failed = true;
+
+        for (size_t i = 0; i < this->bytecode.code.size(); i++) {
+            Instruction& in = this->bytecode.code[i];
+            if (in.op == Op::Call && this->returned(i + 1, in.a))
+                in.op = Op::TailCall;
+        }
+    }
+
+    // Whether the code from instruction i on returns register r as it is,
+    // after at most jumping and leaving let forms that do not hold it.
+    bool returned(size_t i, uint32_t r) const
+    {
+        const std::vector<Instruction>& code = this->bytecode.code;
+        for (; i < code.size(); i++) {
+            const Instruction& in = code[i];
+            switch (in.op) {
+            case Op::Return:
+                return in.a == r;
+            case Op::Jump:
+                if (in.a <= i)
+                    return false;
+                i = in.a - 1;
+                break;
+            case Op::Leave:
+                if (r >= in.a && r < in.a + in.b)
+                    return false;
+                break;
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool ok() const { return !this->failed; }
+};
+
+}
+
+uint64_t Compiler::redefinitions = 0;
+
+bool Compiler::stale(Bytecode& bytecode)
+{
+    if (bytecode.checked == redefinitions)
+        return false;
+    for (const auto& [symbol, macro] : bytecode.macros)
+        if (symbol->function != macro)
+            return true;
+    bytecode.checked = redefinitions;
+    return false;
+}
+
+void Compiler::disable()
+{
+    compiling = false;
+}
+
+bool Compiler::enabled()
+{
+    return compiling;
+}
+
+std::unique_ptr<Bytecode> Compiler::compile(const LambdaCode& code)
+{
+    if (!compiling)
+        return nullptr;
+    std::unique_ptr<Bytecode> bytecode(new Bytecode);
+    bytecode->checked = redefinitions;
+    if (!Compilation(*bytecode, code).ok())
+        return nullptr;
+    if (!translations.empty()) {
+        auto found = translations.find(bytes_of(bytecode->code));
+        if (found != translations.end())
+            bytecode->translated = found->second;
+    }
+    return bytecode;
+}
+
+void Compiler::add_translation(std::span<const Instruction> code, TranslatedCode body)
+{
+    translations.emplace(bytes_of(code), body);
+}
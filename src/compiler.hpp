@@ -0,0 +1,97 @@
+
+#pragma once
+
+#include "environment.hpp"
+#include "jit.hpp"
+#include "objects.hpp"
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Instructions of the bytecode of user functions and macros. Operands a, b
+// and c name registers, constants, instructions or counts as listed.
+enum class Op : uint16_t {
+    Const, // r[a] = constants[b]
+    Var, // r[a] = r[b], the value of a lexical variable, unwrapped from its Cell
+    Captured, // r[a] = the value of captured variable b
+    Global, // r[a] = the value of the symbol constants[b]
+    Function, // r[a] = the function of the symbol constants[b], or jump to c if it is not one
+    Call, // r[a] = r[b] applied to the c registers after it
+    TailCall, // Call whose result is returned as it is, in place of this call if it runs compiled code
+    Jump, // Continue at a
+    JumpIfFalse, // Continue at b if r[a] is nil
+    Enter, // Bind the variables of scopes[a] in the registers from b
+    Leave, // Unbind the innermost scope, clearing the b registers from a
+    Closure, // r[a] = the procedure constants[b] applied to no arguments
+    Eval, // r[a] = the form constants[b], evaluated by the tree walker
+    List, // r[a] = a new list of the c registers from b
+    Splice, // Fail unless r[a] is a proper list, to be spliced in by slice-unquote
+    Append, // r[a] = a new list of the elements of the c lists from b
+    Copy, // r[a] = a copy of the constant list constants[b]
+    Return, // Return r[a]
+};
+
+struct Instruction {
+    Op op;
+    uint16_t a = 0;
+    uint16_t b = 0;
+    uint16_t c = 0;
+};
+
+// Runs Bytecode from instruction start as a body translated to C++ by alma
+// --compile-to-cpp, with the contract of JIT::Code::run.
+using TranslatedCode = uint32_t (*)(VM::State& state, Ref<Object>* registers, uint32_t start);
+
+// The body of a lambda or gamma form, compiled. Its registers start with
+// the parameters, followed by the variables of its let forms and by
+// temporaries. The frames of the Environment are kept as the tree walker
+// would keep them, so that forms the compiler leaves to it, eval and the
+// closures it creates find every variable where they expect it.
+struct Bytecode {
+    std::vector<Instruction> code;
+    std::vector<Ref<Object>> constants;
+    std::vector<const Environment::Scope*> scopes; // Of its let forms
+    // Per instruction, the innermost form around it with a source location,
+    // blamed for its errors. Null if there is none in the body.
+    std::vector<const Cons*> forms;
+    uint32_t registers = 0;
+    uint32_t calls = 0; // Runs so far, counted up to JIT::hot_calls
+    JIT::Code native; // Empty unless it got hot and the JIT compiled it
+    TranslatedCode translated = nullptr; // Set if a translated body has its code
+    // The macros whose calls it expanded in place, with the symbols that
+    // named them. It is stale once one of them names something else.
+    std::vector<std::pair<Ref<Symbol>, Ref<Procedure>>> macros;
+    uint64_t checked = 0; // Compiler::redefinitions when it was last found current
+};
+
+// Let forms nested deeper than this in one body are left to the tree
+// walker.
+inline constexpr size_t max_scopes = 8;
+// Macro calls nested deeper than this in the expansions of one body, as a
+// macro that expands to a call of itself makes, are left to the tree
+// walker.
+inline constexpr size_t max_expansions = 64;
+
+// Compiles the resolved bodies of lambda and gamma forms to Bytecode, run
+// by the VM. Calls of the macros defined by then are expanded, and their
+// expansions compiled in place, so that the calls they make in tail
+// position are tail calls too. Forms it has no instructions for, such as
+// special operators other than progn, if, quote and quasiquote, are
+// evaluated by the tree walker from their bytecode.
+namespace Compiler {
+// Times a symbol that named a macro has been given another procedure.
+extern uint64_t redefinitions;
+// Whether a macro bytecode expanded calls of is no longer named by its
+// symbol, so that it must be compiled again.
+bool stale(Bytecode& bytecode);
+// Leaves every body to the tree walker.
+void disable();
+bool enabled();
+// The bytecode of code, or null if it must run on the tree walker.
+std::unique_ptr<Bytecode> compile(const LambdaCode& code);
+// Has the bytecode compiled from then on run by body wherever its code is
+// exactly code.
+void add_translation(std::span<const Instruction> code, TranslatedCode body);
+};
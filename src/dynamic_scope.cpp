@@ -0,0 +1,58 @@
+
+#include "dynamic_scope.hpp"
+#include "heap.hpp"
+#include <utility>
+#include <vector>
+
+namespace {
+
+struct Saved {
+    Ref<Symbol> symbol;
+    Ref<Object> value; // Null if the symbol was unbound
+};
+
+// Never destroyed, like the symbols whose values it holds.
+std::vector<Saved>& saved = *new std::vector<Saved>;
+
+}
+
+DynamicScope::DynamicScope()
+    : base(saved.size())
+{
+}
+
+DynamicScope::~DynamicScope()
+{
+    while (saved.size() > this->base) {
+        Saved& last = saved.back();
+        last.symbol->value = std::move(last.value);
+        saved.pop_back();
+    }
+}
+
+void DynamicScope::bind(const Ref<Symbol>& symbol, Ref<Object> value)
+{
+    saved.push_back({ symbol, std::exchange(symbol->value, std::move(value)) });
+}
+
+void DynamicScope::bind(std::span<const Ref<Symbol>> specials, Ref<Object>* values)
+{
+    size_t lexical = 0;
+    for (size_t i = 0; i < specials.size(); i++) {
+        if (specials[i]) {
+            this->bind(specials[i], std::move(values[i]));
+        } else {
+            if (lexical != i)
+                values[lexical] = std::move(values[i]);
+            lexical++;
+        }
+    }
+}
+
+void DynamicScope::trace(Tracer& tracer)
+{
+    for (const Saved& entry : saved) {
+        tracer.mark(entry.symbol);
+        tracer.mark(entry.value);
+    }
+}
@@ -0,0 +1,37 @@
+
+#pragma once
+
+#include "objects.hpp"
+#include <cstddef>
+#include <span>
+
+class Tracer;
+
+// Bindings of special variables, those declared by defvar or defparameter.
+// They are shallow: binding a variable saves the value of its symbol on a
+// stack and stores the new one in the symbol, so reading the variable stays
+// a read of its symbol wherever the binding is seen from.
+//
+// A DynamicScope undoes the bindings made through it, innermost first, when
+// it is destroyed, also when an error unwinds past it. Scopes must be
+// destroyed in the reverse order they were created in.
+class DynamicScope {
+private:
+    size_t base; // Saved values below it belong to enclosing scopes
+
+public:
+    DynamicScope();
+    DynamicScope(const DynamicScope&) = delete;
+    DynamicScope& operator=(const DynamicScope&) = delete;
+    ~DynamicScope();
+
+    void bind(const Ref<Symbol>& symbol, Ref<Object> value);
+    // Binds the special variables among the bindings of a form: specials has
+    // one entry per binding, the variable it binds or null if it is lexical,
+    // and values the value of each. The values of the lexical bindings are
+    // moved to the front of values, in order, as their frame expects them.
+    void bind(std::span<const Ref<Symbol>> specials, Ref<Object>* values);
+
+    // Marks the values saved by every scope.
+    static void trace(Tracer& tracer);
+};
@@ -1,76 +1,63 @@
 
 #include "environment.hpp"
+#include "heap.hpp"
 #include "objects.hpp"
 
-bool Environment::EnvironmentLayer::isSymbolBound(const std::shared_ptr<Symbol>& symbol) const
-{
-    return this->values.contains(symbol) && values.at(symbol);
-}
-
-void Environment::EnvironmentLayer::setValue(const std::shared_ptr<Symbol>& symbol,
-    const std::shared_ptr<Object>& value)
-{
-    this->values[symbol] = value;
-}
-
-std::shared_ptr<Object> Environment::EnvironmentLayer::getValue(const std::shared_ptr<Symbol>& symbol) const
-{
-    if (!this->isSymbolBound(symbol))
-        throw std::runtime_error("The symbol " + symbol->name + " is not bound");
-    return this->values.at(symbol);
-}
+uint64_t Environment::probes = 0;
 
-bool Environment::isSymbolBound(const std::shared_ptr<Symbol>& symbol) const
+Ref<Object>* Environment::find(const Symbol* symbol) const
 {
-    size_t len = this->values.size();
-    for (size_t i = 0; i < len; i++) {
-        if (this->values[len - i - 1]->isSymbolBound(symbol))
-            return true;
+    probes++;
+    for (const Frame* frame = this->top; frame; frame = frame->parent) {
+        const std::vector<Ref<Symbol>>& symbols = frame->scope.symbols;
+        for (size_t i = 0; i < symbols.size(); i++) {
+            if (symbols[i].get() == symbol) {
+                Ref<Object>& slot = frame->slots[i];
+                return Object::is<Cell>(slot) ? &Object::as<Cell>(slot)->value : &slot;
+            }
+        }
     }
-    return false;
+    return nullptr;
 }
 
-void Environment::pushValues(
-    const std::vector<std::shared_ptr<Symbol>>& _symbols,
-    const std::vector<std::shared_ptr<Object>>& _values)
+std::vector<const Environment::Scope*> Environment::scopes() const
 {
-    if (_symbols.size() != _values.size())
-        throw std::runtime_error("Symbols and values must have the same size");
-
-    std::shared_ptr<EnvironmentLayer> layer = std::make_shared<EnvironmentLayer>();
-    for (size_t i = 0; i < _symbols.size(); i++) {
-        layer->setValue(_symbols[i], _values[i]);
-    }
-
-    this->values.push_back(layer);
+    std::vector<const Scope*> scopes;
+    for (const Frame* frame = this->top; frame; frame = frame->parent)
+        scopes.push_back(&frame->scope);
+    return scopes;
 }
 
-void Environment::popValues()
+bool Environment::has_scopes(std::span<const Ref<Scope>> scopes) const
 {
-    if (values.empty())
-        throw std::runtime_error("The lexical environment is empty.");
-    values.pop_back();
+    const Frame* frame = this->top;
+    for (const Ref<Scope>& scope : scopes) {
+        if (!frame || &frame->scope != scope.get())
+            return false;
+        frame = frame->parent;
+    }
+    return !frame;
 }
 
-std::shared_ptr<Object> Environment::getValue(const std::shared_ptr<Symbol>& symbol) const
+std::vector<Ref<Object>> Environment::capture(std::span<const Capture> captures) const
 {
-    size_t len = this->values.size();
-    for (size_t i = 0; i < len; i++) {
-        if (values[len - i - 1]->isSymbolBound(symbol))
-            return values[len - i - 1]->getValue(symbol);
+    std::vector<Ref<Object>> cells;
+    cells.reserve(captures.size());
+    for (const Capture& capture : captures) {
+        Ref<Object>& slot = this->slot(capture.depth, capture.index);
+        if (!Object::is<Cell>(slot))
+            slot = make<Cell>(slot);
+        cells.push_back(slot);
     }
-
-    throw std::runtime_error("The symbol " + symbol->name + " is not bound");
+    return cells;
 }
 
-void Environment::setValue(const std::shared_ptr<Symbol>& symbol, const std::shared_ptr<Object>& value)
+void Environment::trace(Tracer& tracer) const
 {
-    size_t len = this->values.size();
-    for (size_t i = 0; i < len; i++) {
-        if (this->values[len - i - 1]->isSymbolBound(symbol)) {
-            this->values[len - i - 1]->setValue(symbol, value);
-            return;
+    for (const Frame* frame = this->top; frame; frame = frame->parent) {
+        for (size_t i = 0; i < frame->scope.symbols.size(); i++) {
+            tracer.mark(frame->scope.symbols[i]);
+            tracer.mark(frame->slots[i]);
         }
     }
-    throw std::runtime_error("The symbol " + symbol->name + " is not bound");
 }
@@ -1,52 +1,98 @@
 
 #pragma once
 
-#include <map>
-#include <memory>
+#include "ref.hpp"
+#include <cstdint>
+#include <span>
 #include <vector>
 
 struct Symbol;
 class Object;
+class Tracer;
 
+// Lexical variables. Each let form, each call and each closure binds its
+// variables in a frame of its own: a flat array with one slot per
+// variable, in the order its Scope lists them. Code resolved ahead of time
+// by the Resolver reads a variable as the slot at a known depth and index.
+// Everything else, such as eval, setq or the expansions of macros, finds
+// it by name.
+//
+// Frames only live while their form runs, in slots of the ArgumentStack.
+// Closures keep the variables they capture instead: capturing a variable
+// moves its value into a Cell, shared from then on by its frame and every
+// closure that captures it.
 class Environment {
-private:
-    class EnvironmentLayer {
+public:
+    // The variables of a frame, in slot order. Shared by every frame of the
+    // same let form or closure.
+    struct Scope : Counted {
+        std::vector<Ref<Symbol>> symbols;
+    };
+
+    // Where a variable captured by a closure is when the closure is created.
+    struct Capture {
+        uint32_t depth;
+        uint32_t index;
+    };
+
+    // Binds the variables of scope in slots owned by the caller, for as long
+    // as it lives. Frames must be destroyed in the reverse order they were
+    // created in.
+    class Frame {
+        friend class Environment;
+
     private:
-        std::map<std::shared_ptr<Symbol>, std::shared_ptr<Object>> values;
+        Environment& env;
+        const Frame* parent;
+        const Scope& scope;
+        Ref<Object>* slots;
 
     public:
-        template <typename InputIt>
-        void insert(InputIt start, InputIt end);
-        bool isSymbolBound(const std::shared_ptr<Symbol>& symbol) const;
-        void setValue(const std::shared_ptr<Symbol>& symbol, const std::shared_ptr<Object>& value);
-        std::shared_ptr<Object> getValue(const std::shared_ptr<Symbol>& symbol) const;
+        Frame(Environment& _env, const Scope& _scope, Ref<Object>* _slots)
+            : env(_env)
+            , parent(_env.top)
+            , scope(_scope)
+            , slots(_slots)
+        {
+            _env.top = this;
+        }
+        Frame(const Frame&) = delete;
+        Frame& operator=(const Frame&) = delete;
+        ~Frame() { this->env.top = this->parent; }
     };
 
 private:
-    std::vector<std::shared_ptr<EnvironmentLayer>> values;
+    const Frame* top = nullptr;
 
 public:
-    bool isSymbolBound(const std::shared_ptr<Symbol>& symbol) const;
-    template <typename InputIt>
-    void pushValues(InputIt first, InputIt second);
-    void pushValues(
-        const std::vector<std::shared_ptr<Symbol>>& symbols,
-        const std::vector<std::shared_ptr<Object>>& values);
-    void popValues();
-    std::shared_ptr<Object> getValue(const std::shared_ptr<Symbol>& symbol) const;
-    void setValue(const std::shared_ptr<Symbol>& symbol, const std::shared_ptr<Object>& value);
-};
+    // Lookups by name made so far by find, over every environment. Code
+    // resolved ahead of time makes none.
+    static uint64_t probes;
+
+    Environment() = default;
+    Environment(const Environment&) = delete;
+    Environment& operator=(const Environment&) = delete;
 
-template <typename InputIt>
-void Environment::EnvironmentLayer::insert(InputIt start, InputIt end)
-{
-    this->values.insert(start, end);
-}
-
-template <typename InputIt>
-void Environment::pushValues(InputIt first, InputIt second)
-{
-    std::shared_ptr<EnvironmentLayer> layer = std::make_shared<EnvironmentLayer>();
-    layer->insert(first, second);
-    this->values.push_back(layer);
-}
+    // Slot of the variable index of the frame depth frames out from the
+    // innermost one. Holds a Cell if the variable has been captured.
+    Ref<Object>& slot(uint32_t depth, uint32_t index) const
+    {
+        const Frame* frame = this->top;
+        for (; depth > 0; depth--)
+            frame = frame->parent;
+        return frame->slots[index];
+    }
+    // Value of the innermost variable named by symbol, or null if it is not
+    // lexically bound.
+    Ref<Object>* find(const Symbol* symbol) const;
+    // Scopes of the frames, from the innermost out.
+    std::vector<const Scope*> scopes() const;
+    // Whether the frames have exactly scopes, from the innermost out.
+    bool has_scopes(std::span<const Ref<Scope>> scopes) const;
+    // Cells of the variables at captures, moving their values into Cells
+    // first if needed.
+    std::vector<Ref<Object>> capture(std::span<const Capture> captures) const;
+
+    // Marks the symbols and values of every frame.
+    void trace(Tracer& tracer) const;
+};
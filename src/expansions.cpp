@@ -0,0 +1,71 @@
+
+#include "expansions.hpp"
+#include "annotations.hpp"
+#include "resolver.hpp"
+#include <utility>
+
+namespace {
+
+using Entry = Annotations::Entry;
+
+Entry* lookup(const Cons* form, const Procedure* macro)
+{
+    Entry* entry = Annotations::find(form);
+    if (!entry || !entry->macro || entry->macro.get() != macro)
+        return nullptr;
+    return entry;
+}
+
+bool same(std::span<const Ref<Environment::Scope>> held, std::span<const Environment::Scope* const> scopes)
+{
+    if (held.size() != scopes.size())
+        return false;
+    for (size_t i = 0; i < held.size(); i++)
+        if (held[i].get() != scopes[i])
+            return false;
+    return true;
+}
+
+void resolve(Entry& entry, std::span<const Environment::Scope* const> scopes)
+{
+    entry.resolved = Resolver::resolve_expansion(entry.expansion, scopes);
+    entry.scopes.clear();
+    for (const Environment::Scope* scope : scopes)
+        entry.scopes.emplace_back(const_cast<Environment::Scope*>(scope));
+}
+
+}
+
+Ref<Object> Expansions::find(const Cons* form, const Procedure* macro, std::span<const Environment::Scope* const> scopes)
+{
+    Entry* entry = lookup(form, macro);
+    if (!entry)
+        return nullptr;
+    if (!same(entry->scopes, scopes))
+        resolve(*entry, scopes);
+    return entry->resolved;
+}
+
+Ref<Object> Expansions::find(const Cons* form, const Procedure* macro, const Environment& env)
+{
+    Entry* entry = lookup(form, macro);
+    if (!entry)
+        return nullptr;
+    if (!env.has_scopes(entry->scopes))
+        resolve(*entry, env.scopes());
+    return entry->resolved;
+}
+
+Ref<Object> Expansions::record(const Cons* form, const Ref<Procedure>& macro, const Ref<Object>& expansion,
+    std::span<const Environment::Scope* const> scopes)
+{
+    Entry& entry = Annotations::at(form);
+    // The old expansion is dropped once the entry is consistent again, as
+    // the forms that die with it forget theirs.
+    Ref<Procedure> old_macro = std::exchange(entry.macro, macro);
+    Ref<Object> old_expansion = std::exchange(entry.expansion, expansion);
+    Ref<Object> old_resolved = std::move(entry.resolved);
+    std::vector<Ref<Environment::Scope>> old_scopes = std::move(entry.scopes);
+    resolve(entry, scopes);
+    return entry.resolved;
+}
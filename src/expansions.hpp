@@ -0,0 +1,29 @@
+
+#pragma once
+
+#include "environment.hpp"
+#include "objects.hpp"
+#include <span>
+
+// The expansions of macro calls, kept so that evaluating a call again
+// evaluates the expansion made the first time instead of running the macro
+// again. An expansion is only reused while the call would run the same
+// macro: once its symbol names another procedure, as after
+// set-symbol-function or a new defmacro, the call is expanded again.
+//
+// Expansions are kept resolved by the Resolver for the frames the call ran
+// in, so that their variables are read by slot. A call run in other frames,
+// as eval may do, resolves the expansion again without expanding it.
+//
+// They are kept in the Annotations of the calls, and die with them.
+namespace Expansions {
+// The expansion of form made by macro, resolved for code run in frames of
+// scopes, from the innermost out, or null if it has none.
+Ref<Object> find(const Cons* form, const Procedure* macro, std::span<const Environment::Scope* const> scopes);
+// Likewise, for code run in the frames of env.
+Ref<Object> find(const Cons* form, const Procedure* macro, const Environment& env);
+// Records expansion as the one of form made by macro, and returns it
+// resolved for scopes.
+Ref<Object> record(const Cons* form, const Ref<Procedure>& macro, const Ref<Object>& expansion,
+    std::span<const Environment::Scope* const> scopes);
+};
@@ -0,0 +1,446 @@
+
+#include "form_cache.hpp"
+#include "hash_cons.hpp"
+#include "heap.hpp"
+#include "mapped_file.hpp"
+#include "package.hpp"
+#include "source_map.hpp"
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+
+// Bump whenever the layout below or the forms the reader produces change.
+constexpr uint32_t format_version = 4;
+constexpr char magic[4] = { 'A', 'L', 'M', 'C' };
+
+struct Header {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_size;
+    uint64_t key[2];
+    // Hash of what follows, so that an entry damaged on disk is not loaded,
+    // nor its symbols interned.
+    uint64_t checksum[2];
+    // The image is followed by the end of each of its forms, as in Batch.
+    uint64_t image_size;
+    uint64_t end;
+    uint64_t stopped;
+};
+
+// Starts an image, followed by the symbol table and the forms.
+struct ImageHeader {
+    uint32_t symbols;
+    uint32_t forms;
+};
+
+enum Tag : uint8_t {
+    NilTag,
+    IntegerTag,
+    StringTag,
+    SymbolTag,
+    ListTag
+};
+
+// Packages a symbol may be interned in, as stored in the symbol table.
+enum PackageIndex : uint8_t {
+    CurrentPackage,
+    AlmaPackage
+};
+
+// --------------------------------------------------------------------------------
+
+uint64_t rotate(uint64_t x, unsigned bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+uint64_t finish(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+// 128 bit hash of the source. Four independent lanes so that hashing a
+// large file runs at memory speed; not meant to resist crafted inputs.
+void hash(std::string_view source, uint64_t key[2])
+{
+    static constexpr uint64_t k1 = 0x9e3779b97f4a7c15ull;
+    static constexpr uint64_t k2 = 0xc2b2ae3d27d4eb4full;
+
+    uint64_t lanes[4] = { k1, k2, k1 ^ source.size(), k2 ^ source.size() };
+    const char* p = source.data();
+    const char* end = p + source.size();
+    for (; end - p >= 32; p += 32) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t word;
+            std::memcpy(&word, p + 8 * i, 8);
+            lanes[i] = rotate(lanes[i] ^ (word * k1), 31) * k2;
+        }
+    }
+    for (int i = 0; p < end; i = (i + 1) % 4) {
+        uint64_t word = 0;
+        size_t size = std::min<size_t>(8, end - p);
+        std::memcpy(&word, p, size);
+        lanes[i] = rotate(lanes[i] ^ (word * k1), 31) * k2;
+        p += size;
+    }
+    key[0] = finish(lanes[0] ^ rotate(lanes[2], 17));
+    key[1] = finish(lanes[1] ^ rotate(lanes[3], 17));
+}
+
+// --------------------------------------------------------------------------------
+
+class Writer {
+private:
+    std::string& out;
+    std::unordered_map<const Symbol*, uint32_t> indices;
+
+public:
+    std::string symbol_table;
+    uint32_t symbol_count = 0;
+
+    Writer(std::string& _out)
+        : out(_out)
+    {
+    }
+
+    template <typename T>
+    static void put(std::string& out, T value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void put_text(std::string& out, std::string_view text)
+    {
+        put<uint32_t>(out, text.size());
+        out.append(text);
+    }
+
+    static bool interned_in(Package& package, const Symbol& sym)
+    {
+        std::optional<Ref<Symbol>> found = package.find_symbol(sym.name);
+        return found && found->get() == &sym;
+    }
+
+    bool symbol(const Symbol& sym)
+    {
+        auto [it, inserted] = this->indices.try_emplace(&sym, this->symbol_count);
+        if (inserted) {
+            PackageIndex package;
+            if (interned_in(*Package::currentPackage, sym))
+                package = CurrentPackage;
+            else if (interned_in(*Package::almaPackage, sym))
+                package = AlmaPackage;
+            else
+                return false;
+            put<uint8_t>(this->symbol_table, package);
+            put_text(this->symbol_table, sym.name);
+            this->symbol_count++;
+        }
+        put<uint8_t>(this->out, SymbolTag);
+        put<uint32_t>(this->out, it->second);
+        return true;
+    }
+
+    bool form(const Ref<Object>& obj)
+    {
+        if (std::optional<int64_t> integer = Object::integer_value(obj)) {
+            put<uint8_t>(this->out, IntegerTag);
+            put<int64_t>(this->out, *integer);
+        } else if (auto string = Object::cast<String>(obj)) {
+            put<uint8_t>(this->out, StringTag);
+            put_text(this->out, string->content);
+        } else if (auto sym = Object::cast<Symbol>(obj)) {
+            return this->symbol(*sym);
+        } else if (Object::cast<Nil>(obj)) {
+            put<uint8_t>(this->out, NilTag);
+        } else if (auto cons = Object::cast<Cons>(obj)) {
+            // The length is patched once the elements are written.
+            put<uint8_t>(this->out, ListTag);
+            size_t length_at = this->out.size();
+            put<uint32_t>(this->out, 0);
+            SourceLocation location = SourceMap::find(cons.get()).value_or(SourceLocation { 0, 0, 0 });
+            put<uint32_t>(this->out, location.line);
+            put<uint32_t>(this->out, location.column);
+
+            uint32_t length = 0;
+            const Cons* last = nullptr;
+            for (const Cons* cell = cons.get(); cell; cell = cell->next()) {
+                if (!this->form(cell->car))
+                    return false;
+                length++;
+                last = cell;
+            }
+            if (Object::is_true(last->cdr()))
+                return false; // Dotted lists are not read
+            std::memcpy(this->out.data() + length_at, &length, sizeof(length));
+        } else {
+            return false;
+        }
+        return true;
+    }
+};
+
+// --------------------------------------------------------------------------------
+
+struct Truncated { };
+
+class Loader {
+private:
+    const char* pos;
+    const char* end;
+    uint32_t file;
+    std::vector<Ref<Symbol>> symbols;
+    // Elements of the lists being built, innermost last.
+    std::vector<Ref<Object>> stack;
+
+public:
+    Loader(std::string_view data, uint32_t _file)
+        : pos(data.data())
+        , end(data.data() + data.size())
+        , file(_file)
+    {
+    }
+
+    template <typename T>
+    T take()
+    {
+        if (static_cast<size_t>(this->end - this->pos) < sizeof(T))
+            throw Truncated();
+        T value;
+        std::memcpy(&value, this->pos, sizeof(T));
+        this->pos += sizeof(T);
+        return value;
+    }
+
+    std::string_view take_text()
+    {
+        uint32_t size = this->take<uint32_t>();
+        if (static_cast<size_t>(this->end - this->pos) < size)
+            throw Truncated();
+        std::string_view text(this->pos, size);
+        this->pos += size;
+        return text;
+    }
+
+    bool at_end() const { return this->pos == this->end; }
+
+    // Throws unless count items of at least size bytes each may follow, so
+    // that a count is never trusted further than the bytes left.
+    void expect(uint32_t count, size_t size) const
+    {
+        if (count > static_cast<size_t>(this->end - this->pos) / size)
+            throw Truncated();
+    }
+
+    void symbol_table(uint32_t count)
+    {
+        this->expect(count, sizeof(uint8_t) + sizeof(uint32_t));
+        this->symbols.reserve(count);
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t package = this->take<uint8_t>();
+            std::string_view name = this->take_text();
+            if (package == CurrentPackage)
+                this->symbols.push_back(Package::currentPackage->intern_symbol(name));
+            else if (package == AlmaPackage)
+                this->symbols.push_back(Package::almaPackage->intern_symbol(name));
+            else
+                throw Truncated();
+        }
+    }
+
+    Ref<Object> form()
+    {
+        switch (this->take<uint8_t>()) {
+        case NilTag:
+            return Object::nil();
+        case IntegerTag:
+            return Object::integer(this->take<int64_t>());
+        case StringTag:
+            return make<String>(this->take_text());
+        case SymbolTag: {
+            uint32_t index = this->take<uint32_t>();
+            if (index >= this->symbols.size())
+                throw Truncated();
+            return this->symbols[index];
+        }
+        case ListTag:
+            return this->list();
+        default:
+            throw Truncated();
+        }
+    }
+
+    // Like the reader, only locates the first cell.
+    Ref<Object> list()
+    {
+        uint32_t length = this->take<uint32_t>();
+        uint32_t line = this->take<uint32_t>();
+        uint32_t column = this->take<uint32_t>();
+        if (length == 0)
+            throw Truncated();
+        this->expect(length, sizeof(uint8_t));
+
+        size_t base = this->stack.size();
+        for (uint32_t i = 0; i < length; i++) {
+            Ref<Object> element = this->form();
+            this->stack.push_back(std::move(element));
+        }
+
+        std::span<Ref<Object>> elements = std::span(this->stack).subspan(base);
+        if (HashCons::quoted(elements))
+            elements[1] = HashCons::canonical(elements[1]);
+        Ref<Cons> head = Cons::list(elements);
+        if (line != 0) {
+            head->located = true;
+            SourceMap::record(head.get(), { this->file, line, column });
+        }
+        this->stack.resize(base);
+        return head;
+    }
+};
+
+std::string hex(const uint64_t key[2])
+{
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string text;
+    for (int i = 0; i < 2; i++)
+        for (int shift = 60; shift >= 0; shift -= 4)
+            text.push_back(digits[(key[i] >> shift) & 0xf]);
+    return text;
+}
+
+}
+
+// --------------------------------------------------------------------------------
+
+FormCache::FormCache(const std::filesystem::path& dir, std::string_view source)
+    : source_size(source.size())
+{
+    hash(source, this->key);
+    this->entry = dir / (hex(this->key) + ".almc");
+}
+
+std::optional<reader::Batch> FormCache::load(uint32_t file) const
+{
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(this->entry, error))
+        return std::nullopt;
+
+    try {
+        MappedFile mapped(this->entry);
+        std::string_view contents = mapped.contents();
+        Header header;
+        if (contents.size() < sizeof(header))
+            return std::nullopt;
+        std::memcpy(&header, contents.data(), sizeof(header));
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != format_version
+            || header.source_size != this->source_size
+            || header.key[0] != this->key[0] || header.key[1] != this->key[1])
+            return std::nullopt;
+        std::string_view rest = contents.substr(sizeof(header));
+        uint64_t checksum[2];
+        hash(rest, checksum);
+        if (header.checksum[0] != checksum[0] || header.checksum[1] != checksum[1] || header.image_size > rest.size())
+            return std::nullopt;
+        std::optional<std::vector<Ref<Object>>> forms = load_image(rest.substr(0, header.image_size), file);
+        std::string_view ends = rest.substr(header.image_size);
+        if (!forms || ends.size() != forms->size() * sizeof(uint64_t))
+            return std::nullopt;
+
+        reader::Batch batch;
+        batch.forms = std::move(*forms);
+        for (size_t i = 0; i < batch.forms.size(); i++) {
+            uint64_t end;
+            std::memcpy(&end, ends.data() + i * sizeof(end), sizeof(end));
+            batch.ends.push_back(end);
+        }
+        batch.end = header.end;
+        batch.stopped = header.stopped != 0;
+        return batch;
+    } catch (const std::exception&) {
+        return std::nullopt; // Unreadable entry
+    }
+}
+
+void FormCache::store(const reader::Batch& batch) const
+{
+    std::optional<std::string> body = image(batch.forms);
+    if (!body)
+        return;
+    size_t image_size = body->size();
+    for (size_t end : batch.ends)
+        Writer::put<uint64_t>(*body, end);
+
+    Header header;
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = format_version;
+    header.source_size = this->source_size;
+    header.key[0] = this->key[0];
+    header.key[1] = this->key[1];
+    hash(*body, header.checksum);
+    header.image_size = image_size;
+    header.end = batch.end;
+    header.stopped = batch.stopped;
+
+    // Written aside and renamed into place, so that a concurrent reader
+    // never sees half an entry.
+    std::error_code error;
+    std::filesystem::create_directories(this->entry.parent_path(), error);
+    std::filesystem::path temporary = this->entry;
+    temporary += ".tmp" + std::to_string(::getpid());
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(body->data(), body->size());
+        if (!out) {
+            out.close();
+            std::filesystem::remove(temporary, error);
+            return;
+        }
+    }
+    std::filesystem::rename(temporary, this->entry, error);
+    if (error)
+        std::filesystem::remove(temporary, error);
+}
+
+std::optional<std::string> FormCache::image(const std::vector<Ref<Object>>& forms)
+{
+    std::string body;
+    Writer writer(body);
+    for (const Ref<Object>& form : forms)
+        if (!writer.form(form))
+            return std::nullopt;
+
+    ImageHeader header { writer.symbol_count, static_cast<uint32_t>(forms.size()) };
+    std::string image(reinterpret_cast<const char*>(&header), sizeof(header));
+    image += writer.symbol_table;
+    image += body;
+    return image;
+}
+
+std::optional<std::vector<Ref<Object>>> FormCache::load_image(std::string_view image, uint32_t file)
+{
+    try {
+        Loader loader(image, file);
+        ImageHeader header = loader.take<ImageHeader>();
+        loader.symbol_table(header.symbols);
+        loader.expect(header.forms, sizeof(uint8_t));
+        std::vector<Ref<Object>> forms;
+        forms.reserve(header.forms);
+        for (uint32_t i = 0; i < header.forms; i++)
+            forms.push_back(loader.form());
+        if (!loader.at_end())
+            return std::nullopt;
+        return forms;
+    } catch (const Truncated&) {
+        return std::nullopt;
+    }
+}
@@ -0,0 +1,46 @@
+
+#pragma once
+
+#include "objects.hpp"
+#include "reader.hpp"
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// On-disk cache of the batch of forms read from a source file, keyed by a
+// hash of its contents. An entry is a flat binary image of the forms:
+// integers and strings inline, symbols as indices into a table of (package,
+// name) pairs and lists as a length followed by their elements, then where
+// each form ends in the source. Loading it does no lexing at all. An entry whose image does not match the hash stored with
+// it, or whose counts run past its end, is a miss.
+//
+// Entries are only meaningful for the standard readtable and the current
+// package at the time they were written, and are in the byte order of the
+// machine that wrote them.
+class FormCache {
+private:
+    std::filesystem::path entry;
+    uint64_t source_size;
+    uint64_t key[2];
+
+public:
+    FormCache(const std::filesystem::path& dir, std::string_view source);
+
+    // The cached batch of forms, or nullopt when there is no usable entry.
+    // Lists are located in `file`.
+    std::optional<reader::Batch> load(uint32_t file) const;
+    // Writes an entry for a batch read from the source. Does nothing if its
+    // forms hold objects the reader cannot produce, or if the entry cannot
+    // be written.
+    void store(const reader::Batch& batch) const;
+
+    // The forms as an entry holds them, without its header: a symbol table
+    // followed by the forms. nullopt if they hold objects the reader cannot
+    // produce.
+    static std::optional<std::string> image(const std::vector<Ref<Object>>& forms);
+    // The forms of an image, or nullopt if it is malformed. Lists are
+    // located in `file`.
+    static std::optional<std::vector<Ref<Object>>> load_image(std::string_view image, uint32_t file);
+};
@@ -1,12 +1,16 @@
 
 #include "function.hpp"
+#include "compiler.hpp"
+#include "heap.hpp"
 #include "objects.hpp"
 #include "package.hpp"
+#include "reader.hpp"
+#include "source_map.hpp"
 #include <iostream>
 
 #define intern_function(name, sym_name)                                                   \
-    std::shared_ptr<Symbol>& name##_func = Package::almaPackage->intern_symbol(sym_name); \
-    name##_func->function = std::make_shared<name>(sym_name);
+    Ref<Symbol>& name##_func = Package::almaPackage->intern_symbol(sym_name); \
+    name##_func->function = make<name>(sym_name);
 
 void intern_functions()
 {
@@ -21,30 +25,35 @@ void intern_functions()
     intern_function(setq, "setq");
     intern_function(eq, "eq");
     intern_function(eql, "eql");
+    intern_function(equal, "equal");
+    intern_function(sxhash, "sxhash");
     intern_function(macroexpand_1, "macroexpand-1");
     intern_function(eval, "eval");
+    intern_function(set_macro_character, "set-macro-character");
+    intern_function(source_location, "source-location");
+    intern_function(lexical_probes, "lexical-probes");
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> sum::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> sum::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     int64_t sum_value = 0;
-    for (const std::shared_ptr<Object>& arg : args) {
-        std::shared_ptr<Integer> value = std::dynamic_pointer_cast<Integer>(arg);
+    for (const Ref<Object>& arg : args) {
+        std::optional<int64_t> value = Object::integer_value(arg);
         if (!value)
             throw std::runtime_error("Expected an integer");
-        sum_value += value->value;
+        sum_value += *value;
     }
 
-    return std::make_shared<Integer>(sum_value);
+    return Object::integer(sum_value);
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> print::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> print::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     if (args.size() != 1)
         throw std::runtime_error("Expected only one argument.");
@@ -56,39 +65,41 @@ std::shared_ptr<Object> print::eval_body(
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> typep::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> typep::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     if (args.size() != 2)
         throw std::runtime_error("Expected two arguments.");
 
-    std::shared_ptr<Symbol> sym = std::dynamic_pointer_cast<Symbol>(args[1]);
+    Ref<Symbol> sym = Object::cast<Symbol>(args[1]);
     if (!sym)
         throw std::runtime_error("The second argument must be a symbol.");
 
     if (Object::typep(args[0], sym)) {
-        return (*Package::almaPackage->find_symbol("t"))->values.back();
+        return Object::t();
     } else {
-        return (*Package::almaPackage->find_symbol("nil"))->values.back();
+        return Object::nil();
     }
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> set_symbol_function::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> set_symbol_function::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     if (args.size() != 2)
         throw std::runtime_error("Expected two arguments.");
 
-    std::shared_ptr<Symbol> sym = std::dynamic_pointer_cast<Symbol>(args[0]);
+    Ref<Symbol> sym = Object::cast<Symbol>(args[0]);
     if (!sym)
         throw std::runtime_error("The first argument must be a symbol.");
 
-    std::shared_ptr<Procedure> proc = std::dynamic_pointer_cast<Procedure>(args[1]);
+    Ref<Procedure> proc = Object::cast<Procedure>(args[1]);
     if (!proc)
         throw std::runtime_error("The second argument must be a valid procedure.");
 
+    if (Object::is<Macro>(sym->function) && sym->function != proc)
+        Compiler::redefinitions++;
     sym->function = proc;
 
     return proc;
@@ -96,17 +107,17 @@ std::shared_ptr<Object> set_symbol_function::eval_body(
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> set_symbol_package::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> set_symbol_package::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     if (args.size() != 2)
         throw std::runtime_error("Expected two arguments.");
 
-    std::shared_ptr<Symbol> sym = std::dynamic_pointer_cast<Symbol>(args[0]);
+    Ref<Symbol> sym = Object::cast<Symbol>(args[0]);
     if (!sym)
         throw std::runtime_error("The first argument must be a symbol.");
 
-    std::shared_ptr<Package> package = std::dynamic_pointer_cast<Package>(args[1]);
+    Ref<Package> package = Object::cast<Package>(args[1]);
     if (!package)
         throw std::runtime_error("The second argument must be a valid package.");
 
@@ -117,20 +128,20 @@ std::shared_ptr<Object> set_symbol_package::eval_body(
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> setq::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env)
+Ref<Object> setq::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env)
 {
     if (args.size() != 2)
         throw std::runtime_error("Expected two arguments.");
 
-    std::shared_ptr<Symbol> sym = std::dynamic_pointer_cast<Symbol>(args[0]);
+    Ref<Symbol> sym = Object::cast<Symbol>(args[0]);
     if (!sym)
         throw std::runtime_error("The first argument must be a symbol.");
 
-    if (lex_env.isSymbolBound(sym))
-        lex_env.setValue(sym, args[1]);
-    else if (!sym->values.empty())
-        sym->values.back() = args[1];
+    if (Ref<Object>* slot = lex_env.find(sym.get()))
+        *slot = args[1];
+    else if (sym->value)
+        sym->value = args[1];
     else
         throw std::runtime_error("The symbol " + sym->name + " is not bound.");
 
@@ -139,8 +150,8 @@ std::shared_ptr<Object> setq::eval_body(
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> emit::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> emit::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     if (args.size() != 1)
         throw std::runtime_error("Expected one argument.");
@@ -152,87 +163,111 @@ std::shared_ptr<Object> emit::eval_body(
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> car::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> car::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     if (args.size() != 1)
         throw std::runtime_error("Expected one argument.");
 
-    std::shared_ptr<Cons> pair = std::dynamic_pointer_cast<Cons>(args[0]);
-    if (!pair)
+    if (!Object::is<Cons>(args[0]))
         throw std::runtime_error("Expected a cons.");
 
-    return pair->car;
+    return Object::as<Cons>(args[0])->car;
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> cdr::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> cdr::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     if (args.size() != 1)
         throw std::runtime_error("Expected one argument.");
 
-    std::shared_ptr<Cons> pair = std::dynamic_pointer_cast<Cons>(args[0]);
-    if (!pair)
+    if (!Object::is<Cons>(args[0]))
         throw std::runtime_error("Expected a cons.");
 
-    return pair->cdr;
+    return Object::as<Cons>(args[0])->cdr();
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> eq::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> eq::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     if (args.size() != 2)
         throw std::runtime_error("Expected two arguments.");
 
     if (Object::eq(args[0], args[1]))
-        return *Package::almaPackage->find_symbol("t");
+        return Object::t();
     else
-        return std::make_shared<Nil>();
+        return Object::nil();
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> eql::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> eql::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     if (args.size() != 2)
         throw std::runtime_error("Expected two arguments.");
 
-    std::shared_ptr<Integer> i1 = std::dynamic_pointer_cast<Integer>(args[0]);
-    std::shared_ptr<Integer> i2 = std::dynamic_pointer_cast<Integer>(args[1]);
+    std::optional<int64_t> i1 = Object::integer_value(args[0]);
+    std::optional<int64_t> i2 = Object::integer_value(args[1]);
 
     if (!i1 || !i2)
         throw std::runtime_error("Expected integers as arguments");
 
-    if (i1->value == i2->value)
-        return *Package::almaPackage->find_symbol("t");
+    if (*i1 == *i2)
+        return Object::t();
     else
-        return std::make_shared<Nil>();
+        return Object::nil();
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> macroexpand_1::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env)
+Ref<Object> equal::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
+{
+    if (args.size() != 2)
+        throw std::runtime_error("Expected two arguments.");
+
+    if (Object::equal(args[0], args[1]))
+        return Object::t();
+    else
+        return Object::nil();
+}
+
+// --------------------------------------------------------------------------------
+
+Ref<Object> sxhash::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
     if (args.size() != 1)
         throw std::runtime_error("Expected one argument.");
 
-    std::shared_ptr<Cons> macroList = std::dynamic_pointer_cast<Cons>(args[0]);
+    // Kept non-negative and within the fixnum range.
+    return Object::integer(static_cast<int64_t>(Object::sxhash(args[0]) >> 2));
+}
+
+// --------------------------------------------------------------------------------
+
+Ref<Object> macroexpand_1::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env)
+{
+    if (args.size() != 1)
+        throw std::runtime_error("Expected one argument.");
+
+    Ref<Cons> macroList = Object::cast<Cons>(args[0]);
     if (!macroList)
         throw std::runtime_error("Expected a list");
 
-    std::shared_ptr<Symbol> macroname = std::dynamic_pointer_cast<Symbol>(macroList->car);
+    Ref<Symbol> macroname = Object::cast<Symbol>(macroList->car);
     if (!macroname)
         throw std::runtime_error("Expected a symbol as the first element");
 
-    std::shared_ptr<Macro> macro = std::dynamic_pointer_cast<Macro>(macroname->function);
+    Ref<Macro> macro = Object::cast<Macro>(macroname->function);
     if (macro) {
-        std::shared_ptr<Cons> macroargs = std::dynamic_pointer_cast<Cons>(macroList->cdr);
+        Ref<Cons> macroargs = Object::cast<Cons>(macroList->cdr());
         if (!macroargs)
             throw std::runtime_error("Expected a list of arguments to the macro");
         return macro->expand(lex_env, macroargs->toList());
@@ -243,11 +278,57 @@ std::shared_ptr<Object> macroexpand_1::eval_body(
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> eval::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env)
+Ref<Object> eval::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env)
 {
     if (args.size() != 1)
         throw std::runtime_error("Expected one argument.");
 
     return Object::eval(args[0], lex_env);
 }
+
+// --------------------------------------------------------------------------------
+
+Ref<Object> set_macro_character::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
+{
+    if (args.size() != 2)
+        throw std::runtime_error("Expected two arguments.");
+
+    Ref<String> character = Object::cast<String>(args[0]);
+    if (!character || character->content.size() != 1)
+        throw std::runtime_error("The first argument must be a string with one character.");
+
+    Ref<Procedure> proc = Object::cast<Procedure>(args[1]);
+    if (!proc)
+        throw std::runtime_error("The second argument must be a valid procedure.");
+
+    reader::set_macro_character(character->content[0], proc);
+
+    return proc;
+}
+
+// --------------------------------------------------------------------------------
+
+Ref<Object> source_location::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
+{
+    if (args.size() != 1)
+        throw std::runtime_error("Expected one argument.");
+
+    std::optional<std::string> location = SourceMap::describe(args[0].get());
+    if (!location)
+        return Object::nil();
+    return make<String>(*location);
+}
+
+// --------------------------------------------------------------------------------
+
+Ref<Object> lexical_probes::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
+{
+    if (!args.empty())
+        throw std::runtime_error("Expected no arguments.");
+
+    return Object::integer(static_cast<int64_t>(Environment::probes));
+}
@@ -15,7 +15,7 @@ void intern_functions();
         }                                                                                           \
                                                                                                     \
     protected:                                                                                      \
-        virtual std::shared_ptr<Object> eval_body(const std::vector<std::shared_ptr<Object>>& args, \
+        virtual Ref<Object> eval_body(std::span<const Ref<Object>> args, \
             Environment& lex_env) override;                                                         \
     }
 
@@ -30,5 +30,10 @@ declare_function(car);
 declare_function(cdr);
 declare_function(eq);
 declare_function(eql);
+declare_function(equal);
+declare_function(sxhash);
 declare_function(macroexpand_1);
 declare_function(eval);
+declare_function(set_macro_character);
+declare_function(source_location);
+declare_function(lexical_probes);
@@ -0,0 +1,163 @@
+
+#include "hash_cons.hpp"
+#include "package.hpp"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+// Lists are looked up by the identity of their elements, which are
+// canonical themselves by the time their list is.
+struct ElementsHash {
+    size_t operator()(const Cons* list) const
+    {
+        size_t hash = 0;
+        for (const Cons* cell = list; cell; cell = cell->next())
+            hash = hash * 31 + std::hash<const Object*>()(cell->car.get());
+        return hash;
+    }
+};
+
+struct ElementsEqual {
+    bool operator()(const Cons* a, const Cons* b) const
+    {
+        while (a && b) {
+            if (a->car != b->car)
+                return false;
+            a = a->next();
+            b = b->next();
+        }
+        return a == b;
+    }
+};
+
+struct Table {
+    std::atomic<bool> enabled = false;
+    std::mutex mutex;
+    std::unordered_set<Cons*, ElementsHash, ElementsEqual> lists;
+    std::unordered_map<std::string_view, Ref<String>> strings;
+    std::unordered_map<int64_t, Ref<Integer>> integers;
+};
+
+// The canonical copy of every constant made canonical so far.
+Table& table = *new Table;
+
+// A list whose elements are being made canonical.
+struct Frame {
+    Ref<Cons> list;
+    Cons* cell; // Whose car comes next
+    Cons* last = nullptr;
+    bool proper = true; // Whether neither it nor any list in it is dotted
+};
+
+Ref<Object> canonical_atom(const Ref<Object>& obj)
+{
+    if (Object::is<String>(obj)) {
+        auto [it, inserted] = table.strings.emplace(Object::as<String>(obj)->content, nullptr);
+        if (inserted) {
+            it->second = Object::cast<String>(obj);
+            it->second->pin();
+        }
+        return it->second;
+    }
+    if (Object::is<Integer>(obj)) {
+        auto [it, inserted] = table.integers.emplace(Object::as<Integer>(obj)->value, nullptr);
+        if (inserted) {
+            it->second = Object::cast<Integer>(obj);
+            it->second->pin();
+        }
+        return it->second;
+    }
+    return obj;
+}
+
+// Makes the lists in list canonical from the innermost out, keeping a
+// stack of them instead of recursing.
+Ref<Object> canonical_list(const Ref<Cons>& list)
+{
+    std::vector<Frame> frames;
+    frames.push_back({ list, list.get() });
+    while (true) {
+        Frame& frame = frames.back();
+        if (frame.cell) {
+            Ref<Object>& car = frame.cell->car;
+            if (Object::is<Cons>(car) && !Object::as<Cons>(car)->canonical) {
+                Ref<Cons> sublist = Object::cast<Cons>(car);
+                Cons* first = sublist.get();
+                frames.push_back({ std::move(sublist), first });
+                continue;
+            }
+            car = canonical_atom(car);
+            frame.last = frame.cell;
+            frame.cell = const_cast<Cons*>(frame.cell->next());
+            continue;
+        }
+
+        Ref<Object> result = frame.list;
+        bool proper = frame.proper && Object::is<Nil>(frame.last->cdr());
+        if (proper) {
+            auto [it, inserted] = table.lists.insert(frame.list.get());
+            if (inserted) {
+                frame.list->canonical = true;
+                frame.list->pin();
+            }
+            result = Ref<Cons>(*it);
+        }
+        frames.pop_back();
+        if (frames.empty())
+            return result;
+
+        Frame& outer = frames.back();
+        outer.proper = outer.proper && proper;
+        outer.cell->car = std::move(result);
+        outer.last = outer.cell;
+        outer.cell = const_cast<Cons*>(outer.cell->next());
+    }
+}
+
+}
+
+void HashCons::enable()
+{
+    table.enabled = true;
+}
+
+bool HashCons::enabled()
+{
+    return table.enabled;
+}
+
+Ref<Object> HashCons::canonical(const Ref<Object>& obj)
+{
+    if (!table.enabled)
+        return obj;
+    std::lock_guard lock(table.mutex);
+    if (!Object::is<Cons>(obj))
+        return canonical_atom(obj);
+    if (Object::as<Cons>(obj)->canonical)
+        return obj;
+    return canonical_list(Object::cast<Cons>(obj));
+}
+
+bool HashCons::quoted(std::span<const Ref<Object>> form)
+{
+    if (!table.enabled)
+        return false;
+    static const Ref<Object> quote = *Package::almaPackage->find_symbol("quote");
+    return form.size() == 2 && form[0] == quote;
+}
+
+void HashCons::trace(Tracer& tracer)
+{
+    std::lock_guard lock(table.mutex);
+    for (const Cons* list : table.lists)
+        tracer.mark(list);
+    for (const auto& [content, string] : table.strings)
+        tracer.mark(string);
+    for (const auto& [value, integer] : table.integers)
+        tracer.mark(integer);
+}
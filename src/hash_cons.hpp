@@ -0,0 +1,27 @@
+
+#pragma once
+
+#include "heap.hpp"
+#include "objects.hpp"
+#include <span>
+
+// Optional table of canonical copies of constant data: quoted lists,
+// strings and integers produced by the reader and by quasiquote. Equal
+// constants are shared, so large tables of generated constants are stored
+// once, and equal on two canonical lists is a pointer comparison.
+//
+// Canonical objects are pinned and live as long as the program, like
+// interned symbols. Lists ending in a dotted pair are left as they are.
+namespace HashCons {
+// Turns the table on. Until then canonical returns its argument.
+void enable();
+bool enabled();
+// The canonical object equal to obj. Lists inside obj are made canonical
+// in place, and obj itself becomes canonical if no equal one is known.
+// Safe to call from several threads at once.
+Ref<Object> canonical(const Ref<Object>& obj);
+// Whether the table is on and form is (quote x), whose x should then be
+// replaced by its canonical copy.
+bool quoted(std::span<const Ref<Object>> form);
+void trace(Tracer& tracer);
+};
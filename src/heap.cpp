@@ -0,0 +1,416 @@
+
+#include "heap.hpp"
+#include "argument_stack.hpp"
+#include "dynamic_scope.hpp"
+#include "hash_cons.hpp"
+#include "package.hpp"
+#include "reader.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <mutex>
+#include <pthread.h>
+#include <unordered_map>
+
+void Tracer::drain()
+{
+    while (!this->pending.empty()) {
+        const Object* obj = this->pending.back();
+        this->pending.pop_back();
+        obj->trace_impl(*this);
+    }
+}
+
+bool Tracer::first_visit(const void* other)
+{
+    return this->seen.insert(other).second;
+}
+
+// --------------------------------------------------------------------------------
+
+#ifndef ALMA_MANAGED_HEAP
+
+void Tracer::mark(const Object* obj [[maybe_unused]])
+{
+}
+
+void Tracer::mark_within(const void* memory [[maybe_unused]])
+{
+}
+
+#else
+
+namespace {
+
+constexpr size_t granule = 16;
+constexpr size_t classes = 32;
+constexpr size_t max_small = granule * classes;
+constexpr size_t chunk_size = 256 * 1024;
+constexpr size_t max_slots = chunk_size / granule;
+constexpr size_t words = max_slots / 64;
+
+// Collect once this much has been handed out since the last collection,
+// or as much as survived it, whichever is larger.
+constexpr size_t min_collect = 8 << 20;
+
+// Slots of one size, preceded by their bitmaps. Chunks are aligned to their
+// size, so the chunk of an object is found by masking its address.
+struct Chunk {
+    uint32_t size_class;
+    uint32_t slot_size;
+    uint32_t slots;
+    uint32_t cursor = 0; // Allocation resumes here
+    uint32_t free_slots;
+    uint64_t allocated[words] = {};
+    uint64_t marked[words] = {};
+
+    char* slot(size_t i) { return reinterpret_cast<char*>(this) + first_slot() + i * this->slot_size; }
+    size_t index(const void* memory) const
+    {
+        return (static_cast<const char*>(memory) - reinterpret_cast<const char*>(this) - first_slot()) / this->slot_size;
+    }
+    static constexpr size_t first_slot() { return (sizeof(Chunk) + granule - 1) / granule * granule; }
+
+    // Next slot past the cursor that holds no object. It only counts as
+    // allocated once committed.
+    void* next_free()
+    {
+        while (this->cursor < this->slots) {
+            size_t word = this->cursor / 64;
+            uint64_t free = ~this->allocated[word] & (~uint64_t(0) << (this->cursor % 64));
+            if (free) {
+                size_t i = word * 64 + std::countr_zero(free);
+                if (i >= this->slots)
+                    break;
+                this->cursor = i + 1;
+                return this->slot(i);
+            }
+            this->cursor = (word + 1) * 64;
+        }
+        this->cursor = this->slots;
+        return nullptr;
+    }
+};
+
+// An object too large for a chunk, allocated on its own.
+struct Large {
+    size_t size;
+    bool marked = false;
+};
+
+struct HeapState {
+    std::mutex mutex;
+    std::unordered_set<Chunk*> chunks;
+    std::vector<Chunk*> available[classes];
+    std::unordered_map<const Object*, Large> large;
+    // Where each large object starts and its size, by address, while a
+    // collection looks for the objects words point into.
+    std::vector<std::pair<uintptr_t, size_t>> ranges;
+    size_t allocated_since = 0;
+    size_t live = 0;
+    // Bumped by every collection, which invalidates the chunks threads are
+    // allocating from.
+    uint64_t epoch = 0;
+};
+
+// The arenas of every object made by make<T>.
+HeapState& heap = *new HeapState;
+
+// The chunk each thread allocates from, per size class.
+struct Local {
+    uint64_t epoch = 0;
+    Chunk* current[classes] = {};
+};
+
+thread_local Local local;
+
+thread_local const Heap::TopLevel* top_level = nullptr;
+thread_local const Heap::Root* root = nullptr;
+thread_local size_t holds = 0;
+
+Chunk* chunk_of(const void* memory)
+{
+    return reinterpret_cast<Chunk*>(reinterpret_cast<uintptr_t>(memory) & ~(chunk_size - 1));
+}
+
+Chunk* acquire(size_t size_class)
+{
+    std::lock_guard lock(heap.mutex);
+    std::vector<Chunk*>& available = heap.available[size_class];
+    Chunk* chunk;
+    if (!available.empty()) {
+        chunk = available.back();
+        available.pop_back();
+    } else {
+        void* memory = std::aligned_alloc(chunk_size, chunk_size);
+        if (!memory)
+            throw std::bad_alloc();
+        chunk = new (memory) Chunk;
+        chunk->size_class = size_class;
+        chunk->slot_size = (size_class + 1) * granule;
+        chunk->slots = std::min(max_slots, (chunk_size - Chunk::first_slot()) / chunk->slot_size);
+        chunk->free_slots = chunk->slots;
+        heap.chunks.insert(chunk);
+    }
+    heap.allocated_since += chunk->free_slots * chunk->slot_size;
+    return chunk;
+}
+
+void sweep()
+{
+    size_t live = 0;
+    for (std::vector<Chunk*>& available : heap.available)
+        available.clear();
+
+    for (auto it = heap.chunks.begin(); it != heap.chunks.end();) {
+        Chunk* chunk = *it;
+        size_t used = 0;
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t dead = chunk->allocated[w] & ~chunk->marked[w]; dead; dead &= dead - 1) {
+                Object* obj = reinterpret_cast<Object*>(chunk->slot(w * 64 + std::countr_zero(dead)));
+                obj->~Object();
+            }
+            chunk->allocated[w] = chunk->marked[w];
+            chunk->marked[w] = 0;
+            used += std::popcount(chunk->allocated[w]);
+        }
+        chunk->cursor = 0;
+        chunk->free_slots = chunk->slots - used;
+        live += used * chunk->slot_size;
+
+        if (used == 0) {
+            std::free(chunk);
+            it = heap.chunks.erase(it);
+            continue;
+        }
+        if (used < chunk->slots)
+            heap.available[chunk->size_class].push_back(chunk);
+        it++;
+    }
+
+    for (auto it = heap.large.begin(); it != heap.large.end();) {
+        auto [obj, large] = *it;
+        if (!large.marked) {
+            const_cast<Object*>(obj)->~Object();
+            ::operator delete(const_cast<Object*>(obj));
+            it = heap.large.erase(it);
+        } else {
+            it->second.marked = false;
+            it++;
+        }
+    }
+
+    heap.live = live;
+    heap.allocated_since = 0;
+    heap.epoch++;
+}
+
+}
+
+void Tracer::mark(const Object* obj)
+{
+    if (!obj || reinterpret_cast<uintptr_t>(obj) & 1)
+        return;
+
+    Chunk* chunk = chunk_of(obj);
+    if (heap.chunks.contains(chunk)) {
+        size_t i = chunk->index(obj);
+        uint64_t bit = uint64_t(1) << (i % 64);
+        if (chunk->marked[i / 64] & bit)
+            return;
+        chunk->marked[i / 64] |= bit;
+        // Traced through the object at the start of the slot, which for a
+        // cell of a compact list is the first cell of its run.
+        obj = reinterpret_cast<const Object*>(chunk->slot(i));
+    } else {
+        auto it = heap.large.find(obj);
+        if (it == heap.large.end() || it->second.marked)
+            return; // Static objects such as nil have nothing to trace
+        it->second.marked = true;
+    }
+    this->pending.push_back(obj);
+}
+
+void* Heap::allocate(size_t size)
+{
+    if (size > max_small)
+        return ::operator new(size);
+
+    if (local.epoch != heap.epoch) {
+        local = Local();
+        local.epoch = heap.epoch;
+    }
+    size_t size_class = (size - 1) / granule;
+    Chunk*& chunk = local.current[size_class];
+    while (true) {
+        if (chunk)
+            if (void* memory = chunk->next_free())
+                return memory;
+        chunk = acquire(size_class);
+    }
+}
+
+void Heap::commit(Object* obj, size_t size)
+{
+    if (size > max_small) {
+        std::lock_guard lock(heap.mutex);
+        heap.large.emplace(obj, Large { size });
+        heap.allocated_since += size;
+        return;
+    }
+    Chunk* chunk = chunk_of(obj);
+    size_t i = chunk->index(obj);
+    chunk->allocated[i / 64] |= uint64_t(1) << (i % 64);
+}
+
+Heap::TopLevel::TopLevel(const Environment& _lex_env, std::span<const Ref<Object>> _forms)
+    : lex_env(_lex_env)
+    , forms(_forms)
+    , outer(top_level)
+{
+    top_level = this;
+}
+
+Heap::TopLevel::~TopLevel()
+{
+    top_level = this->outer;
+}
+
+void Heap::TopLevel::trace(Tracer& tracer) const
+{
+    for (const TopLevel* it = this; it; it = it->outer) {
+        it->lex_env.trace(tracer);
+        for (const Ref<Object>& form : it->forms)
+            tracer.mark(form);
+    }
+}
+
+Heap::Root::Root(Trace _trace_data, const void* _data)
+    : trace_data(_trace_data)
+    , data(_data)
+    , outer(root)
+{
+    root = this;
+}
+
+Heap::Root::Root(const std::vector<Ref<Object>>& objects)
+    : Root([](Tracer& tracer, const void* vector) {
+        for (const Ref<Object>& obj : *static_cast<const std::vector<Ref<Object>>*>(vector))
+            tracer.mark(obj);
+    },
+        &objects)
+{
+}
+
+Heap::Root::~Root()
+{
+    root = this->outer;
+}
+
+void Heap::Root::trace(Tracer& tracer) const
+{
+    for (const Root* it = this; it; it = it->outer)
+        it->trace_data(tracer, it->data);
+}
+
+namespace {
+
+// The object memory points into, or null if it does not point into one.
+const Object* object_at(uintptr_t memory)
+{
+    Chunk* chunk = chunk_of(reinterpret_cast<const void*>(memory));
+    if (heap.chunks.contains(chunk)) {
+        if (memory < reinterpret_cast<uintptr_t>(chunk) + Chunk::first_slot())
+            return nullptr;
+        size_t i = chunk->index(reinterpret_cast<const void*>(memory));
+        if (i >= chunk->slots || !(chunk->allocated[i / 64] & uint64_t(1) << (i % 64)))
+            return nullptr;
+        return reinterpret_cast<const Object*>(chunk->slot(i));
+    }
+    auto it = std::upper_bound(heap.ranges.begin(), heap.ranges.end(), std::pair(memory, ~size_t(0)));
+    if (it == heap.ranges.begin() || memory >= (it - 1)->first + (it - 1)->second)
+        return nullptr;
+    return reinterpret_cast<const Object*>((it - 1)->first);
+}
+
+uintptr_t stack_end()
+{
+    static thread_local uintptr_t end = [] {
+        pthread_attr_t attributes;
+        void* base;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attributes) != 0)
+            throw std::runtime_error("Could not find the stack of the thread");
+        pthread_attr_getstack(&attributes, &base, &size);
+        pthread_attr_destroy(&attributes);
+        return reinterpret_cast<uintptr_t>(base) + size;
+    }();
+    return end;
+}
+
+// Marks whatever the words of the stack from here out point into, since
+// the frames of the evaluator hold references the collector cannot tell
+// apart from other words. Reading the whole stack reads past the objects
+// of the frames on it, which the address sanitizer must allow.
+[[gnu::noinline, gnu::no_sanitize_address]] void scan_words(Tracer& tracer)
+{
+    uintptr_t end = stack_end();
+    uintptr_t word = reinterpret_cast<uintptr_t>(__builtin_frame_address(0)) & ~(sizeof(uintptr_t) - 1);
+    for (; word < end; word += sizeof(uintptr_t))
+        tracer.mark_within(*reinterpret_cast<const void* const*>(word));
+}
+
+// Spills the registers of the caller onto the stack before scanning it.
+[[gnu::noinline]] void scan_stack(Tracer& tracer)
+{
+    __builtin_unwind_init();
+    scan_words(tracer);
+}
+
+}
+
+void Tracer::mark_within(const void* memory)
+{
+    if (const Object* obj = object_at(reinterpret_cast<uintptr_t>(memory)))
+        this->mark(obj);
+}
+
+Heap::Hold::Hold()
+{
+    holds++;
+}
+
+Heap::Hold::~Hold()
+{
+    holds--;
+}
+
+void Heap::safepoint()
+{
+    if (!top_level || holds || heap.allocated_since < std::max(min_collect, heap.live))
+        return;
+
+    for (const auto& [obj, large] : heap.large)
+        heap.ranges.emplace_back(reinterpret_cast<uintptr_t>(obj), large.size);
+    std::sort(heap.ranges.begin(), heap.ranges.end());
+
+    Tracer tracer;
+    tracer.mark(Package::almaPackage);
+    tracer.mark(Package::currentPackage);
+    reader::trace(tracer);
+    HashCons::trace(tracer);
+    DynamicScope::trace(tracer);
+    top_level->trace(tracer);
+    if (root)
+        root->trace(tracer);
+    ArgumentStack::current().trace(tracer);
+    VM::trace(tracer);
+    scan_stack(tracer);
+    tracer.drain();
+
+    heap.ranges.clear();
+    sweep();
+}
+
+#endif
@@ -0,0 +1,151 @@
+
+#pragma once
+
+#include "objects.hpp"
+#include <new>
+#include <span>
+#include <unordered_set>
+#include <vector>
+
+// Objects are created with make<T>. Built with ALMA_MANAGED_HEAP they live in
+// arenas owned by a mark-sweep collector, and Refs to them do not count.
+// Otherwise they are freed when their reference count drops to zero.
+//
+// The collector runs at safepoints: between top-level forms and at the calls
+// made while they are evaluated, by the VM and by the tree walker. Only the
+// thread running a TopLevel collects. Live objects are then reachable from
+// the packages, the readtable, the TopLevels, the argument stack, the
+// activations of the VM, the Roots or, conservatively, from a word on the
+// C++ stack of that thread.
+//
+// Objects still alive at exit die after the statics of the translation
+// units they reach as they do, such as the side tables that forget them.
+// Those tables, and this heap, are allocated with new and never destroyed.
+
+// Marks the objects reachable from what it is given.
+class Tracer {
+private:
+    std::vector<const Object*> pending;
+    std::unordered_set<const void*> seen;
+
+public:
+    void mark(const Object* obj);
+    template <typename T>
+    void mark(const Ref<T>& obj)
+    {
+        this->mark(static_cast<const Object*>(obj.get()));
+    }
+    // Marks the object memory points into, if it points into one. For words
+    // that may or may not be references.
+    void mark_within(const void* memory);
+    // True the first time it is called for other. For structures that are
+    // not objects but may be shared, like environment layers.
+    bool first_visit(const void* other);
+    void drain();
+};
+
+namespace Heap {
+#ifdef ALMA_MANAGED_HEAP
+// Storage for an object of the given size. It is only considered in use
+// once the object constructed in it is committed.
+void* allocate(size_t size);
+void commit(Object* obj, size_t size);
+
+// The environment and the forms of a loop evaluating top-level forms,
+// roots for as long as it lives. Lets the thread that created it collect.
+class TopLevel {
+private:
+    const Environment& lex_env;
+    std::span<const Ref<Object>> forms;
+    const TopLevel* outer;
+
+public:
+    TopLevel(const Environment& _lex_env, std::span<const Ref<Object>> _forms);
+    TopLevel(const TopLevel&) = delete;
+    TopLevel& operator=(const TopLevel&) = delete;
+    ~TopLevel();
+
+    // Marks what it and the ones created before it on its thread hold.
+    void trace(Tracer& tracer) const;
+};
+
+// Objects held where the collector does not look, such as in the elements
+// of a vector, kept as roots for as long as it lives. Roots must be
+// destroyed in the reverse order they were created in.
+class Root {
+public:
+    using Trace = void (*)(Tracer& tracer, const void* data);
+
+private:
+    Trace trace_data;
+    const void* data;
+    const Root* outer;
+
+public:
+    Root(Trace _trace_data, const void* _data);
+    Root(const std::vector<Ref<Object>>& objects);
+    Root(const Root&) = delete;
+    Root& operator=(const Root&) = delete;
+    ~Root();
+
+    // Marks what it and the ones created before it on its thread hold.
+    void trace(Tracer& tracer) const;
+};
+
+// Keeps the calling thread from collecting for as long as it lives, while
+// it runs code with objects held only where the collector does not look,
+// such as in the code being compiled.
+class Hold {
+public:
+    Hold();
+    Hold(const Hold&) = delete;
+    Hold& operator=(const Hold&) = delete;
+    ~Hold();
+};
+
+// A safepoint: collects if enough has been allocated since the last time
+// and the calling thread runs a TopLevel outside any Hold.
+void safepoint();
+#else
+class TopLevel {
+public:
+    TopLevel(const Environment&, std::span<const Ref<Object>>) { }
+    TopLevel(const TopLevel&) = delete;
+    TopLevel& operator=(const TopLevel&) = delete;
+};
+
+class Root {
+public:
+    using Trace = void (*)(Tracer& tracer, const void* data);
+
+    Root(Trace, const void*) { }
+    Root(const std::vector<Ref<Object>>&) { }
+    Root(const Root&) = delete;
+    Root& operator=(const Root&) = delete;
+};
+
+class Hold {
+public:
+    Hold() { }
+    Hold(const Hold&) = delete;
+    Hold& operator=(const Hold&) = delete;
+};
+
+inline void safepoint() { }
+#endif
+};
+
+template <typename T, typename... Args>
+Ref<T> make(Args&&... args)
+{
+#ifdef ALMA_MANAGED_HEAP
+    // The collector destroys objects through the Object at the start of
+    // their storage.
+    void* memory = Heap::allocate(sizeof(T));
+    T* obj = new (memory) T(std::forward<Args>(args)...);
+    Heap::commit(obj, sizeof(T));
+    return Ref<T>(obj);
+#else
+    return Ref<T>(new T(std::forward<Args>(args)...));
+#endif
+}
@@ -0,0 +1,565 @@
+
+#include "jit.hpp"
+#include "compiler.hpp"
+#include "function.hpp"
+#include "runtime.hpp"
+#include "vm.hpp"
+#include <cstring>
+#include <optional>
+#include <utility>
+
+#if defined(ALMA_JIT) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define ALMA_JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+bool jitting = true;
+
+}
+
+JIT::Code::Code(Code&& other) noexcept
+    : memory(std::exchange(other.memory, nullptr))
+    , size(std::exchange(other.size, 0))
+    , guarded(std::move(other.guarded))
+{
+}
+
+JIT::Code& JIT::Code::operator=(Code&& other) noexcept
+{
+    std::swap(this->memory, other.memory);
+    std::swap(this->size, other.size);
+    std::swap(this->guarded, other.guarded);
+    return *this;
+}
+
+JIT::Builtin JIT::builtin(const Bytecode& bytecode, size_t i, const Procedure*& function)
+{
+    const Instruction& call = bytecode.code[i];
+    for (size_t j = i; j-- > 0;) {
+        const Instruction& in = bytecode.code[j];
+        if (in.op != Op::Function || in.a != call.b)
+            continue;
+        function = Object::as<Symbol>(bytecode.constants[in.b])->function.get();
+        if (dynamic_cast<const sum*>(function) && call.c == 2)
+            return Builtin::Sum;
+        if (dynamic_cast<const eql*>(function) && call.c == 2)
+            return Builtin::Eql;
+        if (dynamic_cast<const car*>(function) && call.c == 1)
+            return Builtin::Car;
+        if (dynamic_cast<const cdr*>(function) && call.c == 1)
+            return Builtin::Cdr;
+        break;
+    }
+    return Builtin::None;
+}
+
+void JIT::disable()
+{
+    jitting = false;
+}
+
+#ifndef ALMA_JIT_X86_64
+
+JIT::Code::Code(const void* machine_code [[maybe_unused]], size_t length [[maybe_unused]],
+    std::vector<Ref<Object>> _guarded [[maybe_unused]])
+{
+}
+
+JIT::Code::~Code() = default;
+
+bool JIT::enabled()
+{
+    return false;
+}
+
+JIT::Code JIT::compile(const Bytecode& bytecode [[maybe_unused]])
+{
+    return Code();
+}
+
+#else
+
+JIT::Code::Code(const void* machine_code, size_t length, std::vector<Ref<Object>> _guarded)
+    : guarded(std::move(_guarded))
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t rounded = (length + page - 1) / page * page;
+    void* mapped = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED)
+        return;
+    std::memcpy(mapped, machine_code, length);
+    if (mprotect(mapped, rounded, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mapped, rounded);
+        return;
+    }
+    this->memory = mapped;
+    this->size = rounded;
+}
+
+JIT::Code::~Code()
+{
+    if (this->memory)
+        munmap(this->memory, this->size);
+}
+
+bool JIT::enabled()
+{
+    return jitting;
+}
+
+namespace {
+
+enum Reg : uint8_t {
+    rax,
+    rcx,
+    rdx,
+    rbx,
+    rsp,
+    rbp,
+    rsi,
+    rdi,
+    r12 = 12,
+};
+
+// Condition codes, as in the encoding of Jcc.
+enum Condition : uint8_t {
+    overflow = 0x0,
+    equal = 0x4,
+    not_equal = 0x5,
+};
+
+// Encodes the few x86-64 instructions the JIT emits. Jumps go to labels,
+// which may be bound after them, and always take a 32-bit displacement.
+class Assembler {
+public:
+    using Label = size_t;
+
+private:
+    std::vector<uint8_t> bytes;
+    std::vector<size_t> labels; // Where each label is bound
+    // Displacements to fill in: at where, to which label, from where.
+    struct Fixup {
+        size_t at;
+        Label label;
+        size_t base;
+    };
+    std::vector<Fixup> fixups;
+
+    static constexpr size_t unbound = SIZE_MAX;
+
+    void byte(uint8_t value) { this->bytes.push_back(value); }
+    void imm32(uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+            this->byte(value >> (8 * i));
+    }
+    void imm64(uint64_t value)
+    {
+        for (int i = 0; i < 8; i++)
+            this->byte(value >> (8 * i));
+    }
+    void rex(Reg reg, Reg rm) { this->byte(0x48 | (reg >> 3) << 2 | rm >> 3); }
+    void modrm(uint8_t mod, uint8_t reg, uint8_t rm) { this->byte(mod << 6 | (reg & 7) << 3 | (rm & 7)); }
+    // A displacement from the end of the instruction, which it ends.
+    void displacement(Label label)
+    {
+        this->fixups.push_back({ this->bytes.size(), label, this->bytes.size() + 4 });
+        this->imm32(0);
+    }
+    // An instruction on the register at index in the registers of the VM,
+    // addressed from r12.
+    void slot(uint8_t opcode, Reg reg, uint16_t index)
+    {
+        this->rex(reg, r12);
+        this->byte(opcode);
+        this->modrm(2, reg, r12);
+        this->byte(0x24); // SIB for a base of r12
+        this->imm32(index * sizeof(Ref<Object>));
+    }
+
+public:
+    Label label()
+    {
+        this->labels.push_back(unbound);
+        return this->labels.size() - 1;
+    }
+    void bind(Label label) { this->labels[label] = this->bytes.size(); }
+
+    void push(Reg reg)
+    {
+        if (reg >= 8)
+            this->byte(0x41);
+        this->byte(0x50 | (reg & 7));
+    }
+    void pop(Reg reg)
+    {
+        if (reg >= 8)
+            this->byte(0x41);
+        this->byte(0x58 | (reg & 7));
+    }
+    void ret() { this->byte(0xC3); }
+    // rsp += delta, by a multiple of 8 below 128.
+    void adjust_stack(int8_t delta)
+    {
+        this->rex(rax, rsp);
+        this->byte(0x83);
+        this->modrm(3, delta < 0 ? 5 : 0, rsp);
+        this->byte(delta < 0 ? -delta : delta);
+    }
+
+    void mov(Reg dst, uint64_t value)
+    {
+        this->rex(rax, dst);
+        this->byte(0xB8 | (dst & 7));
+        this->imm64(value);
+    }
+    void mov(Reg dst, const void* pointer) { this->mov(dst, reinterpret_cast<uint64_t>(pointer)); }
+    void mov(Reg dst, Reg src)
+    {
+        this->rex(src, dst);
+        this->byte(0x89);
+        this->modrm(3, src, dst);
+    }
+    // eax = value, clearing the upper half of rax.
+    void mov32(uint32_t value)
+    {
+        this->byte(0xB8);
+        this->imm32(value);
+    }
+    void load(Reg dst, uint16_t index) { this->slot(0x8B, dst, index); }
+    void store(uint16_t index, Reg src) { this->slot(0x89, src, index); }
+    void address(Reg dst, uint16_t index) { this->slot(0x8D, dst, index); }
+
+    void add(Reg dst, Reg src)
+    {
+        this->rex(src, dst);
+        this->byte(0x01);
+        this->modrm(3, src, dst);
+    }
+    void decrement(Reg dst)
+    {
+        this->rex(rax, dst);
+        this->byte(0xFF);
+        this->modrm(3, 1, dst);
+    }
+    void cmp(Reg left, Reg right)
+    {
+        this->rex(right, left);
+        this->byte(0x39);
+        this->modrm(3, right, left);
+    }
+    void test(Reg left, Reg right)
+    {
+        this->rex(right, left);
+        this->byte(0x85);
+        this->modrm(3, right, left);
+    }
+    // Sets the flags by the low bit of reg, the tag of fixnums.
+    void test_tag(Reg reg)
+    {
+        this->rex(rax, reg);
+        this->byte(0xF7);
+        this->modrm(3, 0, reg);
+        this->imm32(1);
+    }
+    // Flags for the bool in al and the uint32_t in eax, as C++ returns them.
+    void test_al() { this->bytes.insert(this->bytes.end(), { 0x84, 0xC0 }); }
+    void test_eax() { this->bytes.insert(this->bytes.end(), { 0x85, 0xC0 }); }
+    void cmp_eax(uint8_t value)
+    {
+        this->bytes.insert(this->bytes.end(), { 0x83, 0xF8 });
+        this->byte(value);
+    }
+
+    // Calls function through rax.
+    void call(const void* function)
+    {
+        this->mov(rax, function);
+        this->bytes.insert(this->bytes.end(), { 0xFF, 0xD0 });
+    }
+    void jump(Label label)
+    {
+        this->byte(0xE9);
+        this->displacement(label);
+    }
+    void jump(Condition condition, Label label)
+    {
+        this->byte(0x0F);
+        this->byte(0x80 | condition);
+        this->displacement(label);
+    }
+
+    // Jumps to the entry of table at the index in edx.
+    void dispatch(Label table)
+    {
+        this->bytes.insert(this->bytes.end(), { 0x89, 0xD0 }); // mov eax, edx
+        this->bytes.insert(this->bytes.end(), { 0x48, 0x8D, 0x0D }); // lea rcx, [rip + table]
+        this->displacement(table);
+        this->bytes.insert(this->bytes.end(), { 0x48, 0x63, 0x04, 0x81 }); // movsxd rax, [rcx + rax * 4]
+        this->add(rax, rcx);
+        this->bytes.insert(this->bytes.end(), { 0xFF, 0xE0 }); // jmp rax
+    }
+    // Binds table to a table of the labels, as displacements from it.
+    void jump_table(Label table, const std::vector<Label>& entries)
+    {
+        this->bind(table);
+        size_t base = this->bytes.size();
+        for (Label entry : entries) {
+            this->fixups.push_back({ this->bytes.size(), entry, base });
+            this->imm32(0);
+        }
+    }
+
+    // The machine code, with the displacements of jumps filled in.
+    const std::vector<uint8_t>& finish()
+    {
+        for (const Fixup& fixup : this->fixups) {
+            int32_t rel = static_cast<int32_t>(this->labels[fixup.label] - fixup.base);
+            std::memcpy(&this->bytes[fixup.at], &rel, sizeof(rel));
+        }
+        this->fixups.clear();
+        return this->bytes;
+    }
+};
+
+using Label = Assembler::Label;
+using JIT::Builtin;
+
+// Stores value in a register that holds no counted reference, or through
+// assign when it may.
+void assign(Ref<Object>& slot, Object* value) noexcept
+{
+    slot = Ref<Object>(value);
+}
+
+// Translates each instruction to machine code on the state of the VM: rbx
+// holds the State and r12 the registers. Instructions without a fast path
+// call their Step. Whatever a fast path does not handle, such as an
+// argument other than a fixnum or a redefined builtin, makes the code
+// return that instruction for the VM to run, as does an instruction that
+// throws, since exceptions cannot unwind through machine code.
+class Translation {
+private:
+    const Bytecode& bytecode;
+    Assembler assembler;
+    std::vector<Label> starts; // Per instruction
+    std::vector<std::optional<Label>> exits; // Per instruction, returning it to the VM
+    Label epilogue;
+    std::vector<Ref<Object>> guarded;
+    const Object* nil = Object::nil().get();
+
+    Label exit(size_t i)
+    {
+        if (!this->exits[i])
+            this->exits[i] = this->assembler.label();
+        return *this->exits[i];
+    }
+
+    // Calls the Step of instruction i. Function continues at c when the
+    // symbol has no function.
+    void step(size_t i)
+    {
+        Assembler& as = this->assembler;
+        const Instruction& in = this->bytecode.code[i];
+        as.mov(rdi, rbx);
+        as.mov(rsi, &in);
+        as.call(reinterpret_cast<const void*>(VM::step(in.op)));
+        if (in.op == Op::Function) {
+            as.cmp_eax(static_cast<uint8_t>(VM::Outcome::Branch));
+            as.jump(equal, this->starts[in.c]);
+        }
+        as.test_eax();
+        as.jump(not_equal, this->exit(i));
+    }
+
+    // Moves rax, which holds a fixnum or nil, into register index. The
+    // reference it replaces is dropped through assign unless there is
+    // nothing to count.
+    void store_uncounted(uint16_t index)
+    {
+        Assembler& as = this->assembler;
+        Label plain = as.label(), done = as.label();
+        as.load(rcx, index);
+        as.test(rcx, rcx);
+        as.jump(equal, plain);
+        as.test_tag(rcx);
+        as.jump(not_equal, plain);
+        as.mov(rdx, this->nil);
+        as.cmp(rcx, rdx);
+        as.jump(equal, plain);
+        as.address(rdi, index);
+        as.mov(rsi, rax);
+        as.call(reinterpret_cast<const void*>(assign));
+        as.jump(done);
+        as.bind(plain);
+        as.store(index, rax);
+        as.bind(done);
+    }
+
+    void call(size_t i)
+    {
+        Assembler& as = this->assembler;
+        const Instruction& in = this->bytecode.code[i];
+        const Procedure* function = nullptr;
+        Builtin kind = JIT::builtin(this->bytecode, i, function);
+        if (kind == Builtin::None) {
+            this->step(i);
+            return;
+        }
+
+        this->guarded.emplace_back(const_cast<Procedure*>(function));
+        as.load(rax, in.b);
+        as.mov(rcx, function);
+        as.cmp(rax, rcx);
+        as.jump(not_equal, this->exit(i));
+
+        if (kind == Builtin::Car || kind == Builtin::Cdr) {
+            as.address(rdi, in.a);
+            as.address(rsi, in.b + 1);
+            as.call(reinterpret_cast<const void*>(kind == Builtin::Car ? Runtime::car_of : Runtime::cdr_of));
+            as.test_al();
+            as.jump(equal, this->exit(i));
+            return;
+        }
+
+        as.load(rax, in.b + 1);
+        as.load(rdx, in.b + 2);
+        as.test_tag(rax);
+        as.jump(equal, this->exit(i));
+        as.test_tag(rdx);
+        as.jump(equal, this->exit(i));
+        if (kind == Builtin::Sum) {
+            // (2x + 1) + (2y + 1) - 1 is the fixnum x + y, unless it
+            // overflows into an Integer.
+            as.decrement(rdx);
+            as.add(rax, rdx);
+            as.jump(overflow, this->exit(i));
+            this->store_uncounted(in.a);
+            return;
+        }
+        Label different = as.label(), done = as.label();
+        as.cmp(rax, rdx);
+        as.jump(not_equal, different);
+        as.address(rdi, in.a);
+        as.mov(rsi, Object::t().get());
+        as.call(reinterpret_cast<const void*>(assign));
+        as.jump(done);
+        as.bind(different);
+        as.mov(rax, this->nil);
+        this->store_uncounted(in.a);
+        as.bind(done);
+    }
+
+    void instruction(size_t i)
+    {
+        Assembler& as = this->assembler;
+        const Instruction& in = this->bytecode.code[i];
+        switch (in.op) {
+        case Op::Jump:
+            as.jump(this->starts[in.a]);
+            break;
+        case Op::JumpIfFalse:
+            as.load(rax, in.a);
+            as.mov(rcx, this->nil);
+            as.cmp(rax, rcx);
+            as.jump(equal, this->starts[in.b]);
+            break;
+        case Op::Const: {
+            const Ref<Object>& constant = this->bytecode.constants[in.b];
+            if (!Object::is_fixnum(constant) && constant.get() != this->nil) {
+                this->step(i);
+                break;
+            }
+            as.mov(rax, constant.get());
+            this->store_uncounted(in.a);
+            break;
+        }
+        case Op::Var: {
+            // Fixnums are never in a Cell.
+            Label slow = as.label(), done = as.label();
+            as.load(rax, in.b);
+            as.test_tag(rax);
+            as.jump(equal, slow);
+            this->store_uncounted(in.a);
+            as.jump(done);
+            as.bind(slow);
+            this->step(i);
+            as.bind(done);
+            break;
+        }
+        case Op::Call:
+        case Op::TailCall:
+            this->call(i);
+            break;
+        case Op::Return:
+            this->step(i);
+            as.mov32(JIT::returned);
+            as.jump(this->epilogue);
+            break;
+        default:
+            this->step(i);
+            break;
+        }
+    }
+
+public:
+    Translation(const Bytecode& _bytecode)
+        : bytecode(_bytecode)
+        , exits(_bytecode.code.size())
+    {
+    }
+
+    JIT::Code translate()
+    {
+        Assembler& as = this->assembler;
+        for (size_t i = 0; i < this->bytecode.code.size(); i++)
+            this->starts.push_back(as.label());
+        this->epilogue = as.label();
+        Label table = as.label();
+
+        // rbx and r12 are saved by the callee, and the stack stays 16-byte
+        // aligned at calls.
+        as.push(rbx);
+        as.push(r12);
+        as.adjust_stack(-8);
+        as.mov(rbx, rdi);
+        as.mov(r12, rsi);
+        as.dispatch(table);
+
+        for (size_t i = 0; i < this->bytecode.code.size(); i++) {
+            as.bind(this->starts[i]);
+            this->instruction(i);
+        }
+        for (size_t i = 0; i < this->exits.size(); i++) {
+            if (!this->exits[i])
+                continue;
+            as.bind(*this->exits[i]);
+            as.mov32(i);
+            as.jump(this->epilogue);
+        }
+
+        as.bind(this->epilogue);
+        as.adjust_stack(8);
+        as.pop(r12);
+        as.pop(rbx);
+        as.ret();
+        as.jump_table(table, this->starts);
+
+        const std::vector<uint8_t>& machine_code = as.finish();
+        return JIT::Code(machine_code.data(), machine_code.size(), std::move(this->guarded));
+    }
+};
+
+}
+
+JIT::Code JIT::compile(const Bytecode& bytecode)
+{
+    if (!jitting)
+        return Code();
+    return Translation(bytecode).translate();
+}
+
+#endif
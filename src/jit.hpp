@@ -0,0 +1,77 @@
+
+#pragma once
+
+#include "objects.hpp"
+#include <cstdint>
+#include <vector>
+
+struct Bytecode;
+
+namespace VM {
+struct State;
+}
+
+// Compiles the Bytecode of hot user functions and macros to x86-64 machine
+// code. Elsewhere, or when disabled, everything stays on the VM.
+namespace JIT {
+
+// Runs of a body after which it is compiled.
+inline constexpr uint32_t hot_calls = 1000;
+
+// Returned by native code once the body has returned.
+inline constexpr uint32_t returned = UINT32_MAX;
+
+// Machine code for one Bytecode, in memory of its own that is executable
+// and no longer writable.
+class Code {
+private:
+    using Entry = uint32_t (*)(VM::State* state, Ref<Object>* registers, uint32_t start);
+
+    void* memory = nullptr;
+    size_t size = 0;
+    // Objects the code compares against by address, kept alive so that the
+    // addresses stay theirs.
+    std::vector<Ref<Object>> guarded;
+
+public:
+    Code() = default;
+    Code(const void* machine_code, size_t length, std::vector<Ref<Object>> _guarded);
+    Code(Code&& other) noexcept;
+    Code& operator=(Code&& other) noexcept;
+    ~Code();
+
+    explicit operator bool() const { return this->memory != nullptr; }
+    const std::vector<Ref<Object>>& objects() const { return this->guarded; }
+
+    // Runs the body from instruction start with the state and registers of
+    // the VM. Returns returned, with the result in state, or the instruction
+    // to continue at on the VM. If the code stopped because that instruction
+    // failed, its error is in state.
+    uint32_t run(VM::State& state, Ref<Object>* registers, uint32_t start) const
+    {
+        return reinterpret_cast<Entry>(this->memory)(&state, registers, start);
+    }
+};
+
+// Builtins whose calls are inlined, guarded by the function called being
+// the very object seen when compiling. Translated bodies inline the same.
+enum class Builtin {
+    None,
+    Sum,
+    Eql,
+    Car,
+    Cdr,
+};
+
+// The builtin the call instruction i of bytecode calls, stored in function,
+// if it calls one with the number of arguments its fast path takes. The
+// function is loaded by the nearest Function instruction into the same
+// register before it.
+Builtin builtin(const Bytecode& bytecode, size_t i, const Procedure*& function);
+
+// Leaves every body on the VM.
+void disable();
+bool enabled();
+// Machine code for bytecode, or empty Code if it stays on the VM.
+Code compile(const Bytecode& bytecode);
+};
@@ -15,7 +15,7 @@ void intern_macros();
         }                                                                                           \
                                                                                                     \
     protected:                                                                                      \
-        virtual std::shared_ptr<Object> eval_body(const std::vector<std::shared_ptr<Object>>& args, \
+        virtual Ref<Object> eval_body(std::span<const Ref<Object>> args, \
             Environment& lex_env) override;                                                         \
     }
 
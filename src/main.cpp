@@ -1,13 +1,15 @@
 
 
+#include "compiler.hpp"
 #include "emitter.hpp"
-#include "function.hpp"
-#include "macro.hpp"
+#include "hash_cons.hpp"
+#include "jit.hpp"
 #include "parser.hpp"
-#include "special_operator.hpp"
-#include "symbol.hpp"
+#include "runtime.hpp"
+#include "translator.hpp"
 #include <filesystem>
 #include <fstream>
+#include <thread>
 
 void showUsage()
 {
@@ -19,7 +21,38 @@ void showUsage()
 
  Usage:
 
-   alma [input [output]]
+   alma [--stream] [--jobs N] [--cache-dir DIR] [--hash-cons] [--interpret]
+        [--no-jit] [--compile-to-cpp] [input [output]]
+
+ Options:
+
+   --stream   Evaluate each top-level form as soon as it is read. Without
+              it, the input is read at once up to the first call of
+              set-macro-character, and the rest once that has run.
+   --jobs N   Parse the input on N threads before evaluating it. Defaults
+              to the number of cores.
+   --cache-dir DIR
+              Keep the parsed forms of each input in DIR, keyed by its
+              contents, and load them from there when the same input is
+              read again. Not used in streaming mode.
+   --hash-cons
+              Share one copy of each distinct quoted constant, so that
+              repeated constant data is stored once and compared by equal
+              as fast as by eq.
+   --interpret
+              Run user functions and macros on the tree-walking evaluator
+              instead of compiling them to bytecode.
+   --no-jit   Keep hot user functions and macros on the bytecode VM
+              instead of compiling them to machine code. Only x86-64
+              builds with ALMA_JIT have a JIT at all.
+   --compile-to-cpp
+              Translate the input to a C++ program, written to output,
+              instead of running it, with the bodies of its functions and
+              macros compiled to C++. Built against the alma_runtime
+              library, it emits what the input would.
+
+ When input is '-' or missing, the program is read from the standard input
+ in streaming mode.
  )END";
 
     std::cout << message << std::endl;
@@ -27,30 +60,80 @@ void showUsage()
 
 int main(int argc, char* argv[])
 {
-    if (argc > 3) {
+    bool streaming = false;
+    bool translating = false;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::filesystem::path cache_dir;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--stream")
+            streaming = true;
+        else if (arg == "--jobs" && i + 1 < argc)
+            jobs = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--cache-dir" && i + 1 < argc)
+            cache_dir = argv[++i];
+        else if (arg == "--hash-cons")
+            HashCons::enable();
+        else if (arg == "--interpret")
+            Compiler::disable();
+        else if (arg == "--no-jit")
+            JIT::disable();
+        else if (arg == "--compile-to-cpp")
+            translating = true;
+        else if (arg == "--help") {
+            showUsage();
+            exit(0);
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "Unknown option " << arg << std::endl;
+            showUsage();
+            exit(1);
+        } else
+            positional.push_back(arg);
+    }
+
+    if (positional.size() > 2) {
         std::cerr << "Too many arguments" << std::endl;
         showUsage();
         exit(1);
     }
 
-    std::filesystem::path file(argv[1]);
-    if (argc == 3) {
-        std::filesystem::path output(argv[2]);
+    bool from_stdin = positional.empty() || positional[0] == "-";
+    std::filesystem::path file(from_stdin ? "" : positional[0]);
+    if (translating && from_stdin) {
+        std::cerr << "--compile-to-cpp needs an input file" << std::endl;
+        exit(1);
+    }
+    if (positional.size() == 2) {
+        std::filesystem::path output(positional[1]);
         Emitter::emitter = std::make_unique<std::ofstream>(output);
     }
 
-    Package::initAlmaPackage();
-    intern_special_operators();
-    intern_functions();
-    intern_macros();
-    intern_symbols();
+    // Reading from std::cin must not flush the output on every character.
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+
+    Runtime::initialize();
 
     try {
         Environment lex_env;
         ast ast;
-        ast.read(file);
-        // ast.print();
-        ast.eval(lex_env);
+        if (from_stdin) {
+            ast.stream(std::cin, "<stdin>", lex_env);
+        } else if (translating) {
+            ast.read(file, jobs);
+            if (ast.stopped_early())
+                throw std::runtime_error("The forms of " + file.string()
+                    + " after its call of set-macro-character can only be read once it has run.");
+            std::ostream& out = Emitter::emitter ? *Emitter::emitter : std::cout;
+            Translator::translate(ast.forms(), file.string(), out);
+        } else if (streaming) {
+            ast.stream(file, lex_env);
+        } else {
+            ast.read(file, jobs, cache_dir);
+            // ast.print();
+            ast.eval(lex_env);
+        }
     } catch (std::runtime_error& e) {
         std::cout << e.what() << std::endl;
     }
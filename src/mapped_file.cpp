@@ -0,0 +1,57 @@
+
+#include "mapped_file.hpp"
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::filesystem::path& file)
+{
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open " + file.string() + ": " + std::strerror(errno));
+
+    struct stat info;
+    if (::fstat(fd, &info) < 0) {
+        ::close(fd);
+        throw std::runtime_error("Cannot stat " + file.string() + ": " + std::strerror(errno));
+    }
+
+    // mmap rejects empty mappings; an empty file is just an empty view.
+    if (info.st_size > 0) {
+        void* mapping = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Cannot map " + file.string() + ": " + std::strerror(errno));
+        }
+        ::madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+        this->data = static_cast<const char*>(mapping);
+        this->size = info.st_size;
+    }
+
+    ::close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (this->data)
+        ::munmap(const_cast<char*>(this->data), this->size);
+}
+
+void MappedFile::release_before(const char* position)
+{
+    static const uintptr_t page_size = ::sysconf(_SC_PAGESIZE);
+    static const uintptr_t step = 4 << 20;
+
+    if (!this->released)
+        this->released = this->data;
+    uintptr_t start = reinterpret_cast<uintptr_t>(this->released);
+    uintptr_t end = reinterpret_cast<uintptr_t>(position) & ~(page_size - 1);
+    if (end >= start + step) {
+        ::madvise(const_cast<char*>(this->released), end - start, MADV_DONTNEED);
+        this->released = reinterpret_cast<const char*>(end);
+    }
+}
@@ -0,0 +1,26 @@
+
+#pragma once
+
+#include <filesystem>
+#include <string_view>
+
+// Read-only memory mapping of a whole regular file. The contents stay valid
+// for the lifetime of the object.
+class MappedFile {
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+    const char* released = nullptr;
+
+public:
+    MappedFile(const std::filesystem::path& file);
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+    ~MappedFile();
+
+    std::string_view contents() const { return { this->data, this->size }; }
+    // Drops the resident pages before `position`, in steps of a few megabytes.
+    // The contents stay valid; touching them again reads them back from the
+    // file.
+    void release_before(const char* position);
+};
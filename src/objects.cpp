@@ -1,54 +1,268 @@
 
 #include "objects.hpp"
+#include "annotations.hpp"
+#include "argument_stack.hpp"
+#include "compiler.hpp"
+#include "dynamic_scope.hpp"
 #include "emitter.hpp"
+#include "expansions.hpp"
+#include "heap.hpp"
+#include "package.hpp"
+#include "resolver.hpp"
+#include "source_map.hpp"
+#include "special_operator.hpp"
+#include "string_pool.hpp"
+#include "types.hpp"
 #include "util.hpp"
+#include "vm.hpp"
+#include <functional>
 #include <iostream>
 #include <optional>
+#include <utility>
+
+namespace {
+
+// A list being walked by code that keeps a stack of them instead of
+// recursing into nested lists.
+struct ListCursor {
+    const Cons* cell; // Whose car comes next, or the last cell once done
+    bool first = true;
+    bool done = false;
+};
+
+// The cdr of the last cell of a list.
+const Ref<Object>& last_cdr(const Cons* cell)
+{
+    if (cell->cdr_code == Cons::CdrCode::Stored)
+        return static_cast<const Pair*>(cell)->rest;
+    return Object::nil();
+}
+
+}
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> Object::eval(
-    const std::shared_ptr<Object>& obj, Environment& lex_env)
+Ref<Object> Object::eval(
+    const Ref<Object>& obj, Environment& lex_env)
 {
+    if (is_fixnum(obj))
+        return obj;
     // debugMsg("Eval: " << Object::to_string(obj));
-    std::shared_ptr<Object> r = obj->eval_impl(obj, lex_env);
-    return r;
+    // Symbols and conses are most of what is evaluated: call them without
+    // going through the vtable.
+    switch (obj->type) {
+    case Type::Symbol:
+        return as<Symbol>(obj)->Symbol::eval_impl(obj, lex_env);
+    case Type::Cons:
+        return as<Cons>(obj)->Cons::eval_impl(obj, lex_env);
+    case Type::LexicalVariable:
+        return as<LexicalVariable>(obj)->LexicalVariable::eval_impl(obj, lex_env);
+    case Type::GlobalVariable:
+        return as<GlobalVariable>(obj)->GlobalVariable::eval_impl(obj, lex_env);
+    default:
+        return obj->eval_impl(obj, lex_env);
+    }
 }
 
-void Object::emit(const std::shared_ptr<Object>& obj)
+void Object::emit(const Ref<Object>& obj)
 {
-    obj->emit_impl();
+    if (is_fixnum(obj))
+        Emitter::emit(*integer_value(obj));
+    else
+        obj->emit_impl();
 }
 
-std::string Object::to_string(const std::shared_ptr<Object>& obj)
+std::string Object::to_string(const Ref<Object>& obj)
 {
+    if (is_fixnum(obj))
+        return std::to_string(*integer_value(obj));
     return obj->to_string_impl();
 }
 
-bool Object::is_true(const std::shared_ptr<Object>& obj)
+bool Object::is_true(const Ref<Object>& obj)
 {
-    return static_cast<bool>(*obj);
+    return is_fixnum(obj) || obj->type != Type::Nil;
 }
 
-bool Object::eq(const std::shared_ptr<Object>& obj1, const std::shared_ptr<Object>& obj2)
+bool Object::eq(const Ref<Object>& obj1, const Ref<Object>& obj2)
 {
     return obj1 == obj2;
 }
 
-bool Object::typep(const std::shared_ptr<Object>& obj, const std::shared_ptr<Symbol>& sym)
+bool Object::equal(const Ref<Object>& obj1, const Ref<Object>& obj2)
+{
+    if (obj1 == obj2)
+        return true;
+
+    // Pairs left to compare, so that deep trees do not recurse.
+    std::vector<std::pair<const Ref<Object>*, const Ref<Object>*>> pending = { { &obj1, &obj2 } };
+    while (!pending.empty()) {
+        auto [a, b] = pending.back();
+        pending.pop_back();
+        if (*a == *b)
+            continue;
+        Type type = type_of(*a);
+        if (type != type_of(*b))
+            return false;
+
+        switch (type) {
+        case Type::Integer:
+            if (as<Integer>(*a)->value != as<Integer>(*b)->value)
+                return false;
+            break;
+        case Type::String:
+            if (as<String>(*a)->content != as<String>(*b)->content)
+                return false;
+            break;
+        case Type::Cons: {
+            const Cons* x = as<Cons>(*a);
+            const Cons* y = as<Cons>(*b);
+            // Equal hash-consed trees are the same object.
+            if (x->canonical && y->canonical)
+                return false;
+            while (true) {
+                pending.emplace_back(&x->car, &y->car);
+                const Cons* next_x = x->next();
+                const Cons* next_y = y->next();
+                if (!next_x || !next_y) {
+                    if (next_x || next_y)
+                        return false;
+                    break;
+                }
+                x = next_x;
+                y = next_y;
+            }
+            pending.emplace_back(&last_cdr(x), &last_cdr(y));
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t Object::sxhash(const Ref<Object>& obj)
+{
+    // FNV-1a over what equal compares: the atoms of the tree in order and
+    // the bounds of its lists. Atoms that outlive a run hash by content, so
+    // that the hash is the same on every run.
+    uint64_t hash = 0xcbf29ce484222325;
+    auto mix = [&hash](uint64_t value) {
+        hash = (hash ^ value) * 0x100000001b3;
+    };
+    auto mix_bytes = [&mix](std::string_view bytes) {
+        for (unsigned char c : bytes)
+            mix(c);
+        mix(bytes.size());
+    };
+    std::vector<ListCursor> lists;
+    auto visit = [&](const Ref<Object>& x) {
+        switch (type_of(x)) {
+        case Type::Fixnum:
+        case Type::Integer:
+            mix(*integer_value(x));
+            break;
+        case Type::String:
+            mix('"');
+            mix_bytes(as<String>(x)->content);
+            break;
+        case Type::Nil:
+            mix('n');
+            break;
+        case Type::Symbol: {
+            if (x.get() == Object::t().get()) {
+                mix('t');
+                break;
+            }
+            // Packages have no name, so the package of a symbol only counts
+            // as the alma package, another one or none.
+            const Symbol* symbol = as<Symbol>(x);
+            mix(!symbol->package ? 'u' : symbol->package == Package::almaPackage ? 's' : 'p');
+            mix_bytes(symbol->name);
+            break;
+        }
+        case Type::Cons:
+            mix('(');
+            lists.push_back({ as<Cons>(x) });
+            break;
+        default: // Compared by identity, and only alive for this run
+            mix(reinterpret_cast<uintptr_t>(x.get()));
+        }
+    };
+
+    visit(obj);
+    while (!lists.empty()) {
+        ListCursor& list = lists.back();
+        if (list.done) {
+            const Ref<Object>& tail = last_cdr(list.cell);
+            lists.pop_back();
+            mix(')');
+            visit(tail);
+            continue;
+        }
+        const Cons* cell = list.cell;
+        if (const Cons* next = cell->next())
+            list.cell = next;
+        else
+            list.done = true;
+        visit(cell->car);
+    }
+    return hash;
+}
+
+bool Object::typep(const Ref<Object>& obj, const Ref<Symbol>& sym)
+{
+    return Types::of(type_of(obj)) & sym->type_bit;
+}
+
+// 63 bit fixnums, shifted left past the tag bit.
+static constexpr int64_t fixnum_min = -(int64_t(1) << 62);
+static constexpr int64_t fixnum_max = (int64_t(1) << 62) - 1;
+
+Ref<Object> Object::integer(int64_t value)
+{
+    if (value < fixnum_min || value > fixnum_max)
+        return make<Integer>(value);
+    uintptr_t bits = (static_cast<uint64_t>(value) << 1) | 1;
+    return Ref<Object>(reinterpret_cast<Object*>(bits));
+}
+
+std::optional<int64_t> Object::integer_value(const Ref<Object>& obj)
 {
-    return sym->name == "t" || obj->typep_impl(sym);
+    if (is_fixnum(obj))
+        return static_cast<int64_t>(reinterpret_cast<uintptr_t>(obj.get())) >> 1;
+    if (is<Integer>(obj))
+        return as<Integer>(obj)->value;
+    return std::nullopt;
+}
+
+const Ref<Object>& Object::nil()
+{
+    static Nil nil_object;
+    static const Ref<Object> nil = [] {
+        nil_object.pin();
+        return Ref<Object>(&nil_object);
+    }();
+    return nil;
+}
+
+const Ref<Object>& Object::t()
+{
+    static const Ref<Object> t = Package::almaPackage->intern_symbol("t");
+    return t;
 }
 
 // --------------------------------------------------------------------------------
 
 Integer::Integer(int64_t _value)
-    : value(_value)
+    : Object(Type::Integer)
+    , value(_value)
 {
 }
 
-std::shared_ptr<Object> Integer::eval_impl(
-    const std::shared_ptr<Object>& obj, Environment& lex_env [[maybe_unused]]) const
+Ref<Object> Integer::eval_impl(
+    const Ref<Object>& obj, Environment& lex_env [[maybe_unused]]) const
 {
     return obj;
 }
@@ -63,20 +277,16 @@ std::string Integer::to_string_impl() const
     return std::to_string(this->value);
 }
 
-bool Integer::typep_impl(const std::shared_ptr<Symbol>& sym) const
-{
-    return sym->name == "integer";
-}
-
 // --------------------------------------------------------------------------------
 
-String::String(const std::string& _content)
-    : content(_content)
+String::String(std::string_view _content)
+    : Object(Type::String)
+    , content(StringPool::intern(_content))
 {
 }
 
-std::shared_ptr<Object> String::eval_impl(
-    const std::shared_ptr<Object>& obj, Environment& lex_env [[maybe_unused]]) const
+Ref<Object> String::eval_impl(
+    const Ref<Object>& obj, Environment& lex_env [[maybe_unused]]) const
 {
     return obj;
 }
@@ -88,18 +298,13 @@ void String::emit_impl() const
 
 std::string String::to_string_impl() const
 {
-    return this->content;
-}
-
-bool String::typep_impl(const std::shared_ptr<Symbol>& sym) const
-{
-    return sym->name == "string";
+    return std::string(this->content);
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> Procedure::eval_impl(
-    const std::shared_ptr<Object>& obj, Environment& lex_env [[maybe_unused]]) const
+Ref<Object> Procedure::eval_impl(
+    const Ref<Object>& obj, Environment& lex_env [[maybe_unused]]) const
 {
     return obj;
 }
@@ -120,244 +325,550 @@ std::string Procedure::to_string_impl() const
     return s.str();
 }
 
-bool Procedure::typep_impl(const std::shared_ptr<Symbol>& sym) const
+Ref<Object> Function::apply(
+    Environment& lex_env, std::span<const Ref<Object>> arguments)
 {
-    return sym->name == "procedure";
+    ArgumentStack::Frame evaluated_args(arguments.size());
+    for (const Ref<Object>& arg : arguments)
+        evaluated_args.push(Object::eval(arg, lex_env));
+    return this->eval_body(evaluated_args.arguments(), lex_env);
 }
 
-std::vector<std::shared_ptr<Object>> Function::eval_args(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env)
+LambdaCode::LambdaCode() = default;
+
+LambdaCode::~LambdaCode() = default;
+
+Ref<Object> LambdaCode::call(std::vector<Ref<Object>>& cells, std::span<const Ref<Object>> args) const
 {
-    std::vector<std::shared_ptr<Object>> evaluated_args;
-    evaluated_args.reserve(args.size());
-    for (const std::shared_ptr<Object>& arg : args) {
-        evaluated_args.push_back(Object::eval(arg, lex_env));
+    this->refresh();
+    if (this->bytecode)
+        return VM::call(*this, cells, args);
+
+    Heap::safepoint();
+    this->check_arity(args.size());
+    Environment env;
+    Environment::Frame captured(env, *this->captures, cells.data());
+    ArgumentStack::Frame slots(args.size());
+    for (const Ref<Object>& arg : args)
+        slots.push(arg);
+    DynamicScope dynamic;
+    if (!this->specials.empty())
+        dynamic.bind(this->specials, slots.data());
+    Environment::Frame frame(env, *this->params, slots.data());
+
+    for (size_t i = 0; i < this->body.size() - 1; i++) {
+        Object::eval(this->body[i], env);
     }
+    return Object::eval(this->body.back(), env);
+}
 
-    return evaluated_args;
+void LambdaCode::refresh() const
+{
+    if (!this->bytecode || !Compiler::stale(*this->bytecode))
+        return;
+    // Null if the body no longer compiles, leaving it to the tree walker.
+    std::unique_ptr<Bytecode> recompiled = Compiler::compile(*this);
+    this->retired.push_back(std::exchange(this->bytecode, std::move(recompiled)));
 }
 
-std::shared_ptr<Object> Function::apply(
-    Environment& lex_env, const std::vector<std::shared_ptr<Object>>& arguments)
+void LambdaCode::check_arity(size_t count) const
 {
-    std::vector<std::shared_ptr<Object>> evaluated_args = eval_args(arguments, lex_env);
-    return this->eval_body(evaluated_args, lex_env);
+    size_t needed = this->specials.empty() ? this->params->symbols.size() : this->specials.size();
+    if (needed != count)
+        throw std::runtime_error("Needed " + std::to_string(needed) + " but received " + std::to_string(count) + " params");
 }
 
-bool Function::typep_impl(const std::shared_ptr<Symbol>& sym) const
+void LambdaCode::trace(Tracer& tracer) const
 {
-    return sym->name == "function" || this->Procedure::typep_impl(sym);
+    for (const Ref<Symbol>& symbol : this->captures->symbols)
+        tracer.mark(symbol);
+    for (const Ref<Symbol>& param : this->params->symbols)
+        tracer.mark(param);
+    for (const Ref<Symbol>& special : this->specials)
+        tracer.mark(special);
+    for (const Ref<Object>& form : this->body)
+        tracer.mark(form);
+    auto trace_bytecode = [&tracer](const Bytecode& compiled) {
+        for (const Ref<Object>& constant : compiled.constants)
+            tracer.mark(constant);
+        for (const Ref<Object>& obj : compiled.native.objects())
+            tracer.mark(obj);
+        for (const auto& [symbol, macro] : compiled.macros) {
+            tracer.mark(symbol);
+            tracer.mark(macro);
+        }
+    };
+    if (this->bytecode)
+        trace_bytecode(*this->bytecode);
+    for (const std::unique_ptr<Bytecode>& old : this->retired)
+        trace_bytecode(*old);
 }
 
-std::shared_ptr<Object> FunctionUser::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+Ref<Object> FunctionUser::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
 {
-    if (this->params.size() != args.size())
-        throw std::runtime_error("Needed " + std::to_string(this->params.size()) + " but received " + std::to_string(args.size()) + " params");
+    return this->code->call(this->cells, args);
+}
 
-    this->closure.pushValues(this->params, args);
+void FunctionUser::trace_impl(Tracer& tracer) const
+{
+    this->code->trace(tracer);
+    for (const Ref<Object>& cell : this->cells)
+        tracer.mark(cell);
+}
 
-    for (size_t i = 0; i < this->body.size() - 1; i++) {
-        Object::eval(this->body[i], this->closure);
-    }
-    std::shared_ptr<Object> result = Object::eval(this->body.back(), this->closure);
+Ref<Object> Macro::apply(
+    Environment& lex_env, std::span<const Ref<Object>> arguments)
+{
+    Ref<Object> result = this->eval_body(arguments, lex_env);
+    return Object::eval(result, lex_env);
+}
 
-    this->closure.popValues();
+Ref<Object> Macro::expand(Environment& lex_env, std::span<const Ref<Object>> arguments)
+{
+    return this->eval_body(arguments, lex_env);
+}
 
-    return result;
+Ref<Object> MacroUser::eval_body(
+    std::span<const Ref<Object>> args, Environment& lex_env [[maybe_unused]])
+{
+    return this->code->call(this->cells, args);
 }
 
-bool FunctionUser::typep_impl(const std::shared_ptr<Symbol>& sym) const
+void MacroUser::trace_impl(Tracer& tracer) const
 {
-    return sym->name == "function-user" || this->Function::typep_impl(sym);
+    this->code->trace(tracer);
+    for (const Ref<Object>& cell : this->cells)
+        tracer.mark(cell);
 }
 
-std::shared_ptr<Object> Macro::apply(
-    Environment& lex_env, const std::vector<std::shared_ptr<Object>>& arguments)
+// --------------------------------------------------------------------------------
+
+Symbol::Symbol(const std::string& _name)
+    : Object(Type::Symbol)
+    , name(_name)
 {
-    std::shared_ptr<Object> result = this->eval_body(arguments, lex_env);
-    return Object::eval(result, lex_env);
 }
 
-std::shared_ptr<Object> Macro::expand(Environment& lex_env, const std::vector<std::shared_ptr<Object>>& arguments)
+Symbol::~Symbol() = default;
+
+Ref<Object> Symbol::eval_impl(
+    const Ref<Object>& obj [[maybe_unused]], Environment& lex_env) const
 {
-    return this->eval_body(arguments, lex_env);
+    if (Ref<Object>* slot = lex_env.find(this))
+        return *slot;
+    if (!this->value)
+        throw std::runtime_error("Symbol " + this->name + " unbound.");
+    return this->value;
 }
 
-bool Macro::typep_impl(const std::shared_ptr<Symbol>& sym) const
+void Symbol::emit_impl() const
+{
+    Emitter::emit(this->name);
+}
+
+std::string Symbol::to_string_impl() const
 {
-    return sym->name == "macro" || this->Procedure::typep_impl(sym);
+    return this->name;
 }
 
-std::shared_ptr<Object> MacroUser::eval_body(
-    const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env [[maybe_unused]])
+void Symbol::trace_impl(Tracer& tracer) const
 {
-    if (this->params.size() != args.size())
-        throw std::runtime_error("Needed " + std::to_string(this->params.size()) + " but received " + std::to_string(args.size()) + " params");
+    tracer.mark(this->value);
+    tracer.mark(this->function);
+    tracer.mark(this->package);
+}
 
-    this->closure.pushValues(this->params, args);
+// --------------------------------------------------------------------------------
 
-    for (size_t i = 0; i < this->body.size() - 1; i++) {
-        Object::eval(this->body[i], this->closure);
-    }
-    std::shared_ptr<Object> result = Object::eval(this->body.back(), this->closure);
+Ref<Object> LexicalVariable::eval_impl(
+    const Ref<Object>& obj [[maybe_unused]], Environment& lex_env) const
+{
+    const Ref<Object>& value = lex_env.slot(this->depth, this->index);
+    return Object::is<Cell>(value) ? Object::as<Cell>(value)->value : value;
+}
 
-    this->closure.popValues();
+void LexicalVariable::emit_impl() const
+{
+    this->symbol->emit_impl();
+}
 
-    return result;
+std::string LexicalVariable::to_string_impl() const
+{
+    return this->symbol->name;
 }
 
-bool MacroUser::typep_impl(const std::shared_ptr<Symbol>& sym) const
+void LexicalVariable::trace_impl(Tracer& tracer) const
 {
-    return sym->name == "macro-user" || this->Macro::typep_impl(sym);
+    tracer.mark(this->symbol);
 }
 
 // --------------------------------------------------------------------------------
 
-Symbol::Symbol(const std::string& _name)
-    : name(_name)
+Ref<Object> GlobalVariable::eval_impl(
+    const Ref<Object>& obj [[maybe_unused]], Environment& lex_env [[maybe_unused]]) const
 {
+    if (!this->symbol->value)
+        throw std::runtime_error("Symbol " + this->symbol->name + " unbound.");
+    return this->symbol->value;
 }
 
-std::shared_ptr<Object> Symbol::eval_impl(
-    const std::shared_ptr<Object>& obj, Environment& lex_env) const
+void GlobalVariable::emit_impl() const
 {
-    std::shared_ptr<Symbol> self = std::dynamic_pointer_cast<Symbol>(obj);
-    if (lex_env.isSymbolBound(self))
-        return lex_env.getValue(self);
-    else {
-        if (this->values.empty())
-            throw std::runtime_error("Symbol " + this->name + " unbound.");
-        return this->values.back();
-    }
+    this->symbol->emit_impl();
 }
 
-void Symbol::emit_impl() const
+std::string GlobalVariable::to_string_impl() const
 {
-    Emitter::emit(this->name);
+    return this->symbol->name;
 }
 
-std::string Symbol::to_string_impl() const
+void GlobalVariable::trace_impl(Tracer& tracer) const
 {
-    return this->name;
+    tracer.mark(this->symbol);
+}
+
+// --------------------------------------------------------------------------------
+
+Ref<Object> Cell::eval_impl(
+    const Ref<Object>& obj [[maybe_unused]], Environment& lex_env [[maybe_unused]]) const
+{
+    return this->value;
+}
+
+void Cell::emit_impl() const
+{
+    Object::emit(this->value);
+}
+
+std::string Cell::to_string_impl() const
+{
+    return Object::to_string(this->value);
 }
 
-bool Symbol::typep_impl(const std::shared_ptr<Symbol>& sym) const
+void Cell::trace_impl(Tracer& tracer) const
 {
-    return sym->name == "symbol";
+    tracer.mark(this->value);
 }
 
 // --------------------------------------------------------------------------------
 
-Cons::Cons(const std::shared_ptr<Object>& _car, const std::shared_ptr<Object>& _cdr)
-    : car(_car)
-    , cdr(_cdr)
+// Cells per run. Small enough for a run to fit in one of the size classes
+// of the managed heap, which finds the run of a cell from its address.
+static constexpr size_t run_length = 20;
+
+Cons::Cons(CdrCode _cdr_code, uint8_t _run_index, const Ref<Object>& _car)
+    : Object(Type::Cons)
+    , cdr_code(_cdr_code)
+    , run_index(_run_index)
+    , car(_car)
+{
+}
+
+Ref<Cons> Cons::list(std::span<const Ref<Object>> elements)
+{
+    if (elements.empty())
+        throw std::runtime_error("The list is empty");
+
+    // Built back to front, so that each run can end in the one after it.
+    Ref<Object> tail = Object::nil();
+    size_t runs = (elements.size() + run_length - 1) / run_length;
+    for (size_t run = runs; run-- > 0;) {
+        std::span<const Ref<Object>> cars = elements.subspan(run * run_length).first(
+            std::min(run_length, elements.size() - run * run_length));
+        bool last_run = !Object::is_true(tail);
+        size_t size = (cars.size() - 1) * sizeof(Cons) + (last_run ? sizeof(Cons) : sizeof(Pair));
+
+#ifdef ALMA_MANAGED_HEAP
+        char* memory = static_cast<char*>(Heap::allocate(size));
+#else
+        char* memory = static_cast<char*>(::operator new(size));
+#endif
+        Cons* head = nullptr;
+        for (size_t i = 0; i < cars.size(); i++) {
+            void* at = memory + i * sizeof(Cons);
+            Cons* cell;
+            if (i + 1 < cars.size())
+                cell = new (at) Cons(CdrCode::Next, i, cars[i]);
+            else if (last_run)
+                cell = new (at) Cons(CdrCode::Nil, i, cars[i]);
+            else
+                cell = new (at) Pair(i, cars[i], tail);
+            // Every cell but the first is referenced by the one before it.
+            if (i == 0)
+                head = cell;
+            else
+                Ref<Cons>(cell).detach();
+        }
+#ifdef ALMA_MANAGED_HEAP
+        Heap::commit(head, size);
+#endif
+        tail = Ref<Cons>(head);
+    }
+    return Ref<Cons>(Object::as<Cons>(tail));
+}
+
+Cons::~Cons()
 {
+    if (this->located)
+        SourceMap::forget(this);
+    if (this->annotated)
+        Annotations::forget(this);
+#ifdef ALMA_MANAGED_HEAP
+    // The collector only destroys the first cell of each run.
+    if (this->cdr_code == CdrCode::Next)
+        const_cast<Cons*>(this->next())->~Cons();
+#endif
 }
 
-static std::shared_ptr<Cons> makeConsFromList(const std::vector<std::shared_ptr<Object>>& list,
-    size_t currentIndex)
+static void free_cell(Cons* cell)
 {
-    if (currentIndex == list.size() - 1) {
-        return std::make_shared<Cons>(list[currentIndex], std::make_shared<Nil>());
+    uint8_t run_index = cell->run_index;
+    Cons* next = cell->cdr_code == Cons::CdrCode::Next ? const_cast<Cons*>(cell->next()) : nullptr;
+    cell->~Cons();
+
+    // The cells of a run die in order, as each one holds the next, so the
+    // run is freed with its last cell.
+    if (next) {
+        Ref<Cons> released(next, adopt);
+    } else if (run_index == Cons::standalone) {
+        ::operator delete(cell);
     } else {
-        return std::make_shared<Cons>(list[currentIndex], makeConsFromList(list, currentIndex + 1));
+        ::operator delete(reinterpret_cast<char*>(cell) - run_index * sizeof(Cons));
     }
 }
 
-Cons::Cons(const std::vector<std::shared_ptr<Object>>& list)
+void Cons::operator delete(Cons* cell, std::destroying_delete_t)
 {
-    if (list.empty())
-        throw std::runtime_error("The list is empty");
+    // Cells that die while another one is being freed, such as the rest of
+    // its list or the lists in its car, are queued in the outermost call
+    // instead of being freed recursively. The queue is not a static, as
+    // cells may still die after the thread's statics are gone.
+    static thread_local std::vector<Cons*>* pending = nullptr;
+    if (pending) {
+        pending->push_back(cell);
+        return;
+    }
+
+    std::vector<Cons*> cells;
+    pending = &cells;
+    free_cell(cell);
+    while (!cells.empty()) {
+        Cons* dead = cells.back();
+        cells.pop_back();
+        free_cell(dead);
+    }
+    pending = nullptr;
+}
+
+Ref<Object> Cons::cdr() const
+{
+    switch (this->cdr_code) {
+    case CdrCode::Stored:
+        return static_cast<const Pair*>(this)->rest;
+    case CdrCode::Next:
+        return Ref<Object>(const_cast<Cons*>(this->next()));
+    default:
+        return Object::nil();
+    }
+}
 
-    std::shared_ptr<Cons> newCons = makeConsFromList(list, 0);
-    this->car = newCons->car;
-    this->cdr = newCons->cdr;
+const Cons* Cons::next() const
+{
+    switch (this->cdr_code) {
+    case CdrCode::Stored: {
+        const Ref<Object>& rest = static_cast<const Pair*>(this)->rest;
+        return Object::is<Cons>(rest) ? Object::as<Cons>(rest) : nullptr;
+    }
+    case CdrCode::Next:
+        return std::launder(reinterpret_cast<const Cons*>(reinterpret_cast<const char*>(this) + sizeof(Cons)));
+    default:
+        return nullptr;
+    }
 }
 
-std::vector<std::shared_ptr<Object>> Cons::toList() const
+std::vector<Ref<Object>> Cons::toList() const
 {
-    std::vector<std::shared_ptr<Object>> list;
+    std::vector<Ref<Object>> list;
     list.push_back(this->car);
-    std::shared_ptr<Object> argIt = this->cdr;
-    while (Object::is_true(argIt)) {
-        std::shared_ptr<Cons> consIt = std::dynamic_pointer_cast<Cons>(argIt);
-        if (!consIt)
-            throw std::runtime_error("Error: Not a proper list.");
-        list.push_back(consIt->car);
-        argIt = consIt->cdr;
+    const Cons* cell = this;
+    for (const Cons* next = cell->next(); next; next = next->next()) {
+        list.push_back(next->car);
+        cell = next;
     }
+    if (Object::is_true(cell->cdr()))
+        throw std::runtime_error("Error: Not a proper list.");
     return list;
 }
 
-std::shared_ptr<Object> Cons::eval_impl(
-    const std::shared_ptr<Object>& obj [[maybe_unused]], Environment& lex_env) const
+std::optional<std::vector<Ref<Object>>> Cons::elements() const
 {
-    std::shared_ptr<Symbol> func_name = std::dynamic_pointer_cast<Symbol>(this->car);
-    if (!func_name)
-        throw std::runtime_error("Expected a symbol denoting a procedure. Found a " + Object::to_string(this->car));
-    if (!func_name->function)
-        throw std::runtime_error("The symbol " + func_name->name + " does not denote a procedure.");
+    std::vector<Ref<Object>> elements;
+    const Cons* last = this;
+    for (const Cons* cell = this; cell; cell = cell->next()) {
+        elements.push_back(cell->car);
+        last = cell;
+    }
+    if (!Object::is<Nil>(last->cdr()))
+        return std::nullopt;
+    return elements;
+}
 
-    if (!Object::is_true(this->cdr)) {
-        return func_name->function->apply(lex_env, {});
-    } else {
-        std::shared_ptr<Cons> arguments = std::dynamic_pointer_cast<Cons>(this->cdr);
-        if (!arguments)
+Ref<Object> Cons::eval_impl(
+    const Ref<Object>& obj [[maybe_unused]], Environment& lex_env) const
+{
+    try {
+        // The Resolver puts the procedures of the forms it rewrites in
+        // place of their names.
+        Procedure* procedure;
+        if (Object::is<Procedure>(this->car)) {
+            procedure = Object::as<Procedure>(this->car);
+        } else {
+            if (!Object::is<Symbol>(this->car))
+                throw std::runtime_error("Expected a symbol denoting a procedure. Found a " + Object::to_string(this->car));
+            const Symbol* func_name = Object::as<Symbol>(this->car);
+            if (!func_name->function)
+                throw std::runtime_error("The symbol " + func_name->name + " does not denote a procedure.");
+            procedure = func_name->function.get();
+        }
+
+        bool macro = procedure->type >= Macro::first_type && procedure->type <= Macro::last_type;
+        // A call resolved as a function call before its name was defined as
+        // a macro: the macro must see the arguments as read, not resolved.
+        if (macro && this->annotated) {
+            if (Ref<Object> original = Resolver::original(this))
+                return Object::eval(original, lex_env);
+            if (Ref<Object> expansion = Expansions::find(this, procedure, lex_env))
+                return Object::eval(expansion, lex_env);
+        }
+
+        size_t count = 0;
+        const Cons* last = this;
+        for (const Cons* it = this->next(); it; it = it->next()) {
+            count++;
+            last = it;
+        }
+        if (Object::is_true(last->cdr()))
             throw std::runtime_error("Arguments must form a list");
 
-        return func_name->function->apply(lex_env, arguments->toList());
+        ArgumentStack::Frame arguments(count);
+        for (const Cons* it = this->next(); it; it = it->next())
+            arguments.push(it->car);
+        if (macro) {
+            // Macros expand the same arguments the same way, so the call is
+            // expanded, and its expansion resolved, once.
+            Ref<Object> expansion = static_cast<Macro*>(procedure)->expand(lex_env, arguments.arguments());
+            expansion = Expansions::record(this, Ref<Procedure>(procedure), expansion, lex_env.scopes());
+            return Object::eval(expansion, lex_env);
+        }
+        return procedure->apply(lex_env, arguments.arguments());
+    } catch (const LocatedError&) {
+        throw;
+    } catch (const std::runtime_error& e) {
+        // Point at the innermost form that came from a source file.
+        std::optional<std::string> location = SourceMap::describe(this);
+        if (!location)
+            throw;
+        throw LocatedError(*location + ": " + e.what());
     }
 }
 
 void Cons::emit_impl() const
 {
-    Emitter::emit(this->car);
-    Emitter::emit(this->cdr);
+    std::vector<ListCursor> lists = { { this } };
+    while (!lists.empty()) {
+        ListCursor& list = lists.back();
+        if (list.done) {
+            Object::emit(list.cell->cdr());
+            lists.pop_back();
+            continue;
+        }
+        const Cons* cell = list.cell;
+        if (const Cons* next = cell->next())
+            list.cell = next;
+        else
+            list.done = true;
+        if (Object::is<Cons>(cell->car))
+            lists.push_back({ Object::as<Cons>(cell->car) });
+        else
+            Object::emit(cell->car);
+    }
 }
 
 std::string Cons::to_string_impl() const
 {
     std::stringstream s;
     s << "(";
-    s << Object::to_string(this->car);
-    std::shared_ptr<Object> listIt = this->cdr;
-    while (Object::is_true(listIt)) {
-        s << " ";
-        std::shared_ptr<Cons> maybeCons = std::dynamic_pointer_cast<Cons>(listIt);
-        if (maybeCons) {
-            s << Object::to_string(maybeCons->car);
-            listIt = maybeCons->cdr;
+    std::vector<ListCursor> lists = { { this } };
+    while (!lists.empty()) {
+        ListCursor& list = lists.back();
+        if (list.done) {
+            Ref<Object> tail = list.cell->cdr();
+            if (Object::is_true(tail)) {
+                s << " . ";
+                s << Object::to_string(tail);
+            }
+            s << ")";
+            lists.pop_back();
+            continue;
+        }
+        const Cons* cell = list.cell;
+        if (!list.first)
+            s << " ";
+        list.first = false;
+        if (const Cons* next = cell->next())
+            list.cell = next;
+        else
+            list.done = true;
+        if (Object::is<Cons>(cell->car)) {
+            s << "(";
+            lists.push_back({ Object::as<Cons>(cell->car) });
         } else {
-            s << ". ";
-            s << Object::to_string(listIt);
-            break;
+            s << Object::to_string(cell->car);
         }
     }
-    s << ")";
 
     return s.str();
 }
 
-bool Cons::typep_impl(const std::shared_ptr<Symbol>& sym) const
+void Cons::trace_impl(Tracer& tracer) const
 {
-    return sym->name == "cons" || sym->name == "list";
+    // The collector only traces the first cell of each run.
+    const Cons* cell = this;
+    for (;; cell = cell->next()) {
+        tracer.mark(cell->car);
+        if (cell->annotated)
+            Annotations::trace(cell, tracer);
+        if (cell->cdr_code != CdrCode::Next)
+            break;
+    }
+    if (cell->cdr_code == CdrCode::Stored)
+        tracer.mark(static_cast<const Pair*>(cell)->rest);
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> Nil::eval_impl(
-    const std::shared_ptr<Object>& obj, Environment& lex_env [[maybe_unused]]) const
+Pair::Pair(const Ref<Object>& _car, const Ref<Object>& _cdr)
+    : Cons(CdrCode::Stored, standalone, _car)
+    , rest(_cdr)
 {
-    return obj;
 }
 
-std::string Nil::to_string_impl() const
+Pair::Pair(uint8_t _run_index, const Ref<Object>& _car, const Ref<Object>& _cdr)
+    : Cons(CdrCode::Stored, _run_index, _car)
+    , rest(_cdr)
 {
-    return "nil";
 }
 
-bool Nil::typep_impl(const std::shared_ptr<Symbol>& sym) const
+// --------------------------------------------------------------------------------
+
+Ref<Object> Nil::eval_impl(
+    const Ref<Object>& obj, Environment& lex_env [[maybe_unused]]) const
 {
-    return sym->name == "null" || sym->name == "list";
+    return obj;
+}
+
+std::string Nil::to_string_impl() const
+{
+    return "nil";
 }
@@ -2,207 +2,494 @@
 #pragma once
 
 #include "environment.hpp"
+#include "ref.hpp"
+#include <cassert>
+#include <cstdint>
 #include <memory>
+#include <new>
 #include <optional>
+#include <span>
+#include <string_view>
 #include <vector>
 
-class Object {
+class Tracer;
+
+class Object : public Counted {
+    friend class Tracer;
+
 public:
-    static std::shared_ptr<Object> eval(const std::shared_ptr<Object>& obj, Environment& lex_env);
-    static void emit(const std::shared_ptr<Object>& obj);
-    static std::string to_string(const std::shared_ptr<Object>& obj);
-    static bool is_true(const std::shared_ptr<Object>& obj);
-    static bool eq(const std::shared_ptr<Object>& obj1, const std::shared_ptr<Object>& obj2);
-    static bool typep(const std::shared_ptr<Object>& obj, const std::shared_ptr<Symbol>& sym);
+#ifdef ALMA_MANAGED_HEAP
+    // Objects are owned by the managed heap.
+    static constexpr bool reference_counted = false;
+#endif
+
+    // Concrete type of an object. Every class covers a contiguous range of
+    // tags, given by its first_type and last_type, so subclasses must be
+    // listed right after their base.
+    enum class Type : uint8_t {
+        Integer,
+        String,
+        SpecialOperator,
+        Function,
+        FunctionUser,
+        Macro,
+        MacroUser,
+        Symbol,
+        Cons,
+        Nil,
+        Package,
+        LexicalVariable,
+        GlobalVariable,
+        Cell,
+        Fixnum, // Immediate integers, which have no object
+    };
+
+    // Stored in the padding after the reference count.
+    const Type type;
+
+    explicit Object(Type _type)
+        : type(_type)
+    {
+    }
+    virtual ~Object() = default;
+
+    static Ref<Object> eval(const Ref<Object>& obj, Environment& lex_env);
+    static void emit(const Ref<Object>& obj);
+    static std::string to_string(const Ref<Object>& obj);
+    static bool is_true(const Ref<Object>& obj);
+    static bool eq(const Ref<Object>& obj1, const Ref<Object>& obj2);
+    static bool typep(const Ref<Object>& obj, const Ref<Symbol>& sym);
+    // Structural equality: integers by value, strings by content and lists
+    // element by element. Anything else is only equal to itself.
+    static bool equal(const Ref<Object>& obj1, const Ref<Object>& obj2);
+    // Hash of obj that agrees with equal.
+    static uint64_t sxhash(const Ref<Object>& obj);
+
+    // Integers in fixnum range are immediate: the pointer holds the value,
+    // tagged in its low bit, and there is no object behind it. Objects that
+    // may be fixnums must go through these helpers and cast instead of being
+    // dereferenced.
+    static Ref<Object> integer(int64_t value);
+    static std::optional<int64_t> integer_value(const Ref<Object>& obj);
+    static bool is_fixnum(const Ref<Object>& obj)
+    {
+        return reinterpret_cast<uintptr_t>(obj.get()) & 1;
+    }
+
+    // The type tag of obj, Fixnum for immediate integers.
+    static Type type_of(const Ref<Object>& obj)
+    {
+        return is_fixnum(obj) ? Type::Fixnum : obj->type;
+    }
+    // Whether obj is a T. A single compare of its type tag.
+    template <typename T>
+    static bool is(const Ref<Object>& obj)
+    {
+        if (!obj || is_fixnum(obj))
+            return false;
+        if constexpr (T::first_type == T::last_type)
+            return obj->type == T::first_type;
+        else
+            return obj->type >= T::first_type && obj->type <= T::last_type;
+    }
+    // obj as a T, without checking in release builds. It must be one.
+    template <typename T>
+    static T* as(const Ref<Object>& obj)
+    {
+        assert(is<T>(obj) && dynamic_cast<T*>(obj.get()));
+        return static_cast<T*>(obj.get());
+    }
+    // obj as a T, or null if it is not one.
+    template <typename T>
+    static Ref<T> cast(const Ref<Object>& obj)
+    {
+        return is<T>(obj) ? Ref<T>(as<T>(obj)) : nullptr;
+    }
+
+    // The canonical nil and t. Copying them touches no reference count.
+    static const Ref<Object>& nil();
+    static const Ref<Object>& t();
 
 protected:
-    virtual std::shared_ptr<Object> eval_impl(
-        const std::shared_ptr<Object>& obj, Environment& lex_env) const
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const
         = 0;
     virtual void emit_impl() const = 0;
     virtual std::string to_string_impl() const = 0;
-    virtual operator bool() const { return true; }
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const = 0;
+    // Marks the objects this one refers to.
+    virtual void trace_impl(Tracer& tracer [[maybe_unused]]) const { }
 };
 
-// Integer
+// Integer outside the fixnum range
 struct Integer : Object {
+    static constexpr Type first_type = Type::Integer;
+    static constexpr Type last_type = Type::Integer;
+
     int64_t value;
 
     Integer(int64_t _value);
 
-    virtual std::shared_ptr<Object> eval_impl(
-        const std::shared_ptr<Object>& obj, Environment& lex_env) const override;
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const override;
     virtual void emit_impl() const override;
     virtual std::string to_string_impl() const override;
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
 };
 
-// string
+// string. The content is immutable and shared with every other string
+// of the same text.
 struct String : Object {
-    std::string content;
+    static constexpr Type first_type = Type::String;
+    static constexpr Type last_type = Type::String;
 
-    String(const std::string& content);
+    std::string_view content;
 
-    virtual std::shared_ptr<Object> eval_impl(
-        const std::shared_ptr<Object>& obj, Environment& lex_env) const override;
+    String(std::string_view content);
+
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const override;
     virtual void emit_impl() const override;
     virtual std::string to_string_impl() const override;
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
 };
 
 // procedure
 struct Procedure : Object {
+    static constexpr Type first_type = Type::SpecialOperator;
+    static constexpr Type last_type = Type::MacroUser;
+
     std::optional<std::string> name;
 
-    Procedure() = default;
+    Procedure()
+        : Object(Type::SpecialOperator)
+    {
+    }
     Procedure(const Procedure& other) = default;
     template <typename Name>
-    Procedure(Name&& _name)
-        : name(_name)
+    Procedure(Type _type, Name&& _name)
+        : Object(_type)
+        , name(_name)
     {
     }
 
-    virtual std::shared_ptr<Object> eval_impl(
-        const std::shared_ptr<Object>& obj, Environment& lex_env) const override;
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const override;
     virtual void emit_impl() const override;
     virtual std::string to_string_impl() const override;
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
 
-    virtual std::shared_ptr<Object> apply(Environment& lex_env,
-        const std::vector<std::shared_ptr<Object>>& arguments)
+    virtual Ref<Object> apply(Environment& lex_env,
+        std::span<const Ref<Object>> arguments)
         = 0;
 };
 
 struct Function : Procedure {
+    static constexpr Type first_type = Type::Function;
+    static constexpr Type last_type = Type::FunctionUser;
+
     template <typename Name>
     Function(Name&& _name)
-        : Procedure(std::forward<Name>(_name))
+        : Procedure(Type::Function, std::forward<Name>(_name))
     {
     }
 
-private:
-    static std::vector<std::shared_ptr<Object>> eval_args(
-        const std::vector<std::shared_ptr<Object>>& args,
-        Environment& lex_env);
+protected:
+    template <typename Name>
+    Function(Type _type, Name&& _name)
+        : Procedure(_type, std::forward<Name>(_name))
+    {
+    }
 
 protected:
-    virtual std::shared_ptr<Object> eval_body(
-        const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env)
+    virtual Ref<Object> eval_body(
+        std::span<const Ref<Object>> args, Environment& lex_env)
         = 0;
 
 public:
-    virtual std::shared_ptr<Object> apply(
-        Environment& lex_env, const std::vector<std::shared_ptr<Object>>& arguments) override;
+    virtual Ref<Object> apply(
+        Environment& lex_env, std::span<const Ref<Object>> arguments) override;
+    // Calls it with arguments evaluated already.
+    Ref<Object> call(std::span<const Ref<Object>> args, Environment& lex_env)
+    {
+        return this->eval_body(args, lex_env);
+    }
+};
 
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
+// The code of a lambda or gamma form, as resolved by the Resolver. Shared
+// by every closure created from the same form.
+struct LambdaCode : Counted {
+    Ref<Environment::Scope> captures; // Variables its closures capture
+    std::vector<Environment::Capture> sources; // Where they are captured from
+    Ref<Environment::Scope> params; // The lexical ones
+    // Per parameter, the special variable it binds, or null if it is
+    // lexical. Empty when none is special.
+    std::vector<Ref<Symbol>> specials;
+    std::vector<Ref<Object>> body;
+    mutable std::unique_ptr<struct Bytecode> bytecode; // Null if it runs on the tree walker
+    // Bytecode replaced by refresh, kept for the calls that may still run it.
+    mutable std::vector<std::unique_ptr<struct Bytecode>> retired;
+
+    LambdaCode();
+    ~LambdaCode(); // Where Bytecode is complete
+
+    // Runs the body for a closure with the given cells. Each call binds its
+    // arguments in a frame of its own, under one for the captured
+    // variables, except those of special parameters, which it binds
+    // dynamically.
+    Ref<Object> call(std::vector<Ref<Object>>& cells, std::span<const Ref<Object>> args) const;
+    // Compiles the body again if its bytecode expanded a macro that has
+    // been redefined since.
+    void refresh() const;
+    // Throws unless it takes count arguments.
+    void check_arity(size_t count) const;
+    void trace(Tracer& tracer) const;
 };
 
 struct FunctionUser : Function {
-    Environment closure;
-    std::vector<std::shared_ptr<Symbol>> params;
-    std::vector<std::shared_ptr<Object>> body;
+    static constexpr Type first_type = Type::FunctionUser;
+    static constexpr Type last_type = Type::FunctionUser;
+
+    Ref<LambdaCode> code;
+    std::vector<Ref<Object>> cells; // Of the variables it captured
 
     FunctionUser(const FunctionUser& other) = default;
-    template <typename Name, typename Closure, typename Params, typename Body>
-    FunctionUser(Name&& _name, Closure&& _closure, Params&& _params, Body&& _body)
-        : Function(std::forward<Name>(_name))
-        , closure(_closure)
-        , params(std::forward<Params>(_params))
-        , body(std::forward<Body>(_body))
+    template <typename Name, typename Cells>
+    FunctionUser(Name&& _name, const Ref<LambdaCode>& _code, Cells&& _cells)
+        : Function(Type::FunctionUser, std::forward<Name>(_name))
+        , code(_code)
+        , cells(std::forward<Cells>(_cells))
     {
     }
 
 protected:
-    virtual std::shared_ptr<Object> eval_body(
-        const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env) override;
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
+    virtual Ref<Object> eval_body(
+        std::span<const Ref<Object>> args, Environment& lex_env) override;
+    virtual void trace_impl(Tracer& tracer) const override;
 };
 
 struct Macro : Procedure {
+    static constexpr Type first_type = Type::Macro;
+    static constexpr Type last_type = Type::MacroUser;
+
     template <typename Name>
     Macro(Name&& _name)
-        : Procedure(std::forward<Name>(_name))
+        : Procedure(Type::Macro, std::forward<Name>(_name))
+    {
+    }
+
+protected:
+    template <typename Name>
+    Macro(Type _type, Name&& _name)
+        : Procedure(_type, std::forward<Name>(_name))
     {
     }
 
 protected:
-    virtual std::shared_ptr<Object> eval_body(
-        const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env)
+    virtual Ref<Object> eval_body(
+        std::span<const Ref<Object>> args, Environment& lex_env)
         = 0;
 
 public:
-    virtual std::shared_ptr<Object> apply(
-        Environment& lex_env, const std::vector<std::shared_ptr<Object>>& arguments) override;
-    std::shared_ptr<Object> expand(Environment& lex_env, const std::vector<std::shared_ptr<Object>>& arguments);
-
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
+    virtual Ref<Object> apply(
+        Environment& lex_env, std::span<const Ref<Object>> arguments) override;
+    Ref<Object> expand(Environment& lex_env, std::span<const Ref<Object>> arguments);
 };
 
 struct MacroUser : Macro {
-    Environment closure;
-    std::vector<std::shared_ptr<Symbol>> params;
-    std::vector<std::shared_ptr<Object>> body;
+    static constexpr Type first_type = Type::MacroUser;
+    static constexpr Type last_type = Type::MacroUser;
+
+    Ref<LambdaCode> code;
+    std::vector<Ref<Object>> cells; // Of the variables it captured
 
     MacroUser(const MacroUser& other) = default;
-    template <typename Name, typename Closure, typename Params, typename Body>
-    MacroUser(Name&& _name, Closure&& _closure, Params&& _params, Body&& _body)
-        : Macro(std::forward<Name>(_name))
-        , closure(_closure)
-        , params(std::forward<Params>(_params))
-        , body(std::forward<Body>(_body))
+    template <typename Name, typename Cells>
+    MacroUser(Name&& _name, const Ref<LambdaCode>& _code, Cells&& _cells)
+        : Macro(Type::MacroUser, std::forward<Name>(_name))
+        , code(_code)
+        , cells(std::forward<Cells>(_cells))
     {
     }
 
 protected:
-    virtual std::shared_ptr<Object> eval_body(
-        const std::vector<std::shared_ptr<Object>>& args, Environment& lex_env) override;
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
+    virtual Ref<Object> eval_body(
+        std::span<const Ref<Object>> args, Environment& lex_env) override;
+    virtual void trace_impl(Tracer& tracer) const override;
 };
 
 // symbol
 struct Symbol : Object {
+    static constexpr Type first_type = Type::Symbol;
+    static constexpr Type last_type = Type::Symbol;
+
     std::string name;
-    std::vector<std::shared_ptr<Object>> values;
-    std::shared_ptr<Procedure> function;
-    std::shared_ptr<class Package> package;
+    Ref<Object> value; // Global value, or null while unbound
+    Ref<Procedure> function;
+    uint64_t type_bit = 0; // Its bit in the type lattice, if it names a type
+    bool special = false; // Bound dynamically, declared by defvar or defparameter
+    Ref<class Package> package;
 
     Symbol(const std::string& _name);
+    ~Symbol(); // Where Package is complete
 
-    virtual std::shared_ptr<Object> eval_impl(
-        const std::shared_ptr<Object>& obj, Environment& lex_env) const override;
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const override;
     virtual void emit_impl() const override;
     virtual std::string to_string_impl() const override;
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
+    virtual void trace_impl(Tracer& tracer) const override;
 };
 
-// cons
-struct Cons : Object {
-    std::shared_ptr<Object> car;
-    std::shared_ptr<Object> cdr;
+// A reference to a lexical variable in code resolved by the Resolver: the
+// slot the variable lives in. Only found in the bodies of closures, never
+// handed to programs.
+struct LexicalVariable : Object {
+    static constexpr Type first_type = Type::LexicalVariable;
+    static constexpr Type last_type = Type::LexicalVariable;
+
+    uint32_t depth; // Frames out from the innermost one
+    uint32_t index;
+    Ref<Symbol> symbol;
+
+    LexicalVariable(uint32_t _depth, uint32_t _index, const Ref<Symbol>& _symbol)
+        : Object(Type::LexicalVariable)
+        , depth(_depth)
+        , index(_index)
+        , symbol(_symbol)
+    {
+    }
+
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const override;
+    virtual void emit_impl() const override;
+    virtual std::string to_string_impl() const override;
+    virtual void trace_impl(Tracer& tracer) const override;
+};
+
+// A reference to a global variable in code resolved by the Resolver, made
+// for each symbol that names no lexical variable in scope. Reads the value
+// of the symbol without looking for a lexical binding first.
+struct GlobalVariable : Object {
+    static constexpr Type first_type = Type::GlobalVariable;
+    static constexpr Type last_type = Type::GlobalVariable;
+
+    Ref<Symbol> symbol;
+
+    GlobalVariable(const Ref<Symbol>& _symbol)
+        : Object(Type::GlobalVariable)
+        , symbol(_symbol)
+    {
+    }
+
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const override;
+    virtual void emit_impl() const override;
+    virtual std::string to_string_impl() const override;
+    virtual void trace_impl(Tracer& tracer) const override;
+};
 
-    Cons(const std::shared_ptr<Object>& _car, const std::shared_ptr<Object>& _cdr);
-    Cons(const std::vector<std::shared_ptr<Object>>& list);
+// A variable captured by a closure, shared by the frame that binds it and
+// every closure that captures it. Only found in the slots of frames.
+struct Cell : Object {
+    static constexpr Type first_type = Type::Cell;
+    static constexpr Type last_type = Type::Cell;
 
-    std::vector<std::shared_ptr<Object>> toList() const;
+    Ref<Object> value;
 
-    virtual std::shared_ptr<Object> eval_impl(
-        const std::shared_ptr<Object>& obj, Environment& lex_env) const override;
+    Cell(const Ref<Object>& _value)
+        : Object(Type::Cell)
+        , value(_value)
+    {
+    }
+
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const override;
+    virtual void emit_impl() const override;
+    virtual std::string to_string_impl() const override;
+    virtual void trace_impl(Tracer& tracer) const override;
+};
+
+// cons. Lists built all at once are CDR-coded: their cells are laid out
+// one after another in runs, each cell implicitly followed by the next, so
+// a cell only holds its car. Conses built on their own are Pairs, which
+// store their cdr.
+struct Cons : Object {
+    static constexpr Type first_type = Type::Cons;
+    static constexpr Type last_type = Type::Cons;
+
+    // Where the cdr of a cell is.
+    enum class CdrCode : uint8_t {
+        Stored, // In the Pair
+        Next, // The cell right after this one
+        Nil, // nil, the end of a compact list
+    };
+
+    // Stored in the padding of Object, like its type.
+    const CdrCode cdr_code : 2;
+    // Whether the SourceMap has an entry for the cell, which it drops when
+    // the cell dies so that a later object at the same address does not
+    // inherit it.
+    bool located : 1 = false;
+    // Whether it is the copy of its structure kept by HashCons, which no
+    // other copy there is equal to.
+    bool canonical : 1 = false;
+    // Whether the cell has an entry in the Annotations, which is dropped
+    // when the cell dies.
+    mutable bool annotated : 1 = false;
+    // Position in its run, or standalone for a Pair built on its own.
+    const uint8_t run_index;
+    Ref<Object> car;
+
+    static constexpr uint8_t standalone = 0xff;
+
+    // A compact list of the elements, which must not be empty.
+    static Ref<Cons> list(std::span<const Ref<Object>> elements);
+
+    ~Cons();
+    // Frees the run of a cell once its last cell dies.
+    static void operator delete(Cons* cell, std::destroying_delete_t);
+
+    Ref<Object> cdr() const;
+    // The cell after this one, or null if the cdr is not a cons. Walks
+    // lists without counting references.
+    const Cons* next() const;
+
+    std::vector<Ref<Object>> toList() const;
+    // The elements of the list, or nullopt if it is dotted.
+    std::optional<std::vector<Ref<Object>>> elements() const;
+
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const override;
     virtual void emit_impl() const override;
     virtual std::string to_string_impl() const override;
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
+    virtual void trace_impl(Tracer& tracer) const override;
+
+protected:
+    Cons(CdrCode _cdr_code, uint8_t _run_index, const Ref<Object>& _car);
+};
+
+// Cons that stores its cdr. It shares the type tag of Cons, so tell them
+// apart by cdr_code.
+struct Pair : Cons {
+    friend struct Cons;
+
+    Ref<Object> rest;
+
+    Pair(const Ref<Object>& _car, const Ref<Object>& _cdr);
+
+private:
+    // The last cell of a run that is followed by another one.
+    Pair(uint8_t _run_index, const Ref<Object>& _car, const Ref<Object>& _cdr);
 };
 
 // nil
 struct Nil : Object {
+    static constexpr Type first_type = Type::Nil;
+    static constexpr Type last_type = Type::Nil;
+
     Nil()
+        : Object(Type::Nil)
     {
     }
 
-    virtual std::shared_ptr<Object> eval_impl(
-        const std::shared_ptr<Object>& obj, Environment& lex_env) const override;
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const override;
     virtual void emit_impl() const override { }
-    virtual operator bool() const override { return false; }
     virtual std::string to_string_impl() const override;
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
 };
@@ -1,30 +1,53 @@
 
 #include "package.hpp"
+#include "heap.hpp"
 #include <iostream>
+#include <mutex>
 
-std::shared_ptr<Package> Package::almaPackage;
-std::shared_ptr<Package> Package::currentPackage;
+Ref<Package> Package::almaPackage;
+Ref<Package> Package::currentPackage;
 
 void Package::initAlmaPackage()
 {
-    Package::almaPackage = std::make_shared<Package>();
+    // Pinned, like interned symbols.
+    Package::almaPackage = make<Package>();
+    Package::almaPackage->pin();
     Package::currentPackage = Package::almaPackage;
 }
 
-std::optional<std::shared_ptr<Symbol>> Package::find_symbol(const std::string& name)
+std::optional<Ref<Symbol>> Package::find_symbol(std::string_view name)
 {
-    if (this->symbols.contains(name)) {
-        return this->symbols[name];
+    auto it = this->symbols.find(name);
+    if (it != this->symbols.end()) {
+        return it->second;
     } else {
         return std::nullopt;
     }
 }
 
-std::shared_ptr<Symbol>& Package::intern_symbol(const std::string& name)
+Ref<Symbol>& Package::intern_symbol(std::string_view name)
 {
-    if (!this->symbols.contains(name))
-        this->symbols.try_emplace(name, std::make_shared<Symbol>(name));
-    return this->symbols[name];
+    auto it = this->symbols.find(name);
+    if (it == this->symbols.end()) {
+        // Interned symbols are shared by the reader threads, so they are
+        // never counted. Their package keeps them alive.
+        Ref<Symbol> symbol = make<Symbol>(std::string(name));
+        symbol->pin();
+        it = this->symbols.try_emplace(std::string(name), std::move(symbol)).first;
+    }
+    return it->second;
+}
+
+Ref<Symbol> Package::intern_symbol_concurrent(std::string_view name)
+{
+    {
+        std::shared_lock lock(this->symbols_mutex);
+        auto it = this->symbols.find(name);
+        if (it != this->symbols.end())
+            return it->second;
+    }
+    std::unique_lock lock(this->symbols_mutex);
+    return this->intern_symbol(name);
 }
 
 void Package::emit_impl() const
@@ -32,8 +55,8 @@ void Package::emit_impl() const
     throw std::runtime_error("A package cannot be emitted");
 }
 
-std::shared_ptr<Object> Package::eval_impl(
-    const std::shared_ptr<Object>& obj, Environment& lex_env [[maybe_unused]]) const
+Ref<Object> Package::eval_impl(
+    const Ref<Object>& obj, Environment& lex_env [[maybe_unused]]) const
 {
     return obj;
 }
@@ -43,7 +66,8 @@ std::string Package::to_string_impl() const
     return "<package>";
 }
 
-bool Package::typep_impl(const std::shared_ptr<Symbol>& sym) const
+void Package::trace_impl(Tracer& tracer) const
 {
-    return sym->name == "package";
+    for (const auto& [name, symbol] : this->symbols)
+        tracer.mark(symbol);
 }
@@ -4,25 +4,39 @@
 #include "objects.hpp"
 #include <map>
 #include <optional>
+#include <shared_mutex>
+#include <string_view>
 
 class Package : public Object {
 public:
-    static std::shared_ptr<Package> almaPackage;
-    static std::shared_ptr<Package> currentPackage;
+    static constexpr Type first_type = Type::Package;
+    static constexpr Type last_type = Type::Package;
+
+    Package()
+        : Object(Type::Package)
+    {
+    }
+
+    static Ref<Package> almaPackage;
+    static Ref<Package> currentPackage;
 
     static void initAlmaPackage();
 
 private:
-    std::map<std::string, std::shared_ptr<Symbol>> symbols;
+    std::map<std::string, Ref<Symbol>, std::less<>> symbols;
+    std::shared_mutex symbols_mutex;
 
 public:
-    std::optional<std::shared_ptr<Symbol>> find_symbol(const std::string& name);
-    std::shared_ptr<Symbol>& intern_symbol(const std::string& name);
+    std::optional<Ref<Symbol>> find_symbol(std::string_view name);
+    Ref<Symbol>& intern_symbol(std::string_view name);
+    // Safe to call from several threads at once, as long as no other
+    // member is used meanwhile.
+    Ref<Symbol> intern_symbol_concurrent(std::string_view name);
 
 public:
-    virtual std::shared_ptr<Object> eval_impl(
-        const std::shared_ptr<Object>& obj, Environment& lex_env) const override;
+    virtual Ref<Object> eval_impl(
+        const Ref<Object>& obj, Environment& lex_env) const override;
     virtual void emit_impl() const override;
     virtual std::string to_string_impl() const override;
-    virtual bool typep_impl(const std::shared_ptr<Symbol>& sym) const override;
+    virtual void trace_impl(Tracer& tracer) const override;
 };
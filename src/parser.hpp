@@ -1,13 +1,18 @@
 
 #pragma once
 
+#include "form_cache.hpp"
 #include "grammar.hpp"
+#include "heap.hpp"
+#include "mapped_file.hpp"
 #include "objects.hpp"
 #include "package.hpp"
 #include "reader.hpp"
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <string>
 #include <tao/pegtl.hpp>
 
 namespace peg = tao::pegtl;
@@ -17,33 +22,133 @@ struct make_ast;
 
 class ast {
 private:
-    std::vector<std::shared_ptr<Object>> expressions;
+    std::vector<Ref<Object>> expressions;
+    // The source of the forms, mapped or, if it cannot be, read whole, for
+    // what follows the batch to be read once it has run.
+    std::unique_ptr<MappedFile> mapping;
+    std::string text;
+    std::string_view source;
+    uint32_t file_id = 0;
+    std::vector<size_t> ends;
+    size_t end = 0;
+    bool stopped = false;
+
+    // Reads and evaluates the forms of the source from offset on, one at a
+    // time, like stream.
+    void stream_from(size_t offset, Environment& lex_env)
+    {
+        reader::BufferInput input(this->source, this->file_id);
+        input.seek(this->source.data() + offset);
+        Heap::TopLevel top_level(lex_env, {});
+        while (Ref<Object> expr = reader::read(input)) {
+            Object::eval(expr, lex_env);
+            if (this->mapping)
+                this->mapping->release_before(input.position());
+            Heap::safepoint();
+        }
+    }
 
 public:
     ast()
     {
     }
 
-    void read(const std::filesystem::path& file)
+    // Reads the file in one batch, up to the first call of
+    // set-macro-character. Regular files are mapped and, when jobs > 1,
+    // parsed on that many threads. With a cache_dir, the batch of a file
+    // already read once is loaded from there instead.
+    void read(const std::filesystem::path& file, unsigned jobs = 1, const std::filesystem::path& cache_dir = {})
     {
-        std::ifstream file_input(file);
-        while (std::shared_ptr<Object> expr = reader::read(file_input))
-            expressions.push_back(expr);
+        this->file_id = SourceMap::add_file(file.string());
+        if (std::filesystem::is_regular_file(file)) {
+            this->mapping = std::make_unique<MappedFile>(file);
+            this->source = this->mapping->contents();
+        } else {
+            std::ifstream file_input(file, std::ios::binary);
+            this->text.assign(std::istreambuf_iterator<char>(file_input), std::istreambuf_iterator<char>());
+            this->source = this->text;
+        }
+
+        std::optional<FormCache> cache;
+        if (this->mapping && !cache_dir.empty() && reader::standard_readtable())
+            cache.emplace(cache_dir, this->source);
+        std::optional<reader::Batch> batch;
+        if (cache)
+            batch = cache->load(this->file_id);
+        if (!batch) {
+            batch = reader::read_parallel(this->source, this->file_id, jobs);
+            if (cache)
+                cache->store(*batch);
+        }
+        this->expressions = std::move(batch->forms);
+        this->ends = std::move(batch->ends);
+        this->end = batch->end;
+        this->stopped = batch->stopped;
+        if (this->mapping)
+            this->mapping->release_before(this->source.data() + this->end);
     }
 
+    // Whether reading stopped at a call of set-macro-character, before the
+    // forms that may use it.
+    bool stopped_early() const { return this->stopped; }
+
+    // Reads and evaluates one top-level form at a time. Only the form being
+    // evaluated is kept alive, and its effects happen before the next one is
+    // read.
+    void stream(const std::filesystem::path& file, Environment& lex_env)
+    {
+        if (std::filesystem::is_regular_file(file)) {
+            MappedFile mapped(file);
+            reader::BufferInput input(mapped.contents(), SourceMap::add_file(file.string()));
+            Heap::TopLevel top_level(lex_env, {});
+            while (Ref<Object> expr = reader::read(input)) {
+                Object::eval(expr, lex_env);
+                mapped.release_before(input.position());
+                Heap::safepoint();
+            }
+        } else {
+            std::ifstream file_input(file);
+            stream(file_input, file.string(), lex_env);
+        }
+    }
+
+    void stream(std::istream& input, const std::string& name, Environment& lex_env)
+    {
+        reader::StreamInput stream_input(input, SourceMap::add_file(name));
+        Heap::TopLevel top_level(lex_env, {});
+        while (Ref<Object> expr = reader::read(stream_input)) {
+            Object::eval(expr, lex_env);
+            Heap::safepoint();
+        }
+    }
+
+    // Evaluates the forms read, then reads and evaluates the rest of the
+    // source form by form. A form that sets a macro character is the last
+    // one evaluated from the batch, as those after it were read without.
     void eval(Environment& lex_env)
     {
-        for (std::shared_ptr<Object>& expression : this->expressions) {
-            Object::eval(expression, lex_env);
+        Heap::TopLevel top_level(lex_env, this->expressions);
+        bool standard = reader::standard_readtable();
+        size_t rest = this->end;
+        for (size_t i = 0; i < this->expressions.size(); i++) {
+            Object::eval(this->expressions[i], lex_env);
+            Heap::safepoint();
+            if (standard && !reader::standard_readtable()) {
+                rest = this->ends[i];
+                break;
+            }
         }
+        this->stream_from(rest, lex_env);
     }
 
+    const std::vector<Ref<Object>>& forms() const { return this->expressions; }
+
     void print() const
     {
         if (this->expressions.empty()) {
             std::cout << ";; No values" << std::endl;
         } else {
-            for (const std::shared_ptr<Object>& expression : this->expressions) {
+            for (const Ref<Object>& expression : this->expressions) {
                 std::cout << Object::to_string(expression) << std::endl;
             }
         }
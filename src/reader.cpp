@@ -1,258 +1,630 @@
 
 #include "reader.hpp"
+#include "hash_cons.hpp"
+#include "heap.hpp"
 #include "package.hpp"
+#include <array>
+#include <atomic>
 #include <iostream>
-#include <regex>
+#include <optional>
+#include <thread>
 
-#define maybe(EXPR)                               \
-    if (std::shared_ptr<Object> __obj__ = EXPR) { \
-        return __obj__;                           \
-    }
+// --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> reader::read(std::istream& input)
+void reader::StreamInput::skip_whitespace()
 {
-    maybe(reader::read_whitespace(input)); // Consume whitespaces
-    maybe(reader::read_comment(input));
-    maybe(reader::read_list(input));
-    maybe(reader::read_quote(input));
-    maybe(reader::read_quasiquote(input));
-    maybe(reader::read_unquote(input));
-    maybe(reader::read_string(input));
-    maybe(reader::read_token(input));
-    return nullptr;
+    while (scanner::is_whitespace(this->input.peek()))
+        this->get();
 }
 
-std::shared_ptr<Object> reader::read_whitespace(std::istream& input)
+void reader::StreamInput::skip_line()
 {
     while (true) {
-        int c = input.get();
-        if (c == EOF)
-            return nullptr;
-        if (!(c == ' ' || c == '\n' || c == '\t')) {
-            input.unget();
-            return nullptr;
-        }
+        int c = this->input.peek();
+        if (c == EOF || c == '\n')
+            return;
+        this->get();
     }
 }
 
-std::shared_ptr<Object> reader::read_comment(std::istream& input)
+std::string_view reader::StreamInput::read_token()
 {
-    int c = input.get();
-    if (c != ';') {
-        input.unget();
-        return nullptr;
+    this->scratch.clear();
+    while (true) {
+        int c = this->input.peek();
+        if (c == EOF || !scanner::token_characters[c])
+            break;
+        this->scratch.push_back(this->get());
     }
-    while (char d = input.get()) {
-        if (d == EOF || d == '\n')
+    return this->scratch;
+}
+
+std::string_view reader::StreamInput::read_string_run()
+{
+    this->scratch.clear();
+    while (true) {
+        int c = this->input.peek();
+        if (c == EOF || c == '"' || c == '\\')
             break;
+        this->scratch.push_back(this->get());
     }
-    return reader::read_whitespace(input);
+    return this->scratch;
+}
+
+// --------------------------------------------------------------------------------
+
+template <typename Input>
+static Ref<Object> read_form(Input& input);
+
+// Set on the worker threads of read_parallel, which intern symbols
+// concurrently.
+static thread_local bool concurrent_interning = false;
+
+static Ref<Symbol> intern(Package& package, std::string_view name)
+{
+    if (concurrent_interning)
+        return package.intern_symbol_concurrent(name);
+    return package.intern_symbol(name);
+}
+
+// Worker threads of read_parallel collect locations here; the SourceMap is
+// only filled from the main thread.
+static thread_local std::vector<std::pair<const Object*, SourceLocation>>* deferred_locations = nullptr;
+
+// Quasiquote templates are left as read: the constant parts of their
+// expansions are made canonical instead.
+static thread_local size_t quasiquote_level = 0;
+
+static Ref<Cons> make_located(const std::vector<Ref<Object>>& list, SourceLocation location)
+{
+    Ref<Cons> cons = Cons::list(list);
+    cons->located = true;
+    if (deferred_locations)
+        deferred_locations->emplace_back(cons.get(), location);
+    else
+        SourceMap::record(cons.get(), location);
+    return cons;
 }
 
-std::shared_ptr<Object> reader::read_list(std::istream& input)
+// Where the locations of the lists read from now on start.
+static size_t location_mark()
 {
-    int lp = input.get();
-    if (lp != '(') {
-        input.unget();
-        return nullptr;
+    return deferred_locations ? deferred_locations->size() : 0;
+}
+
+// Replaces the quoted object of form by its canonical copy, if it is a
+// quote form outside quasiquote templates. The lists read since mark make
+// up that object. Worker threads may not touch the SourceMap, which the
+// lists dropped for their canonical copies would do, so they give up their
+// locations first.
+static void canonicalize_quoted(std::vector<Ref<Object>>& form, size_t mark)
+{
+    if (quasiquote_level != 0 || !HashCons::quoted(form))
+        return;
+    if (deferred_locations) {
+        for (size_t i = mark; i < deferred_locations->size(); i++)
+            static_cast<Cons*>(const_cast<Object*>((*deferred_locations)[i].first))->located = false;
+        deferred_locations->resize(mark);
     }
-    std::vector<std::shared_ptr<Object>> objects;
-    while (input) {
-        std::shared_ptr<Object> object = reader::read(input);
+    form[1] = HashCons::canonical(form[1]);
+}
+
+// --------------------------------------------------------------------------------
+
+namespace {
+
+enum class Syntax : uint8_t {
+    Invalid,
+    Whitespace,
+    Comment,
+    ListOpen,
+    Quote,
+    Quasiquote,
+    Unquote,
+    String,
+    Token,
+    Macro
+};
+
+// Maps the first character of a form to the reader that handles it.
+struct Readtable {
+    std::array<Syntax, 256> syntax;
+    std::array<Ref<Procedure>, 256> macros;
+    bool standard = true;
+
+    Readtable()
+    {
+        for (size_t c = 0; c < syntax.size(); c++)
+            syntax[c] = scanner::token_characters[c] ? Syntax::Token : Syntax::Invalid;
+        syntax[' '] = syntax['\t'] = syntax['\n'] = Syntax::Whitespace;
+        syntax[';'] = Syntax::Comment;
+        syntax['('] = Syntax::ListOpen;
+        syntax['\''] = Syntax::Quote;
+        syntax['`'] = Syntax::Quasiquote;
+        syntax[','] = Syntax::Unquote;
+        syntax['"'] = Syntax::String;
+    }
+};
+
+Readtable readtable;
+
+}
+
+void reader::set_macro_character(char c, const Ref<Procedure>& function)
+{
+    unsigned char index = c;
+    if (scanner::is_whitespace(index) || c == '(' || c == ')' || c == '"' || c == ';')
+        throw std::runtime_error("The character '" + std::string(1, c) + "' cannot be a macro character");
+
+    readtable.syntax[index] = Syntax::Macro;
+    readtable.macros[index] = function;
+    readtable.standard = false;
+}
+
+bool reader::standard_readtable()
+{
+    return readtable.standard;
+}
+
+void reader::trace(Tracer& tracer)
+{
+    for (const Ref<Procedure>& function : readtable.macros)
+        tracer.mark(function);
+}
+
+static std::string describe_character(int c)
+{
+    return c == EOF ? "end of file" : "'" + std::string(1, static_cast<char>(c)) + "'";
+}
+
+template <typename Input>
+static Ref<Object> read_list(Input& input)
+{
+    SourceLocation location = input.location();
+    input.get();
+
+    std::vector<Ref<Object>> objects;
+    // Reader macros may run code that collects.
+    Heap::Root root(objects);
+    size_t quoted_mark = 0; // Before the second element
+    while (true) {
+        if (objects.size() == 1)
+            quoted_mark = location_mark();
+        Ref<Object> object = read_form(input);
         if (!object)
             break;
-        else
-            objects.push_back(std::move(object));
+        objects.push_back(std::move(object));
     }
+
     int rp = input.get();
     if (rp != ')')
-        throw std::runtime_error("Expected the character ')' but found '" + std::string(1, (char)rp) + "'");
+        throw std::runtime_error("Expected the character ')' but found " + describe_character(rp));
 
     if (objects.empty())
-        return std::make_shared<Nil>();
-    else
-        return std::make_shared<Cons>(objects);
+        return Object::nil();
+    canonicalize_quoted(objects, quoted_mark);
+    return make_located(objects, location);
 }
 
-std::shared_ptr<Object> reader::read_quote(std::istream& input)
+template <typename Input>
+static Ref<Object> read_prefixed(Input& input, SourceLocation location, const char* prefix, std::string_view symbol_name)
 {
-    int q = input.get();
-    if (q != '\'') {
-        input.unget();
-        return nullptr;
-    }
-    std::shared_ptr<Object> object = reader::read(input);
-    std::shared_ptr<Symbol> qs = *Package::almaPackage->find_symbol("quote");
+    size_t mark = location_mark();
+    Ref<Object> object = read_form(input);
+    if (!object)
+        throw std::runtime_error(std::string("Expected an object after ") + prefix);
+    Ref<Symbol> qs = intern(*Package::almaPackage, symbol_name);
 
-    return std::make_shared<Cons>(std::vector<std::shared_ptr<Object>> { qs, object });
+    std::vector<Ref<Object>> form = { qs, object };
+    canonicalize_quoted(form, mark);
+    return make_located(form, location);
 }
 
-static size_t quasiquote_level = 0;
+template <typename Input>
+static Ref<Object> read_quote(Input& input)
+{
+    SourceLocation location = input.location();
+    input.get();
+    return read_prefixed(input, location, "'", "quote");
+}
 
-std::shared_ptr<Object> reader::read_quasiquote(std::istream& input)
+template <typename Input>
+static Ref<Object> read_quasiquote(Input& input)
 {
-    int q = input.get();
-    if (q != '`') {
-        input.unget();
-        return nullptr;
-    }
+    SourceLocation location = input.location();
+    input.get();
     quasiquote_level++;
-    std::shared_ptr<Object> object = reader::read(input);
+    Ref<Object> object = read_prefixed(input, location, "`", "quasiquote");
     quasiquote_level--;
-    std::shared_ptr<Symbol> qs = *Package::almaPackage->find_symbol("quasiquote");
-
-    return std::make_shared<Cons>(std::vector<std::shared_ptr<Object>> { qs, object });
+    return object;
 }
 
-std::shared_ptr<Object> reader::read_unquote(std::istream& input)
+template <typename Input>
+static Ref<Object> read_unquote(Input& input)
 {
-    int q = input.get();
-    if (q != ',') {
-        input.unget();
-        return nullptr;
-    }
-    bool slice = true;
-    int s = input.get();
-    if (s != '@') {
-        slice = false;
-        input.unget();
-    }
+    SourceLocation location = input.location();
+    input.get();
+    bool slice = input.peek() == '@';
+    if (slice)
+        input.get();
     if (quasiquote_level == 0)
         throw std::runtime_error(std::string(slice ? "slice-unquote" : "unquote") + " outside quasiquote");
 
     quasiquote_level--;
-    std::shared_ptr<Object> object = reader::read(input);
+    Ref<Object> object = read_prefixed(input, location, slice ? ",@" : ",", slice ? "slice-unquote" : "unquote");
     quasiquote_level++;
-    std::shared_ptr<Symbol> qs = *Package::almaPackage->find_symbol(slice ? "slice-unquote" : "unquote");
-
-    return std::make_shared<Cons>(std::vector<std::shared_ptr<Object>> { qs, object });
+    return object;
 }
 
-std::shared_ptr<Object> reader::read_string(std::istream& input)
+template <typename Input>
+static Ref<Object> read_string(Input& input)
 {
-    int q = input.get();
-    if (q != '"') {
-        input.unget();
-        return nullptr;
+    input.get();
+
+    // Literals without escapes go to the string pool straight from the
+    // input.
+    std::string_view run = input.read_string_run();
+    if (input.peek() == '"') {
+        input.get();
+        return make<String>(run);
     }
-    std::string content;
-    bool next_special = false;
-    while (input) {
+
+    std::string content(run);
+    while (true) {
         int d = input.get();
-        if (next_special) {
-            switch (d) {
-            case 'n':
-                content.push_back('\n');
-                break;
-            case 'b':
-                content.push_back(' ');
-                break;
-            case 't':
-                content.push_back('\t');
-                break;
-            case '"':
-                content.push_back('"');
-                break;
-            case '\\':
-                content.push_back('\\');
-                break;
-            }
-            next_special = false;
-        } else {
-            if (d == '\\')
-                next_special = true;
-            else if (d == '"')
-                break;
-            else
-                content.push_back(d);
+        if (d == '"')
+            break;
+        if (d == EOF)
+            throw std::runtime_error("Unterminated string literal");
+
+        // d is a backslash
+        switch (input.get()) {
+        case 'n':
+            content.push_back('\n');
+            break;
+        case 'b':
+            content.push_back(' ');
+            break;
+        case 't':
+            content.push_back('\t');
+            break;
+        case '"':
+            content.push_back('"');
+            break;
+        case '\\':
+            content.push_back('\\');
+            break;
+        case EOF:
+            throw std::runtime_error("Unterminated string literal");
         }
+        content += input.read_string_run();
     }
-    return std::make_shared<String>(content);
+    return make<String>(content);
 }
 
-static bool is_token_character(int c)
+// Recognizes [+-]?[0-9]+ and converts it in the same pass.
+static std::optional<int64_t> parse_number(std::string_view token)
 {
-    return c == '!' || (c >= '#' && c <= '&') || (c >= '*' && c <= '+') || (c >= '-' && c <= ':')
-        || (c >= '<' && c <= 'Z') || c == '_' || (c >= 'a' && c <= 'z');
-}
+    size_t i = 0;
+    bool negative = false;
+    if (token[0] == '+' || token[0] == '-') {
+        negative = token[0] == '-';
+        i = 1;
+    }
+    if (i == token.size())
+        return std::nullopt;
 
-static std::shared_ptr<Integer> parse_number(const std::string& token)
-{
-    std::regex int_regex(R"(^[+-]?\d+$)");
-    if (std::regex_match(token, int_regex)) {
-        int64_t value = std::stoll(token);
-        return std::make_shared<Integer>(value);
+    const uint64_t limit = negative ? uint64_t(INT64_MAX) + 1 : uint64_t(INT64_MAX);
+    uint64_t magnitude = 0;
+    for (; i < token.size(); i++) {
+        unsigned digit = static_cast<unsigned char>(token[i]) - '0';
+        if (digit > 9)
+            return std::nullopt;
+        if (magnitude > (limit - digit) / 10)
+            throw std::runtime_error("Integer out of range: " + std::string(token));
+        magnitude = magnitude * 10 + digit;
     }
-    return nullptr;
+    return negative ? static_cast<int64_t>(-magnitude) : static_cast<int64_t>(magnitude);
 }
 
-static std::pair<size_t, size_t> find_next_delimiter(const std::string& s, const std::vector<std::string>& delimiters, size_t start)
+static std::pair<size_t, size_t> find_next_delimiter(std::string_view s, const std::vector<std::string_view>& delimiters, size_t start)
 {
-    for (const std::string& delimiter : delimiters) {
+    for (std::string_view delimiter : delimiters) {
         size_t end = s.find(delimiter, start);
-        if (end != std::string::npos) {
+        if (end != std::string_view::npos) {
             return { end, delimiter.size() };
         }
     }
-    return { std::string::npos, 0 };
+    return { std::string_view::npos, 0 };
 }
 
-static std::vector<std::string> splitString(const std::string& s, const std::vector<std::string>& delimiters)
+static std::vector<std::string_view> splitString(std::string_view s, const std::vector<std::string_view>& delimiters)
 {
-    std::vector<std::string> tokens;
+    std::vector<std::string_view> tokens;
     size_t start = 0;
     while (true) {
         auto [end, delSize] = find_next_delimiter(s, delimiters, start);
-        tokens.push_back(s.substr(start, end - start));
+        tokens.push_back(s.substr(start, end == std::string_view::npos ? end : end - start));
         start = end + delSize;
-        if (end == std::string::npos)
+        if (end == std::string_view::npos)
             break;
     }
 
     return tokens;
 }
 
-static std::vector<std::string> parse_token(const std::string& token)
+static std::vector<std::string_view> parse_token(std::string_view token)
 {
     return splitString(token, { "::", ":" }); // Order matters. Most specific first
 }
 
-static std::shared_ptr<Symbol> findSymbol(const std::vector<std::string>& splittedTokens)
+static Ref<Symbol> findSymbol(const std::vector<std::string_view>& splittedTokens)
 {
-    std::shared_ptr<Package> packageIt = Package::currentPackage;
+    Ref<Package> packageIt = Package::currentPackage;
     for (size_t i = 0; i < splittedTokens.size() - 1; i++) {
-        std::shared_ptr<Symbol> packageSymbol = packageIt->intern_symbol(splittedTokens[i]);
+        Ref<Symbol> packageSymbol = intern(*packageIt, splittedTokens[i]);
         if (!packageSymbol->package) {
             std::string currentSymbol;
             for (size_t j = 0; j < i; j++)
-                currentSymbol += splittedTokens[j] + "::";
+                currentSymbol += std::string(splittedTokens[j]) + "::";
             currentSymbol += splittedTokens[i];
             throw std::runtime_error("The symbol " + currentSymbol + " does not denote a package.");
         }
         packageIt = packageSymbol->package;
     }
-    return packageIt->intern_symbol(splittedTokens.back());
+    return intern(*packageIt, splittedTokens.back());
 }
 
-std::shared_ptr<Object> reader::read_token(std::istream& input)
+template <typename Input>
+static Ref<Object> read_token(Input& input)
 {
-    int c = input.peek();
-    if (!is_token_character(c))
-        return nullptr;
-    std::string token;
-    while (input) {
-        int d = input.get();
-        if (!is_token_character(d)) {
-            input.unget();
+    std::string_view token = input.read_token();
+
+    if (std::optional<int64_t> number = parse_number(token))
+        return Object::integer(*number);
+
+    if (token.find(':') == std::string_view::npos)
+        return intern(*Package::currentPackage, token);
+    return findSymbol(parse_token(token));
+}
+
+// Calls the function installed for the macro character with the form that
+// follows it. The result replaces both.
+template <typename Input>
+static Ref<Object> read_macro(Input& input)
+{
+    int c = input.get();
+    Ref<Procedure> function = readtable.macros[c];
+    Ref<Object> object = read_form(input);
+    if (!object)
+        throw std::runtime_error("Expected an object after the macro character " + describe_character(c));
+
+    Ref<Object> quote = intern(*Package::almaPackage, "quote");
+    Ref<Object> argument = Cons::list(std::vector<Ref<Object>> { quote, object });
+    Environment lex_env;
+    return function->apply(lex_env, std::span(&argument, 1));
+}
+
+// Returns nullptr at the end of the input or at a character that cannot
+// start a form, such as ')'.
+template <typename Input>
+static Ref<Object> read_form(Input& input)
+{
+    while (true) {
+        int c = input.peek();
+        if (c == EOF)
+            return nullptr;
+
+        switch (readtable.syntax[c]) {
+        case Syntax::Whitespace:
+            input.skip_whitespace();
             break;
+        case Syntax::Comment:
+            input.skip_line();
+            break;
+        case Syntax::ListOpen:
+            return read_list(input);
+        case Syntax::Quote:
+            return read_quote(input);
+        case Syntax::Quasiquote:
+            return read_quasiquote(input);
+        case Syntax::Unquote:
+            return read_unquote(input);
+        case Syntax::String:
+            return read_string(input);
+        case Syntax::Token:
+            return read_token(input);
+        case Syntax::Macro:
+            return read_macro(input);
+        case Syntax::Invalid:
+            return nullptr;
         }
-        token.push_back(d);
     }
+}
+
+// --------------------------------------------------------------------------------
+
+// Prefixes reader errors with the place where reading stopped.
+template <typename Input>
+static Ref<Object> read_located(Input& input)
+{
+    try {
+        return read_form(input);
+    } catch (const LocatedError&) {
+        throw;
+    } catch (const std::runtime_error& e) {
+        throw LocatedError(SourceMap::describe(input.location()) + ": " + e.what());
+    }
+}
+
+Ref<Object> reader::read(StreamInput& input)
+{
+    return read_located(input);
+}
+
+Ref<Object> reader::read(BufferInput& input)
+{
+    return read_located(input);
+}
 
-    std::shared_ptr<Integer> number = parse_number(token);
-    if (number)
-        return number;
+// --------------------------------------------------------------------------------
 
-    std::vector<std::string> splittedTokens = parse_token(token);
-    return findSymbol(splittedTokens);
+// Splits buffer into about `count` pieces, cutting only right after a
+// top-level list so that every piece holds whole forms. Strings and
+// comments are skipped, so parentheses inside them do not count. An
+// unbalanced ')' makes the sequential reader stop, so no cut is made after
+// one.
+static std::vector<std::string_view> split_top_level(std::string_view buffer, size_t count)
+{
+    std::vector<std::string_view> pieces;
+    const char* begin = buffer.data();
+    const char* end = buffer.data() + buffer.size();
+    const char* piece = begin;
+    size_t piece_size = buffer.size() / count + 1;
+    long depth = 0;
+
+    const char* p = begin;
+    while (p < end) {
+        p = scanner::find_structural(p, end);
+        if (p == end)
+            break;
+        switch (*p++) {
+        case '(':
+            depth++;
+            break;
+        case ')':
+            depth--;
+            if (depth < 0)
+                p = end;
+            else if (depth == 0 && static_cast<size_t>(p - piece) >= piece_size) {
+                pieces.emplace_back(piece, p - piece);
+                piece = p;
+            }
+            break;
+        case ';':
+            p = scanner::find_newline(p, end);
+            break;
+        case '"':
+            while (p < end) {
+                p = scanner::find_string_special(p, end);
+                if (p < end && *p++ == '"')
+                    break;
+                if (p < end)
+                    p++; // The escaped character
+            }
+            break;
+        }
+    }
+    pieces.emplace_back(piece, end - piece);
+
+    return pieces;
+}
+
+// Whether form calls set-macro-character.
+static bool sets_macro_character(const Ref<Object>& form)
+{
+    static const Symbol* setter = Package::almaPackage->intern_symbol("set-macro-character").get();
+    return Object::is<Cons>(form) && Object::as<Cons>(form)->car.get() == setter;
+}
+
+// Adds form, which ends at end, to batch, and tells whether reading goes
+// on after it.
+static bool add_form(reader::Batch& batch, Ref<Object> form, size_t end)
+{
+    batch.stopped = sets_macro_character(form);
+    batch.forms.push_back(std::move(form));
+    batch.ends.push_back(end);
+    batch.end = end;
+    return !batch.stopped;
+}
+
+reader::Batch reader::read_parallel(std::string_view buffer, uint32_t file, unsigned jobs)
+{
+    // Below this size the threads cost more than they save.
+    static constexpr size_t min_piece_size = 256 * 1024;
+
+    // User macros may run arbitrary code, so they are only run in order.
+    size_t count = std::min<size_t>(jobs * 4, buffer.size() / min_piece_size);
+    if (jobs <= 1 || count <= 1 || !readtable.standard) {
+        Batch batch;
+        BufferInput input(buffer, file);
+        while (Ref<Object> form = read(input))
+            if (!add_form(batch, std::move(form), input.position() - buffer.data()))
+                break;
+        return batch;
+    }
+
+    struct Piece {
+        std::string_view text;
+        uint32_t first_line;
+        const char* line_start;
+        std::vector<Ref<Object>> forms;
+        std::vector<const char*> ends;
+        std::vector<std::pair<const Object*, SourceLocation>> locations;
+        bool complete = false;
+        std::exception_ptr error;
+    };
+
+    // Each piece starts where the previous one ended, so one pass over the
+    // buffer gives the line and line start of all of them.
+    std::vector<Piece> pieces;
+    uint32_t line = 1;
+    const char* line_start = buffer.data();
+    const char* counted = buffer.data();
+    for (std::string_view text : split_top_level(buffer, count)) {
+        line += scanner::count_newlines(counted, text.data());
+        for (const char* p = text.data(); p > counted; p--) {
+            if (p[-1] == '\n') {
+                line_start = p;
+                break;
+            }
+        }
+        counted = text.data();
+        pieces.push_back({ text, line, line_start, {}, {}, {}, false, nullptr });
+    }
+
+    std::atomic<size_t> next = 0;
+    auto work = [&pieces, &next, file]() {
+        concurrent_interning = true;
+        for (size_t i = next++; i < pieces.size(); i = next++) {
+            Piece& piece = pieces[i];
+            deferred_locations = &piece.locations;
+            try {
+                BufferInput input(piece.text, file, piece.first_line, piece.line_start);
+                while (Ref<Object> form = read(input)) {
+                    piece.forms.push_back(std::move(form));
+                    piece.ends.push_back(input.position());
+                }
+                piece.complete = input.peek() == EOF;
+            } catch (...) {
+                piece.error = std::current_exception();
+            }
+        }
+        deferred_locations = nullptr;
+        concurrent_interning = false;
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < std::min<size_t>(jobs, pieces.size()); i++)
+        workers.emplace_back(work);
+    work();
+    for (std::thread& worker : workers)
+        worker.join();
+
+    // Stitch the pieces back in source order. Whatever follows a piece that
+    // stopped early, or a call of set-macro-character, would not have been
+    // read sequentially.
+    Batch batch;
+    for (Piece& piece : pieces) {
+        for (auto [form, location] : piece.locations)
+            SourceMap::record(form, location);
+        for (size_t i = 0; i < piece.forms.size(); i++)
+            if (!add_form(batch, std::move(piece.forms[i]), piece.ends[i] - buffer.data()))
+                return batch;
+        if (piece.error)
+            std::rethrow_exception(piece.error);
+        if (!piece.complete)
+            break;
+    }
+    return batch;
 }
@@ -2,15 +2,131 @@
 #pragma once
 
 #include "objects.hpp"
+#include "scanner.hpp"
+#include "source_map.hpp"
+#include <cstdio>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace reader {
-std::shared_ptr<Object> read(std::istream& input);
-std::shared_ptr<Object> read_whitespace(std::istream& input);
-std::shared_ptr<Object> read_comment(std::istream& input);
-std::shared_ptr<Object> read_list(std::istream& input);
-std::shared_ptr<Object> read_quote(std::istream& input);
-std::shared_ptr<Object> read_quasiquote(std::istream& input);
-std::shared_ptr<Object> read_unquote(std::istream& input);
-std::shared_ptr<Object> read_string(std::istream& input);
-std::shared_ptr<Object> read_token(std::istream& input);
+
+// Character source over an std::istream, for inputs that cannot be mapped.
+class StreamInput {
+private:
+    std::istream& input;
+    std::string scratch;
+    uint32_t file;
+    uint32_t line = 1;
+    uint32_t column = 1;
+
+public:
+    StreamInput(std::istream& _input, uint32_t _file)
+        : input(_input)
+        , file(_file)
+    {
+    }
+
+    SourceLocation location() const { return { this->file, this->line, this->column }; }
+    int peek() { return this->input.peek(); }
+    int get()
+    {
+        int c = this->input.get();
+        if (c == '\n') {
+            this->line++;
+            this->column = 1;
+        } else if (c != EOF)
+            this->column++;
+        return c;
+    }
+    void skip_whitespace();
+    void skip_line();
+    std::string_view read_token();
+    std::string_view read_string_run();
+};
+
+// Character source over an in-memory buffer such as a mapped file. Scanning
+// is vectorized and tokens are slices of the buffer.
+class BufferInput {
+private:
+    const char* pos;
+    const char* end;
+    uint32_t file;
+    // Lines are counted lazily, up to `counted`, when a location is asked.
+    uint32_t line;
+    const char* line_start;
+    const char* counted;
+
+public:
+    // line_start may lie before buffer when it starts in the middle of a line
+    // of a larger text.
+    BufferInput(std::string_view buffer, uint32_t _file, uint32_t first_line = 1, const char* _line_start = nullptr)
+        : pos(buffer.data())
+        , end(buffer.data() + buffer.size())
+        , file(_file)
+        , line(first_line)
+        , line_start(_line_start ? _line_start : buffer.data())
+        , counted(buffer.data())
+    {
+    }
+
+    SourceLocation location()
+    {
+        for (const char* p = this->counted; (p = scanner::find_newline(p, this->pos)) < this->pos;) {
+            this->line++;
+            this->line_start = ++p;
+        }
+        this->counted = this->pos;
+        return { this->file, this->line, static_cast<uint32_t>(this->pos - this->line_start) + 1 };
+    }
+
+    const char* position() const { return this->pos; }
+    // Goes on reading at position, further on in the buffer.
+    void seek(const char* position) { this->pos = position; }
+    int peek() const { return this->pos < this->end ? static_cast<unsigned char>(*this->pos) : EOF; }
+    int get() { return this->pos < this->end ? static_cast<unsigned char>(*this->pos++) : EOF; }
+    void skip_whitespace() { this->pos = scanner::skip_whitespace(this->pos, this->end); }
+    void skip_line() { this->pos = scanner::find_newline(this->pos, this->end); }
+    std::string_view read_token()
+    {
+        const char* start = this->pos;
+        this->pos = scanner::find_token_end(this->pos, this->end);
+        return { start, static_cast<size_t>(this->pos - start) };
+    }
+    std::string_view read_string_run()
+    {
+        const char* start = this->pos;
+        this->pos = scanner::find_string_special(this->pos, this->end);
+        return { start, static_cast<size_t>(this->pos - start) };
+    }
+};
+
+Ref<Object> read(StreamInput& input);
+Ref<Object> read(BufferInput& input);
+// Top-level forms read from a buffer before any of them runs.
+struct Batch {
+    std::vector<Ref<Object>> forms;
+    // Offset in the buffer right after each form.
+    std::vector<size_t> ends;
+    // Where reading stopped, for what follows to be read form by form once
+    // the forms have run.
+    size_t end = 0;
+    // Whether it stopped after a call of set-macro-character, as the forms
+    // after the call may use the macro characters it sets.
+    bool stopped = false;
+};
+
+// Reads the top-level forms in buffer using up to `jobs` threads, the same
+// forms, in the same order, as repeated calls to read, up to the first one
+// that is a call of set-macro-character.
+Batch read_parallel(std::string_view buffer, uint32_t file, unsigned jobs);
+
+// Makes c a macro character: from now on, reading c followed by a form
+// calls function with that form and uses the result in place of both.
+void set_macro_character(char c, const Ref<Procedure>& function);
+// True until the first macro character is set.
+bool standard_readtable();
+// Marks the functions of the macro characters.
+void trace(Tracer& tracer);
 }
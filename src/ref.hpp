@@ -0,0 +1,138 @@
+
+#pragma once
+
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// Base of the types handled through Ref. Holds the reference count in the
+// object itself. Counts are not atomic: an object must only be counted by
+// one thread at a time, and objects reachable from several threads are
+// pinned instead.
+class Counted {
+    template <typename T>
+    friend class Ref;
+
+private:
+    uint32_t refs = 0;
+    bool pinned = false;
+
+protected:
+    Counted() = default;
+    // A copy is a new object, with no references yet.
+    Counted(const Counted&) { }
+    Counted& operator=(const Counted&) { return *this; }
+    ~Counted() = default;
+
+public:
+    // Whether Ref counts references to objects of this type at all. Types
+    // whose objects are owned by something else turn it off.
+    static constexpr bool reference_counted = true;
+
+    // Stops counting references to this object, so Ref never frees it. It
+    // lives as long as the program or as whatever else owns it, such as the
+    // managed heap or static storage.
+    void pin() { this->pinned = true; }
+};
+
+// Tag for taking over a reference that has already been counted.
+struct adopt_t {
+};
+inline constexpr adopt_t adopt;
+
+// Owning handle to a Counted object. It may also hold a tagged pointer,
+// with the low bit set, which is neither counted nor dereferenced.
+template <typename T>
+class Ref {
+    template <typename U>
+    friend class Ref;
+
+private:
+    T* ptr = nullptr;
+
+    static bool counted(const T* p)
+    {
+        if constexpr (!T::reference_counted)
+            return false;
+        else
+            return p && !(reinterpret_cast<uintptr_t>(p) & 1) && !p->pinned;
+    }
+    void retain() const
+    {
+        if (counted(this->ptr))
+            this->ptr->refs++;
+    }
+    void release()
+    {
+        if (counted(this->ptr) && --this->ptr->refs == 0)
+            delete this->ptr;
+    }
+
+public:
+    Ref() = default;
+    Ref(std::nullptr_t) { }
+    // Takes a reference to p, which may be a freshly created object.
+    explicit Ref(T* p)
+        : ptr(p)
+    {
+        this->retain();
+    }
+    // Takes over a reference to p counted earlier, as left by detach.
+    Ref(T* p, adopt_t)
+        : ptr(p)
+    {
+    }
+    Ref(const Ref& other)
+        : ptr(other.ptr)
+    {
+        this->retain();
+    }
+    Ref(Ref&& other) noexcept
+        : ptr(std::exchange(other.ptr, nullptr))
+    {
+    }
+    template <typename U>
+    Ref(const Ref<U>& other)
+        : ptr(other.ptr)
+    {
+        this->retain();
+    }
+    template <typename U>
+    Ref(Ref<U>&& other)
+        : ptr(std::exchange(other.ptr, nullptr))
+    {
+    }
+    ~Ref() { this->release(); }
+
+    Ref& operator=(Ref other) noexcept
+    {
+        std::swap(this->ptr, other.ptr);
+        return *this;
+    }
+
+    // Gives up the reference without dropping its count.
+    T* detach() { return std::exchange(this->ptr, nullptr); }
+
+    T* get() const { return this->ptr; }
+    T* operator->() const { return this->ptr; }
+    T& operator*() const { return *this->ptr; }
+    explicit operator bool() const { return this->ptr != nullptr; }
+
+    template <typename U>
+    bool operator==(const Ref<U>& other) const { return this->ptr == other.get(); }
+    bool operator==(std::nullptr_t) const { return this->ptr == nullptr; }
+    template <typename U>
+    std::strong_ordering operator<=>(const Ref<U>& other) const
+    {
+        return std::compare_three_way()(static_cast<const void*>(this->ptr), static_cast<const void*>(other.get()));
+    }
+};
+
+// Ref to the same object as a T, or null if it is not one. r must not hold
+// a tagged pointer.
+template <typename T, typename U>
+Ref<T> dynamic_ref_cast(const Ref<U>& r)
+{
+    return Ref<T>(dynamic_cast<T*>(r.get()));
+}
@@ -0,0 +1,301 @@
+
+#include "resolver.hpp"
+#include "annotations.hpp"
+#include "compiler.hpp"
+#include "heap.hpp"
+#include "package.hpp"
+#include "source_map.hpp"
+#include "special_operator.hpp"
+#include <optional>
+#include <unordered_set>
+
+namespace {
+
+// Scopes of the frames the code being resolved runs in, from the outermost
+// in.
+using Chain = std::vector<const Environment::Scope*>;
+
+// Operators whose arguments are not all evaluated in place.
+struct Operators {
+    const Symbol* quote;
+    const Symbol* quasiquote;
+    const Symbol* let;
+    const Symbol* lambda;
+    const Symbol* gamma;
+    const Symbol* defvar;
+    const Symbol* defparameter;
+};
+
+const Operators& operators()
+{
+    static const Operators operators = [] {
+        auto find = [](std::string_view name) { return Package::almaPackage->find_symbol(name)->get(); };
+        return Operators { find("quote"), find("quasiquote"), find("let"), find("lambda"), find("gamma"),
+            find("defvar"), find("defparameter") };
+    }();
+    return operators;
+}
+
+// A new form made of elements, located where form was.
+Ref<Object> rebuild(const Cons* form, std::span<const Ref<Object>> elements)
+{
+    Ref<Cons> list = Cons::list(elements);
+    if (form->located)
+        list->located = SourceMap::copy(form, list.get());
+    return list;
+}
+
+Ref<Object> resolve(const Ref<Object>& form, Chain& chain);
+
+// Every symbol in forms, at any depth.
+std::unordered_set<const Symbol*> symbols_in(std::span<const Ref<Object>> forms)
+{
+    std::unordered_set<const Symbol*> symbols;
+    std::vector<const Ref<Object>*> pending;
+    for (const Ref<Object>& form : forms)
+        pending.push_back(&form);
+    while (!pending.empty()) {
+        const Ref<Object>& obj = *pending.back();
+        pending.pop_back();
+        if (Object::is<Symbol>(obj)) {
+            symbols.insert(Object::as<Symbol>(obj));
+        } else if (Object::is<Cons>(obj)) {
+            const Cons* last = nullptr;
+            for (const Cons* cell = Object::as<Cons>(obj); cell; cell = cell->next()) {
+                pending.push_back(&cell->car);
+                last = cell;
+            }
+            if (last->cdr_code == Cons::CdrCode::Stored)
+                pending.push_back(&static_cast<const Pair*>(last)->rest);
+        }
+    }
+    return symbols;
+}
+
+// The scope of the lexical variables among symbols, the variables of a
+// form's bindings. Fills specials with the special variable each binding
+// binds, or null, unless none is special.
+Ref<Environment::Scope> split_specials(const std::vector<Ref<Symbol>>& symbols, std::vector<Ref<Symbol>>& specials)
+{
+    Ref<Environment::Scope> scope(new Environment::Scope);
+    for (const Ref<Symbol>& symbol : symbols)
+        if (!symbol->special)
+            scope->symbols.push_back(symbol);
+    if (scope->symbols.size() == symbols.size())
+        return scope;
+
+    for (const Ref<Symbol>& symbol : symbols)
+        specials.push_back(symbol->special ? symbol : nullptr);
+    return scope;
+}
+
+// The code of a closure created where enclosing is in scope.
+Ref<LambdaCode> make_code(const Ref<Environment::Scope>& params,
+    std::span<const Ref<Object>> body, const Chain& enclosing)
+{
+    Ref<LambdaCode> code(new LambdaCode);
+    code->params = split_specials(params->symbols, code->specials);
+    code->captures = Ref<Environment::Scope>(new Environment::Scope);
+
+    if (!enclosing.empty()) {
+        std::unordered_set<const Symbol*> names = symbols_in(body);
+        for (const Ref<Symbol>& param : params->symbols)
+            names.erase(param.get());
+        for (size_t depth = 0; depth < enclosing.size(); depth++) {
+            const std::vector<Ref<Symbol>>& symbols = enclosing[enclosing.size() - 1 - depth]->symbols;
+            for (size_t i = 0; i < symbols.size(); i++) {
+                if (names.erase(symbols[i].get())) {
+                    code->captures->symbols.push_back(symbols[i]);
+                    code->sources.push_back({ static_cast<uint32_t>(depth), static_cast<uint32_t>(i) });
+                }
+            }
+        }
+    }
+
+    Chain chain = { code->captures.get(), code->params.get() };
+    for (const Ref<Object>& form : body)
+        code->body.push_back(resolve(form, chain));
+    code->bytecode = Compiler::compile(*code);
+    return code;
+}
+
+Ref<Object> resolve_symbol(const Ref<Object>& form, const Chain& chain)
+{
+    const Symbol* symbol = Object::as<Symbol>(form);
+    for (size_t depth = 0; depth < chain.size(); depth++) {
+        const std::vector<Ref<Symbol>>& symbols = chain[chain.size() - 1 - depth]->symbols;
+        for (size_t i = 0; i < symbols.size(); i++)
+            if (symbols[i].get() == symbol)
+                return make<LexicalVariable>(depth, i, symbols[i]);
+    }
+    return make<GlobalVariable>(Object::cast<Symbol>(form));
+}
+
+// (let ((var init) ...) body ...)
+Ref<Object> resolve_let(const Cons* form, const std::vector<Ref<Object>>& elements, Chain& chain)
+{
+    if (elements.size() < 2 || !Object::is<Cons>(elements[1]))
+        return Ref<Object>(const_cast<Cons*>(form));
+    std::optional<std::vector<Ref<Object>>> bindings = Object::as<Cons>(elements[1])->elements();
+    if (!bindings)
+        return Ref<Object>(const_cast<Cons*>(form));
+
+    std::vector<Ref<Symbol>> symbols;
+    std::vector<Ref<Object>> resolved = { nullptr };
+    for (const Ref<Object>& binding : *bindings) {
+        if (!Object::is<Cons>(binding))
+            return Ref<Object>(const_cast<Cons*>(form));
+        std::optional<std::vector<Ref<Object>>> clause = Object::as<Cons>(binding)->elements();
+        if (!clause || clause->size() != 2 || !Object::is<Symbol>((*clause)[0]))
+            return Ref<Object>(const_cast<Cons*>(form));
+        symbols.push_back(Object::cast<Symbol>((*clause)[0]));
+        resolved.push_back(resolve((*clause)[1], chain));
+    }
+    std::vector<Ref<Symbol>> specials;
+    Ref<Environment::Scope> scope = split_specials(symbols, specials);
+
+    chain.push_back(scope.get());
+    for (size_t i = 2; i < elements.size(); i++)
+        resolved.push_back(resolve(elements[i], chain));
+    chain.pop_back();
+
+    resolved[0] = make<resolved_let>(scope, std::move(specials));
+    return rebuild(form, resolved);
+}
+
+// (lambda (param ...) body ...)
+Ref<Object> resolve_lambda(const Cons* form, const std::vector<Ref<Object>>& elements, Chain& chain)
+{
+    if (elements.size() < 2)
+        return Ref<Object>(const_cast<Cons*>(form));
+
+    Ref<Environment::Scope> params(new Environment::Scope);
+    if (!Object::is<Nil>(elements[1])) {
+        if (!Object::is<Cons>(elements[1]))
+            return Ref<Object>(const_cast<Cons*>(form));
+        std::optional<std::vector<Ref<Object>>> symbols = Object::as<Cons>(elements[1])->elements();
+        if (!symbols)
+            return Ref<Object>(const_cast<Cons*>(form));
+        for (const Ref<Object>& symbol : *symbols) {
+            if (!Object::is<Symbol>(symbol))
+                return Ref<Object>(const_cast<Cons*>(form));
+            params->symbols.push_back(Object::cast<Symbol>(symbol));
+        }
+    }
+
+    Ref<LambdaCode> code = make_code(params, std::span(elements).subspan(2), chain);
+    std::vector<Ref<Object>> resolved = { make<resolved_lambda>(code) };
+    return rebuild(form, resolved);
+}
+
+// What a quasiquote template unquotes at its own level, resolved. Sets
+// nested if it holds another quasiquote, whose unquotes are not all its
+// own.
+Ref<Object> resolve_template(const Ref<Object>& templ, Chain& chain, bool& nested)
+{
+    if (!Object::is<Cons>(templ))
+        return templ;
+    const Cons* cons = Object::as<Cons>(templ);
+    std::optional<std::vector<Ref<Object>>> elements = cons->elements();
+    if (!elements)
+        return templ;
+
+    std::string_view head = Object::is<Symbol>((*elements)[0]) ? std::string_view(Object::as<Symbol>((*elements)[0])->name) : "";
+    bool changed = false;
+    if (head == "quasiquote") {
+        nested = true;
+    } else if ((head == "unquote" || head == "slice-unquote") && elements->size() == 2) {
+        Ref<Object> resolved = resolve((*elements)[1], chain);
+        changed = resolved != (*elements)[1];
+        (*elements)[1] = std::move(resolved);
+    } else {
+        for (Ref<Object>& element : *elements) {
+            Ref<Object> resolved = resolve_template(element, chain, nested);
+            changed = changed || resolved != element;
+            element = std::move(resolved);
+        }
+    }
+    return changed ? rebuild(cons, *elements) : templ;
+}
+
+// (quasiquote template)
+Ref<Object> resolve_quasiquote(const Cons* form, std::vector<Ref<Object>>& elements, Chain& chain)
+{
+    if (elements.size() != 2)
+        return Ref<Object>(const_cast<Cons*>(form));
+    bool nested = false;
+    Ref<Object> templ = resolve_template(elements[1], chain, nested);
+    if (nested || templ == elements[1])
+        return Ref<Object>(const_cast<Cons*>(form));
+    elements[1] = std::move(templ);
+    return rebuild(form, elements);
+}
+
+Ref<Object> resolve_form(const Ref<Object>& form, Chain& chain)
+{
+    const Cons* cons = Object::as<Cons>(form);
+    std::optional<std::vector<Ref<Object>>> elements = cons->elements();
+    if (!elements || !Object::is<Symbol>((*elements)[0]))
+        return form;
+
+    const Symbol* head = Object::as<Symbol>((*elements)[0]);
+    const Operators& ops = operators();
+    if (head == ops.quasiquote)
+        return resolve_quasiquote(cons, *elements, chain);
+    if (head == ops.quote || head == ops.gamma || head == ops.defvar
+        || head == ops.defparameter || Object::is<Macro>(head->function))
+        return form;
+    if (head == ops.let)
+        return resolve_let(cons, *elements, chain);
+    if (head == ops.lambda)
+        return resolve_lambda(cons, *elements, chain);
+
+    // A function call, or a special operator that evaluates all its
+    // arguments, like progn and if.
+    bool changed = false;
+    for (size_t i = 1; i < elements->size(); i++) {
+        Ref<Object> resolved = resolve((*elements)[i], chain);
+        if (resolved != (*elements)[i]) {
+            (*elements)[i] = std::move(resolved);
+            changed = true;
+        }
+    }
+    if (!changed)
+        return form;
+    Ref<Object> rebuilt = rebuild(cons, *elements);
+    Annotations::at(Object::as<Cons>(rebuilt)).original = form;
+    return rebuilt;
+}
+
+Ref<Object> resolve(const Ref<Object>& form, Chain& chain)
+{
+    switch (Object::type_of(form)) {
+    case Object::Type::Symbol:
+        return resolve_symbol(form, chain);
+    case Object::Type::Cons:
+        return resolve_form(form, chain);
+    default:
+        return form;
+    }
+}
+
+}
+
+Ref<LambdaCode> Resolver::resolve_lambda(const Ref<Environment::Scope>& params,
+    std::span<const Ref<Object>> body, const Environment& env)
+{
+    std::vector<const Environment::Scope*> scopes = env.scopes();
+    return make_code(params, body, Chain(scopes.rbegin(), scopes.rend()));
+}
+
+Ref<Object> Resolver::resolve_expansion(const Ref<Object>& expansion, std::span<const Environment::Scope* const> scopes)
+{
+    Chain chain(scopes.rbegin(), scopes.rend());
+    return resolve(expansion, chain);
+}
+
+Ref<Object> Resolver::original(const Cons* form)
+{
+    Annotations::Entry* entry = Annotations::find(form);
+    return entry ? entry->original : nullptr;
+}
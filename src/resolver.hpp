@@ -0,0 +1,45 @@
+
+#pragma once
+
+#include "environment.hpp"
+#include "objects.hpp"
+#include <span>
+#include <vector>
+
+// Pre-pass over the body of a lambda or gamma form, run when the form is
+// evaluated outside resolved code. Turns the references to lexical
+// variables into LexicalVariables, which read their slot directly, the
+// other variable references into GlobalVariables, which read the value of
+// their symbol without probing the frames, and the let and lambda forms
+// inside into ones that bind their variables by slot, resolving their
+// bodies too, as well as what quasiquote templates unquote. Quoted data,
+// nested quasiquotes and malformed forms are left as they are, to be
+// evaluated by name when they run. So are macro calls, whose expansions are
+// resolved in turn, for the frames they run in, when they are made.
+//
+// Variables declared special by the time the code is resolved are bound
+// dynamically by its let forms and parameters, and read from their symbol.
+//
+// Closures capture the variables in scope whose names appear anywhere in
+// their body, quoted or not, since eval and the expansions of macros may
+// refer to them by name. Nothing else of the frames they are created in is
+// kept.
+//
+// A call to a name that is not a macro when the closure is created is
+// taken for a function call. Should the name be defined as a macro later,
+// the call is evaluated as read instead, so that the macro sees its
+// arguments as they were written.
+namespace Resolver {
+// The code of a lambda or gamma form with params and body, for closures
+// created in env.
+Ref<LambdaCode> resolve_lambda(const Ref<Environment::Scope>& params,
+    std::span<const Ref<Object>> body, const Environment& env);
+
+// The expansion of a macro call, resolved for code run in frames of
+// scopes, from the innermost out.
+Ref<Object> resolve_expansion(const Ref<Object>& expansion, std::span<const Environment::Scope* const> scopes);
+
+// The call form was rebuilt from, as read, or null if it is not one the
+// Resolver rebuilt. Kept in the Annotations of form.
+Ref<Object> original(const Cons* form);
+};
@@ -0,0 +1,122 @@
+
+#include "runtime.hpp"
+#include "compiler.hpp"
+#include "emitter.hpp"
+#include "form_cache.hpp"
+#include "function.hpp"
+#include "hash_cons.hpp"
+#include "heap.hpp"
+#include "jit.hpp"
+#include "macro.hpp"
+#include "package.hpp"
+#include "special_operator.hpp"
+#include "symbol.hpp"
+#include "types.hpp"
+#include <fstream>
+#include <iostream>
+#include <string>
+
+Runtime::Builtins Runtime::builtins;
+
+void Runtime::initialize()
+{
+    Package::initAlmaPackage();
+    intern_special_operators();
+    intern_functions();
+    intern_macros();
+    intern_symbols();
+    intern_types();
+
+    auto function = [](const std::string& name) {
+        return (*Package::almaPackage->find_symbol(name))->function.get();
+    };
+    builtins = { function("+"), function("eql"), function("car"), function("cdr") };
+}
+
+int Runtime::main(int argc, char* argv[], std::string_view source, std::string_view image,
+    std::span<const Translated> translated, std::span<const Body> bodies)
+{
+    const char* output = nullptr;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--hash-cons")
+            HashCons::enable();
+        else if (arg == "--interpret")
+            Compiler::disable();
+        else if (arg == "--no-jit")
+            JIT::disable();
+        else if (!output && (arg.size() <= 1 || arg[0] != '-'))
+            output = argv[i];
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--hash-cons] [--interpret] [--no-jit] [output]" << std::endl;
+            return 1;
+        }
+    }
+    if (output)
+        Emitter::emitter = std::make_unique<std::ofstream>(output);
+
+    std::ios::sync_with_stdio(false);
+    initialize();
+    for (const Body& body : bodies)
+        Compiler::add_translation(body.code, body.run);
+
+    try {
+        std::optional<std::vector<Ref<Object>>> forms = FormCache::load_image(image, SourceMap::add_file(std::string(source)));
+        if (!forms || forms->size() != translated.size())
+            throw std::runtime_error("The forms of " + std::string(source) + " are corrupt.");
+
+        Environment lex_env;
+        Heap::TopLevel top_level(lex_env, *forms);
+        for (size_t i = 0; i < forms->size(); i++) {
+            if (translated[i])
+                translated[i](lex_env, (*forms)[i]);
+            else
+                Object::eval((*forms)[i], lex_env);
+            Heap::safepoint();
+        }
+    } catch (std::runtime_error& e) {
+        std::cout << e.what() << std::endl;
+    }
+
+    return 0;
+}
+
+bool Runtime::sum_of(Ref<Object>& target, const Ref<Object>& x, const Ref<Object>& y) noexcept
+{
+    if (!Object::is_fixnum(x) || !Object::is_fixnum(y))
+        return false;
+    // Two fixnums add up without overflowing 64 bits, to an Integer if the
+    // sum leaves the fixnum range, which may fail to allocate.
+    try {
+        target = Object::integer(*Object::integer_value(x) + *Object::integer_value(y));
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
+bool Runtime::eql_of(Ref<Object>& target, const Ref<Object>& x, const Ref<Object>& y) noexcept
+{
+    if (!Object::is_fixnum(x) || !Object::is_fixnum(y))
+        return false;
+    target = x == y ? Object::t() : Object::nil();
+    return true;
+}
+
+bool Runtime::car_of(Ref<Object>& target, const Ref<Object>& cons) noexcept
+{
+    if (!Object::is<Cons>(cons))
+        return false;
+    Ref<Object> car = Object::as<Cons>(cons)->car;
+    target = std::move(car);
+    return true;
+}
+
+bool Runtime::cdr_of(Ref<Object>& target, const Ref<Object>& cons) noexcept
+{
+    if (!Object::is<Cons>(cons))
+        return false;
+    Ref<Object> cdr = Object::as<Cons>(cons)->cdr();
+    target = std::move(cdr);
+    return true;
+}
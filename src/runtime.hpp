@@ -0,0 +1,111 @@
+
+#pragma once
+
+#include "argument_stack.hpp"
+#include "compiler.hpp"
+#include "environment.hpp"
+#include "objects.hpp"
+#include "source_map.hpp"
+#include <span>
+#include <string_view>
+
+// What programs translated by alma --compile-to-cpp run on: the object
+// model and builtins of the interpreter, which evaluates whatever the
+// translation left to it.
+namespace Runtime {
+
+// Interns the packages, special operators, builtins and types every
+// program starts with.
+void initialize();
+
+// A top-level form translated to C++, run on its form as read.
+using Translated = Ref<Object> (*)(Environment& env, const Ref<Object>& form);
+
+// The body of a lambda or gamma form translated to C++, run for the
+// bytecode compiled to exactly its code.
+struct Body {
+    std::span<const Instruction> code;
+    TranslatedCode run;
+};
+
+// Runs a translated program with the command line of its executable. The
+// image holds its forms as read, in the layout of FormCache::image; for
+// each one, translated has its translation, or null to have it evaluated.
+// The bodies are run for the functions and macros they were translated
+// from.
+int main(int argc, char* argv[], std::string_view source, std::string_view image,
+    std::span<const Translated> translated, std::span<const Body> bodies);
+
+// The builtins whose calls translated bodies have fast paths for, as
+// interned by initialize.
+struct Builtins {
+    const Procedure* sum;
+    const Procedure* eql;
+    const Procedure* car;
+    const Procedure* cdr;
+};
+extern Builtins builtins;
+
+// The fast paths: each stores the result of the builtin in target, or
+// returns false to leave the call to the VM, for arguments other than
+// fixnums or conses.
+bool sum_of(Ref<Object>& target, const Ref<Object>& x, const Ref<Object>& y) noexcept;
+bool eql_of(Ref<Object>& target, const Ref<Object>& x, const Ref<Object>& y) noexcept;
+bool car_of(Ref<Object>& target, const Ref<Object>& cons) noexcept;
+bool cdr_of(Ref<Object>& target, const Ref<Object>& cons) noexcept;
+
+// The arguments of a call being translated, evaluated in order as the
+// generated code asks for them.
+class Call {
+private:
+    const Cons* cell; // Of the next argument
+    Environment& env;
+    ArgumentStack::Frame frame;
+
+public:
+    Call(const Cons* form, size_t count, Environment& _env)
+        : cell(form->next())
+        , env(_env)
+        , frame(count)
+    {
+    }
+
+    // The form of the next argument, for a translated call to take it.
+    const Ref<Object>& next()
+    {
+        const Ref<Object>& form = this->cell->car;
+        this->cell = this->cell->next();
+        return form;
+    }
+    // Evaluates the next argument.
+    void evaluate() { this->push(Object::eval(this->next(), this->env)); }
+    void push(Ref<Object> value) { this->frame.push(std::move(value)); }
+    std::span<const Ref<Object>> arguments() const { return this->frame.arguments(); }
+};
+
+// Evaluates form, a proper list of count arguments, as the interpreter
+// would: if its symbol names a function, its arguments are given to it by
+// arguments(Call&). Otherwise, as for macros and special operators, form is
+// evaluated as read.
+template <typename Arguments>
+Ref<Object> call(Environment& env, const Ref<Object>& form, size_t count, Arguments arguments)
+{
+    const Cons* cons = Object::as<Cons>(form);
+    Procedure* procedure = Object::as<Symbol>(cons->car)->function.get();
+    if (!procedure || procedure->type < Function::first_type || procedure->type > Function::last_type)
+        return Object::eval(form, env);
+
+    try {
+        Call call(cons, count, env);
+        arguments(call);
+        return static_cast<Function*>(procedure)->call(call.arguments(), env);
+    } catch (const LocatedError&) {
+        throw;
+    } catch (const std::runtime_error& e) {
+        std::optional<std::string> location = SourceMap::describe(cons);
+        if (!location)
+            throw;
+        throw LocatedError(*location + ": " + e.what());
+    }
+}
+};
@@ -0,0 +1,173 @@
+
+#include "scanner.hpp"
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define ALMA_SCANNER_SIMD 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define ALMA_SCANNER_SIMD 1
+#else
+#define ALMA_SCANNER_SIMD 0
+#endif
+
+namespace {
+
+#if defined(__AVX2__)
+struct Simd {
+    using Vec = __m256i;
+    static constexpr size_t width = 32;
+
+    static Vec load(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    static Vec splat(char c) { return _mm256_set1_epi8(c); }
+    static Vec eq(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+    static Vec gt(Vec a, Vec b) { return _mm256_cmpgt_epi8(a, b); }
+    static Vec either(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+    static Vec both(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+    static uint32_t mask(Vec a) { return static_cast<uint32_t>(_mm256_movemask_epi8(a)); }
+    static constexpr uint32_t all = 0xFFFFFFFFu;
+};
+#elif defined(__SSE2__)
+struct Simd {
+    using Vec = __m128i;
+    static constexpr size_t width = 16;
+
+    static Vec load(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    static Vec splat(char c) { return _mm_set1_epi8(c); }
+    static Vec eq(Vec a, Vec b) { return _mm_cmpeq_epi8(a, b); }
+    static Vec gt(Vec a, Vec b) { return _mm_cmpgt_epi8(a, b); }
+    static Vec either(Vec a, Vec b) { return _mm_or_si128(a, b); }
+    static Vec both(Vec a, Vec b) { return _mm_and_si128(a, b); }
+    static uint32_t mask(Vec a) { return static_cast<uint32_t>(_mm_movemask_epi8(a)); }
+    static constexpr uint32_t all = 0xFFFFu;
+};
+#endif
+
+#if ALMA_SCANNER_SIMD
+// Bytes in [lo, hi]. Every range used here lies below 0x80, so the signed
+// comparison rejects non-ASCII bytes for free.
+Simd::Vec in_range(Simd::Vec v, char lo, char hi)
+{
+    return Simd::both(Simd::gt(v, Simd::splat(lo - 1)), Simd::gt(Simd::splat(hi + 1), v));
+}
+#endif
+
+// Each scan is described by a policy with a scalar predicate and, when SIMD
+// is available, a block predicate returning one bit per stopping byte.
+struct WhitespaceEnd {
+    static bool scalar(unsigned char c) { return !scanner::is_whitespace(c); }
+#if ALMA_SCANNER_SIMD
+    static uint32_t block(Simd::Vec v)
+    {
+        Simd::Vec ws = Simd::either(Simd::eq(v, Simd::splat(' ')), Simd::eq(v, Simd::splat('\n')));
+        ws = Simd::either(ws, Simd::eq(v, Simd::splat('\t')));
+        return ~Simd::mask(ws) & Simd::all;
+    }
+#endif
+};
+
+struct Newline {
+    static bool scalar(unsigned char c) { return c == '\n'; }
+#if ALMA_SCANNER_SIMD
+    static uint32_t block(Simd::Vec v) { return Simd::mask(Simd::eq(v, Simd::splat('\n'))); }
+#endif
+};
+
+struct TokenEnd {
+    static bool scalar(unsigned char c) { return !scanner::token_characters[c]; }
+#if ALMA_SCANNER_SIMD
+    static uint32_t block(Simd::Vec v)
+    {
+        Simd::Vec token = Simd::either(Simd::eq(v, Simd::splat('!')), Simd::eq(v, Simd::splat('_')));
+        token = Simd::either(token, in_range(v, '#', '&'));
+        token = Simd::either(token, in_range(v, '*', '+'));
+        token = Simd::either(token, in_range(v, '-', ':'));
+        token = Simd::either(token, in_range(v, '<', 'Z'));
+        token = Simd::either(token, in_range(v, 'a', 'z'));
+        return ~Simd::mask(token) & Simd::all;
+    }
+#endif
+};
+
+struct StringSpecial {
+    static bool scalar(unsigned char c) { return c == '"' || c == '\\'; }
+#if ALMA_SCANNER_SIMD
+    static uint32_t block(Simd::Vec v)
+    {
+        return Simd::mask(Simd::either(Simd::eq(v, Simd::splat('"')), Simd::eq(v, Simd::splat('\\'))));
+    }
+#endif
+};
+
+struct Structural {
+    static bool scalar(unsigned char c) { return c == '(' || c == ')' || c == '"' || c == ';'; }
+#if ALMA_SCANNER_SIMD
+    static uint32_t block(Simd::Vec v)
+    {
+        Simd::Vec parens = Simd::either(Simd::eq(v, Simd::splat('(')), Simd::eq(v, Simd::splat(')')));
+        Simd::Vec others = Simd::either(Simd::eq(v, Simd::splat('"')), Simd::eq(v, Simd::splat(';')));
+        return Simd::mask(Simd::either(parens, others));
+    }
+#endif
+};
+
+template <typename Stops>
+const char* find_first(const char* p, const char* end)
+{
+#if ALMA_SCANNER_SIMD
+    while (static_cast<size_t>(end - p) >= Simd::width) {
+        uint32_t m = Stops::block(Simd::load(p));
+        if (m)
+            return p + __builtin_ctz(m);
+        p += Simd::width;
+    }
+#endif
+    while (p < end && !Stops::scalar(static_cast<unsigned char>(*p)))
+        p++;
+    return p;
+}
+
+}
+
+const char* scanner::skip_whitespace(const char* begin, const char* end)
+{
+    // Most gaps are a single space; avoid the vector setup for them.
+    if (begin < end && !is_whitespace(*begin))
+        return begin;
+    return find_first<WhitespaceEnd>(begin, end);
+}
+
+const char* scanner::find_newline(const char* begin, const char* end)
+{
+    return find_first<Newline>(begin, end);
+}
+
+const char* scanner::find_token_end(const char* begin, const char* end)
+{
+    return find_first<TokenEnd>(begin, end);
+}
+
+const char* scanner::find_string_special(const char* begin, const char* end)
+{
+    return find_first<StringSpecial>(begin, end);
+}
+
+const char* scanner::find_structural(const char* begin, const char* end)
+{
+    return find_first<Structural>(begin, end);
+}
+
+size_t scanner::count_newlines(const char* p, const char* end)
+{
+    size_t count = 0;
+#if ALMA_SCANNER_SIMD
+    while (static_cast<size_t>(end - p) >= Simd::width) {
+        count += __builtin_popcount(Newline::block(Simd::load(p)));
+        p += Simd::width;
+    }
+#endif
+    for (; p < end; p++)
+        count += *p == '\n';
+    return count;
+}
@@ -0,0 +1,44 @@
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+// Bulk scanning primitives used by the reader on in-memory sources. Every
+// function returns a pointer in [begin, end]; end means "not found".
+// They use SSE2 or AVX2 when the target supports it and fall back to a
+// table-driven scalar loop otherwise.
+namespace scanner {
+
+constexpr bool is_whitespace(unsigned char c)
+{
+    return c == ' ' || c == '\n' || c == '\t';
+}
+
+constexpr bool is_token_character(unsigned char c)
+{
+    return c == '!' || (c >= '#' && c <= '&') || (c >= '*' && c <= '+') || (c >= '-' && c <= ':')
+        || (c >= '<' && c <= 'Z') || c == '_' || (c >= 'a' && c <= 'z');
+}
+
+constexpr std::array<bool, 256> token_characters = [] {
+    std::array<bool, 256> table {};
+    for (size_t c = 0; c < table.size(); c++)
+        table[c] = is_token_character(c);
+    return table;
+}();
+
+// First character that is not whitespace.
+const char* skip_whitespace(const char* begin, const char* end);
+// First newline.
+const char* find_newline(const char* begin, const char* end);
+// First character that cannot be part of a token.
+const char* find_token_end(const char* begin, const char* end);
+// First '"' or '\\'.
+const char* find_string_special(const char* begin, const char* end);
+// Number of newlines.
+size_t count_newlines(const char* begin, const char* end);
+// First '(', ')', '"' or ';', the characters that delimit top-level forms.
+const char* find_structural(const char* begin, const char* end);
+
+}
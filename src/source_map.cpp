@@ -0,0 +1,76 @@
+
+#include "source_map.hpp"
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// 8 bytes per location: the file index and column share one word.
+struct Entry {
+    uint32_t line;
+    uint32_t file_column;
+};
+
+constexpr unsigned column_bits = 20;
+constexpr uint32_t column_mask = (1u << column_bits) - 1;
+
+struct Table {
+    std::vector<std::string> files;
+    std::unordered_map<const Object*, Entry> entries;
+};
+
+// Where the located forms were read, until they die.
+Table& table = *new Table;
+
+}
+
+uint32_t SourceMap::add_file(const std::string& name)
+{
+    table.files.push_back(name);
+    return table.files.size() - 1;
+}
+
+void SourceMap::record(const Object* form, SourceLocation location)
+{
+    uint32_t column = location.column > column_mask ? column_mask : location.column;
+    table.entries[form] = { location.line, (location.file << column_bits) | column };
+}
+
+void SourceMap::forget(const Object* form)
+{
+    table.entries.erase(form);
+}
+
+bool SourceMap::copy(const Object* from, const Object* to)
+{
+    auto it = table.entries.find(from);
+    if (it == table.entries.end())
+        return false;
+    Entry entry = it->second; // Before inserting may rehash
+    table.entries.insert_or_assign(to, entry);
+    return true;
+}
+
+std::optional<SourceLocation> SourceMap::find(const Object* form)
+{
+    auto it = table.entries.find(form);
+    if (it == table.entries.end())
+        return std::nullopt;
+    const Entry& entry = it->second;
+    return SourceLocation { entry.file_column >> column_bits, entry.line, entry.file_column & column_mask };
+}
+
+std::string SourceMap::describe(SourceLocation location)
+{
+    const std::vector<std::string>& files = table.files;
+    const std::string& file = location.file < files.size() ? files[location.file] : "<unknown>";
+    return file + ":" + std::to_string(location.line) + ":" + std::to_string(location.column);
+}
+
+std::optional<std::string> SourceMap::describe(const Object* form)
+{
+    std::optional<SourceLocation> location = find(form);
+    if (!location)
+        return std::nullopt;
+    return describe(*location);
+}
@@ -0,0 +1,32 @@
+
+#pragma once
+
+#include "objects.hpp"
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+struct SourceLocation {
+    uint32_t file;
+    uint32_t line;
+    uint32_t column;
+};
+
+// Side table from forms built by the reader to the place they were read
+// from. Objects themselves carry no position.
+namespace SourceMap {
+uint32_t add_file(const std::string& name);
+void record(const Object* form, SourceLocation location);
+void forget(const Object* form);
+// Records for to where from was read, if it has a location: whether it did.
+bool copy(const Object* from, const Object* to);
+std::optional<SourceLocation> find(const Object* form);
+std::string describe(SourceLocation location);
+std::optional<std::string> describe(const Object* form);
+};
+
+// An error whose message already starts with the location it refers to.
+struct LocatedError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
@@ -1,12 +1,18 @@
 
 #include "special_operator.hpp"
+#include "annotations.hpp"
+#include "argument_stack.hpp"
+#include "dynamic_scope.hpp"
+#include "hash_cons.hpp"
+#include "heap.hpp"
 #include "objects.hpp"
 #include "package.hpp"
+#include "resolver.hpp"
 #include <memory>
 
 #define intern_special_operator(name_impl, name)                                         \
-    std::shared_ptr<Symbol>& name_impl##_so = Package::almaPackage->intern_symbol(name); \
-    name_impl##_so->function = std::make_shared<name_impl>();
+    Ref<Symbol>& name_impl##_so = Package::almaPackage->intern_symbol(name); \
+    name_impl##_so->function = make<name_impl>();
 
 void intern_special_operators()
 {
@@ -17,16 +23,18 @@ void intern_special_operators()
     intern_special_operator(gamma, "gamma");
     intern_special_operator(branch, "if");
     intern_special_operator(quasiquote, "quasiquote");
+    intern_special_operator(defvar, "defvar");
+    intern_special_operator(defparameter, "defparameter");
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> progn::apply(
+Ref<Object> progn::apply(
     Environment& lex_env [[maybe_unused]],
-    const std::vector<std::shared_ptr<Object>>& arguments)
+    std::span<const Ref<Object>> arguments)
 {
     if (arguments.empty()) {
-        return std::make_shared<Nil>();
+        return Object::nil();
     }
     for (size_t i = 0; i < arguments.size() - 1; i++) {
         Object::eval(arguments[i], lex_env);
@@ -36,74 +44,103 @@ std::shared_ptr<Object> progn::apply(
 
 // --------------------------------------------------------------------------------
 
-static std::vector<std::pair<std::shared_ptr<Symbol>, std::shared_ptr<Object>>> parseBindings(
-    const std::shared_ptr<Cons>& bindings)
+// The binding clause element, (var value), once checked.
+static const Cons* bindingClause(const Ref<Object>& element)
 {
-    std::vector<std::pair<std::shared_ptr<Symbol>, std::shared_ptr<Object>>> parsedBindings;
-
-    for (const std::shared_ptr<Object>& element : bindings->toList()) {
-        const std::shared_ptr<Cons> binding = std::dynamic_pointer_cast<Cons>(element);
-        if (!binding)
-            throw std::runtime_error("Expected a binding clause (a list).");
-        std::vector<std::shared_ptr<Object>> bindingList = binding->toList();
-        if (bindingList.size() != 2)
-            throw std::runtime_error("The binding clause must have 2 elements.");
-        const std::shared_ptr<Symbol> var = std::dynamic_pointer_cast<Symbol>(bindingList[0]);
-        if (!var)
-            throw std::runtime_error("The first element of the binding clause must be a symbol");
-        const std::shared_ptr<Object>& value = bindingList[1];
-        parsedBindings.emplace_back(std::move(var), value);
+    if (!Object::is<Cons>(element))
+        throw std::runtime_error("Expected a binding clause (a list).");
+    const Cons* clause = Object::as<Cons>(element);
+    size_t size = 0;
+    const Cons* last = clause;
+    for (const Cons* cell = clause; cell; cell = cell->next()) {
+        size++;
+        last = cell;
     }
-
-    return parsedBindings;
+    if (Object::is_true(last->cdr()))
+        throw std::runtime_error("Error: Not a proper list.");
+    if (size != 2)
+        throw std::runtime_error("The binding clause must have 2 elements.");
+    if (!Object::is<Symbol>(clause->car))
+        throw std::runtime_error("The first element of the binding clause must be a symbol");
+    return clause;
 }
 
-static std::vector<std::pair<std::shared_ptr<Symbol>, std::shared_ptr<Object>>> evaluateBindings(
-    Environment& lex_env,
-    const std::vector<std::pair<std::shared_ptr<Symbol>, std::shared_ptr<Object>>>& bindings)
+// The Scope of the lexical variables bindings binds, of which there are
+// lexical, kept in the Annotations of the list so that every evaluation of
+// the form binds them in the same one. Variables are only ever declared
+// special, never undeclared, so the one kept still fits while it has as
+// many.
+static Ref<Environment::Scope> letScope(const Cons* bindings, size_t lexical)
 {
-    std::vector<std::pair<std::shared_ptr<Symbol>, std::shared_ptr<Object>>> evaluatedBindings;
-
-    for (const auto& [var, value] : bindings) {
-        evaluatedBindings.emplace_back(var, Object::eval(value, lex_env));
+    Ref<Environment::Scope>& scope = Annotations::at(bindings).let_scope;
+    if (scope && scope->symbols.size() == lexical)
+        return scope;
+    scope = Ref<Environment::Scope>(new Environment::Scope);
+    for (const Cons* cell = bindings; cell; cell = cell->next()) {
+        Ref<Symbol> var = Object::cast<Symbol>(Object::as<Cons>(cell->car)->car);
+        if (!var->special)
+            scope->symbols.push_back(var);
     }
-
-    return evaluatedBindings;
+    return scope;
 }
 
-std::shared_ptr<Object> let::apply(
-    Environment& lex_env, const std::vector<std::shared_ptr<Object>>& arguments)
+Ref<Object> let::apply(
+    Environment& lex_env, std::span<const Ref<Object>> arguments)
 {
     if (arguments.empty())
         throw std::runtime_error("let needs at least a list");
 
-    const std::shared_ptr<Cons> bindings = std::dynamic_pointer_cast<Cons>(arguments.front());
-    if (!bindings)
+    if (!Object::is<Cons>(arguments.front()))
         throw std::runtime_error("Expected a list.");
+    const Cons* bindings = Object::as<Cons>(arguments.front());
 
-    auto parsedBindings = parseBindings(bindings);
-    auto evaluatedBindings = evaluateBindings(lex_env, parsedBindings);
+    size_t count = 0;
+    const Cons* last = bindings;
+    for (const Cons* cell = bindings; cell; cell = cell->next()) {
+        count++;
+        last = cell;
+    }
+    if (Object::is_true(last->cdr()))
+        throw std::runtime_error("Error: Not a proper list.");
+    for (const Cons* cell = bindings; cell; cell = cell->next())
+        bindingClause(cell->car);
 
-    if (arguments.size() == 1)
-        return std::make_shared<Nil>();
+    // Evaluated into the argument stack, where the collector finds them.
+    ArgumentStack::Frame evaluated(count);
+    for (const Cons* cell = bindings; cell; cell = cell->next())
+        evaluated.push(Object::eval(Object::as<Cons>(cell->car)->next()->car, lex_env));
 
-    lex_env.pushValues(evaluatedBindings.begin(), evaluatedBindings.end());
+    if (arguments.size() == 1)
+        return Object::nil();
+
+    // Which variables are special is only known once the values are.
+    size_t lexical = 0;
+    for (const Cons* cell = bindings; cell; cell = cell->next())
+        lexical += !Object::as<Symbol>(Object::as<Cons>(cell->car)->car)->special;
+    Ref<Environment::Scope> scope = letScope(bindings, lexical);
+    ArgumentStack::Frame values(lexical);
+    DynamicScope dynamic;
+    size_t binding = 0;
+    for (const Cons* cell = bindings; cell; cell = cell->next(), binding++) {
+        Ref<Symbol> var = Object::cast<Symbol>(Object::as<Cons>(cell->car)->car);
+        if (var->special)
+            dynamic.bind(var, evaluated.arguments()[binding]);
+        else
+            values.push(evaluated.arguments()[binding]);
+    }
+    Environment::Frame frame(lex_env, *scope, values.data());
 
     for (size_t i = 1; i < arguments.size() - 1; i++)
         Object::eval(arguments[i], lex_env);
 
-    std::shared_ptr<Object> result = Object::eval(arguments.back(), lex_env);
-
-    lex_env.popValues();
-
-    return result;
+    return Object::eval(arguments.back(), lex_env);
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> quote::apply(
+Ref<Object> quote::apply(
     Environment& lex_env [[maybe_unused]],
-    const std::vector<std::shared_ptr<Object>>& arguments)
+    std::span<const Ref<Object>> arguments)
 {
     if (arguments.size() != 1)
         throw std::runtime_error("Expected only one argument.");
@@ -112,74 +149,149 @@ std::shared_ptr<Object> quote::apply(
 
 // --------------------------------------------------------------------------------
 
-static std::vector<std::shared_ptr<Object>> expand_quotation(const std::shared_ptr<Symbol>& sym,
-    const std::vector<std::shared_ptr<Object>>& elements)
+static std::vector<Ref<Object>> expand_quotation(const Ref<Symbol>& sym,
+    const std::vector<Ref<Object>>& elements)
 {
-    std::vector<std::shared_ptr<Object>> new_elements;
-    for (const std::shared_ptr<Object>& element : elements) {
-        new_elements.push_back(std::make_shared<Cons>(std::vector<std::shared_ptr<Object>> { sym, element }));
+    std::vector<Ref<Object>> new_elements;
+    for (const Ref<Object>& element : elements) {
+        new_elements.push_back(Cons::list(std::vector<Ref<Object>> { sym, element }));
     }
     return new_elements;
 }
 
-static std::vector<std::shared_ptr<Object>> eval_quasiquote(const std::shared_ptr<Object>& obj,
-    size_t quasi_level, Environment& lex_env)
+namespace {
+
+// A list in a quasiquote template whose elements are being expanded. Their
+// expansions are spliced together into its own.
+struct QuasiFrame {
+    std::vector<Ref<Object>> elements;
+    size_t next = 0;
+    size_t quasi_level;
+    // For quote, quasiquote and unquote forms left in place: wraps each
+    // element of the expansion back in one. Otherwise the expansion is the
+    // list of them.
+    Ref<Symbol> quotation;
+    std::vector<Ref<Object>> expansion;
+    // Whether nothing in it was unquoted, so that its expansion is a
+    // constant and may be made canonical.
+    bool constant = true;
+};
+
+}
+
+// Marks what the frames of a quasiquote expansion hold.
+static void trace_frames(Tracer& tracer, const void* data)
+{
+    for (const QuasiFrame& frame : *static_cast<const std::vector<QuasiFrame>*>(data)) {
+        for (const Ref<Object>& element : frame.elements)
+            tracer.mark(element);
+        tracer.mark(frame.quotation);
+        for (const Ref<Object>& element : frame.expansion)
+            tracer.mark(element);
+    }
+}
+
+// Expands obj into splice, or pushes a frame to expand it from and returns
+// false.
+static bool expand_quasiquoted(const Ref<Object>& obj, size_t quasi_level,
+    Environment& lex_env, std::vector<QuasiFrame>& frames, std::vector<Ref<Object>>& splice)
 {
-    std::shared_ptr<Cons> cons = std::dynamic_pointer_cast<Cons>(obj);
-    if (!cons)
-        return { obj };
-    std::vector<std::shared_ptr<Object>> list = cons->toList();
-    std::shared_ptr<Symbol> sym = std::dynamic_pointer_cast<Symbol>(list[0]);
+    Ref<Cons> cons = Object::cast<Cons>(obj);
+    if (!cons) {
+        splice = { obj };
+        return true;
+    }
+    std::vector<Ref<Object>> list = cons->toList();
+    Ref<Symbol> sym = Object::cast<Symbol>(list[0]);
     if (sym && sym->name == "quote") {
-        return expand_quotation(sym, eval_quasiquote(list[1], quasi_level, lex_env));
+        frames.push_back({ { list[1] }, 0, quasi_level, sym, {} });
     } else if (sym && sym->name == "quasiquote") {
-        return expand_quotation(sym, eval_quasiquote(list[1], quasi_level + 1, lex_env));
+        frames.push_back({ { list[1] }, 0, quasi_level + 1, sym, {} });
     } else if (sym && sym->name == "unquote") {
-        if (quasi_level == 1)
-            return { Object::eval(list[1], lex_env) };
-        else {
-            return expand_quotation(sym, eval_quasiquote(list[1], quasi_level - 1, lex_env));
+        if (quasi_level == 1) {
+            if (!frames.empty())
+                frames.back().constant = false;
+            splice = { Object::eval(list[1], lex_env) };
+            return true;
         }
+        frames.push_back({ { list[1] }, 0, quasi_level - 1, sym, {} });
     } else if (sym && sym->name == "slice-unquote") {
         if (quasi_level == 1) {
-            std::shared_ptr<Object> eval_obj = Object::eval(list[1], lex_env);
-            std::shared_ptr<Cons> eval_cons = std::dynamic_pointer_cast<Cons>(eval_obj);
+            if (!frames.empty())
+                frames.back().constant = false;
+            Ref<Object> eval_obj = Object::eval(list[1], lex_env);
+            Ref<Cons> eval_cons = Object::cast<Cons>(eval_obj);
             if (!eval_cons) {
-                std::shared_ptr<Nil> nil_obj = std::dynamic_pointer_cast<Nil>(eval_obj);
-                if (!nil_obj)
+                if (!Object::is<Nil>(eval_obj))
                     throw std::runtime_error("The result of slice-unquote must be a list.");
-                return {};
+                splice = {};
+            } else {
+                splice = eval_cons->toList();
             }
-            return eval_cons->toList();
-        } else {
-            return expand_quotation(sym, eval_quasiquote(list[1], quasi_level - 1, lex_env));
+            return true;
         }
+        frames.push_back({ { list[1] }, 0, quasi_level - 1, sym, {} });
     } else {
-        std::vector<std::shared_ptr<Object>> result_list;
-        for (std::shared_ptr<Object>& elem : list) {
-            std::vector<std::shared_ptr<Object>> result_elem = eval_quasiquote(elem, quasi_level, lex_env);
-            result_list.insert(result_list.end(), result_elem.begin(), result_elem.end());
+        frames.push_back({ std::move(list), 0, quasi_level, nullptr, {} });
+    }
+    return false;
+}
+
+// What obj expands to, to be spliced into the list around it. Keeps a
+// stack of the lists being expanded instead of recursing into them.
+static std::vector<Ref<Object>> eval_quasiquote(const Ref<Object>& obj,
+    size_t quasi_level, Environment& lex_env)
+{
+    std::vector<QuasiFrame> frames;
+    std::vector<Ref<Object>> splice;
+    Heap::Root frames_root(trace_frames, &frames);
+    Heap::Root splice_root(splice);
+    if (expand_quasiquoted(obj, quasi_level, lex_env, frames, splice))
+        return splice;
+
+    while (true) {
+        QuasiFrame& frame = frames.back();
+        if (frame.next < frame.elements.size()) {
+            Ref<Object> element = frame.elements[frame.next++];
+            // frame is only used again if nothing was pushed, which would
+            // have left it dangling.
+            if (expand_quasiquoted(element, frame.quasi_level, lex_env, frames, splice))
+                frame.expansion.insert(frame.expansion.end(), splice.begin(), splice.end());
+            continue;
         }
-        if (result_list.empty())
-            return { std::make_shared<Nil>() };
+
+        if (frame.quotation)
+            splice = expand_quotation(frame.quotation, frame.expansion);
+        else if (frame.expansion.empty())
+            splice = { Object::nil() };
         else
-            return { std::make_shared<Cons>(result_list) };
+            splice = { Cons::list(frame.expansion) };
+        bool constant = frame.constant;
+        if (constant)
+            for (Ref<Object>& element : splice)
+                element = HashCons::canonical(element);
+        frames.pop_back();
+        if (frames.empty())
+            return splice;
+        QuasiFrame& outer = frames.back();
+        outer.constant = outer.constant && constant;
+        outer.expansion.insert(outer.expansion.end(), splice.begin(), splice.end());
     }
 }
 
-std::shared_ptr<Object> quasiquote::apply(
+Ref<Object> quasiquote::apply(
     Environment& lex_env,
-    const std::vector<std::shared_ptr<Object>>& arguments)
+    std::span<const Ref<Object>> arguments)
 {
     if (arguments.size() != 1)
         throw std::runtime_error("Expected only one argument.");
 
-    std::shared_ptr<Cons> list = std::dynamic_pointer_cast<Cons>(arguments[0]);
+    Ref<Cons> list = Object::cast<Cons>(arguments[0]);
 
     if (!list)
         return arguments[0];
     else {
-        std::vector<std::shared_ptr<Object>> res = eval_quasiquote(arguments[0], 1, lex_env);
+        std::vector<Ref<Object>> res = eval_quasiquote(arguments[0], 1, lex_env);
         if (res.size() > 1)
             throw std::runtime_error("Used slice-unquote at the top of quasiquote");
         return res[0];
@@ -188,67 +300,60 @@ std::shared_ptr<Object> quasiquote::apply(
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> lambda::apply(
+Ref<Object> lambda::apply(
     Environment& lex_env,
-    const std::vector<std::shared_ptr<Object>>& arguments)
+    std::span<const Ref<Object>> arguments)
 {
     if (arguments.size() < 1)
         throw std::runtime_error("Expected at least one argument.");
 
-    std::vector<std::shared_ptr<Symbol>> func_arg_symbols;
-    std::shared_ptr<Nil> no_args = std::dynamic_pointer_cast<Nil>(arguments[0]);
-    if (!no_args) {
-        std::shared_ptr<Cons> func_args = std::dynamic_pointer_cast<Cons>(arguments[0]);
-        if (!func_args)
+    Ref<Environment::Scope> params(new Environment::Scope);
+    if (!Object::is<Nil>(arguments[0])) {
+        if (!Object::is<Cons>(arguments[0]))
             throw std::runtime_error("Expected a list of symbols.");
-        for (std::shared_ptr<Object>& func_arg : func_args->toList()) {
-            std::shared_ptr<Symbol> func_arg_symbol = std::dynamic_pointer_cast<Symbol>(func_arg);
-            if (!func_arg_symbol)
+        for (Ref<Object>& func_arg : Object::as<Cons>(arguments[0])->toList()) {
+            if (!Object::is<Symbol>(func_arg))
                 throw std::runtime_error("Expected a symbol as an argument.");
-            func_arg_symbols.push_back(func_arg_symbol);
+            params->symbols.emplace_back(Object::as<Symbol>(func_arg));
         }
     }
 
-    std::vector<std::shared_ptr<Object>> body;
-    for (size_t i = 1; i < arguments.size(); i++)
-        body.push_back(arguments[i]);
+    Ref<LambdaCode> code = Resolver::resolve_lambda(params, arguments.subspan(1), lex_env);
 
-    return std::make_shared<FunctionUser>("<lambda>", lex_env, func_arg_symbols, body);
+    return make<FunctionUser>("<lambda>", code, lex_env.capture(code->sources));
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> gamma::apply(
+Ref<Object> gamma::apply(
     Environment& lex_env,
-    const std::vector<std::shared_ptr<Object>>& arguments)
+    std::span<const Ref<Object>> arguments)
 {
     if (arguments.size() < 1)
         throw std::runtime_error("Expected at least one argument.");
 
-    std::shared_ptr<Cons> macro_args = std::dynamic_pointer_cast<Cons>(arguments[0]);
+    Ref<Cons> macro_args = Object::cast<Cons>(arguments[0]);
     if (!macro_args)
         throw std::runtime_error("Expected a list of symbols.");
 
-    std::vector<std::shared_ptr<Symbol>> macro_arg_symbols;
-    for (std::shared_ptr<Object>& macro_arg : macro_args->toList()) {
-        std::shared_ptr<Symbol> macro_arg_symbol = std::dynamic_pointer_cast<Symbol>(macro_arg);
+    Ref<Environment::Scope> macro_arg_symbols(new Environment::Scope);
+    for (Ref<Object>& macro_arg : macro_args->toList()) {
+        Ref<Symbol> macro_arg_symbol = Object::cast<Symbol>(macro_arg);
         if (!macro_arg_symbol)
             throw std::runtime_error("Expected a symbol as an argument.");
-        macro_arg_symbols.push_back(macro_arg_symbol);
+        macro_arg_symbols->symbols.push_back(macro_arg_symbol);
     }
 
-    std::vector<std::shared_ptr<Object>> body;
-    for (size_t i = 1; i < arguments.size(); i++)
-        body.push_back(arguments[i]);
+    Ref<LambdaCode> code = Resolver::resolve_lambda(macro_arg_symbols, arguments.subspan(1), lex_env);
 
-    return std::make_shared<MacroUser>("<lambda>", lex_env, macro_arg_symbols, body);
+    return make<MacroUser>("<lambda>", code, lex_env.capture(code->sources));
 }
 
 // --------------------------------------------------------------------------------
 
-std::shared_ptr<Object> branch::apply(
+Ref<Object> branch::apply(
     Environment& lex_env,
-    const std::vector<std::shared_ptr<Object>>& arguments)
+    std::span<const Ref<Object>> arguments)
 {
     if (arguments.size() != 2 && arguments.size() != 3)
         throw std::runtime_error("Expected at two or three arguments.");
@@ -259,6 +364,90 @@ std::shared_ptr<Object> branch::apply(
         if (arguments.size() == 3)
             return Object::eval(arguments[2], lex_env);
         else
-            return std::make_shared<Nil>();
+            return Object::nil();
     }
 }
+
+// --------------------------------------------------------------------------------
+
+// Declares the variable named by the first argument special, so that let
+// forms and parameters bind it dynamically from then on, and gives it the
+// value of the second argument. defvar only gives it a value if it has none.
+static Ref<Object> define_special(Environment& lex_env,
+    std::span<const Ref<Object>> arguments, bool always)
+{
+    if (arguments.empty() || arguments.size() > 2)
+        throw std::runtime_error("Expected one or two arguments.");
+
+    Ref<Symbol> sym = Object::cast<Symbol>(arguments[0]);
+    if (!sym)
+        throw std::runtime_error("The first argument must be a symbol.");
+
+    sym->special = true;
+    if (arguments.size() == 2 && (always || !sym->value))
+        sym->value = Object::eval(arguments[1], lex_env);
+    return sym;
+}
+
+Ref<Object> defvar::apply(
+    Environment& lex_env,
+    std::span<const Ref<Object>> arguments)
+{
+    return define_special(lex_env, arguments, false);
+}
+
+Ref<Object> defparameter::apply(
+    Environment& lex_env,
+    std::span<const Ref<Object>> arguments)
+{
+    if (arguments.size() != 2)
+        throw std::runtime_error("Expected two arguments.");
+    return define_special(lex_env, arguments, true);
+}
+
+// --------------------------------------------------------------------------------
+
+Ref<Object> resolved_let::apply(
+    Environment& lex_env,
+    std::span<const Ref<Object>> arguments)
+{
+    size_t count = this->specials.empty() ? this->scope->symbols.size() : this->specials.size();
+    ArgumentStack::Frame values(count);
+    for (size_t i = 0; i < count; i++)
+        values.push(Object::eval(arguments[i], lex_env));
+
+    if (arguments.size() == count)
+        return Object::nil();
+
+    DynamicScope dynamic;
+    if (!this->specials.empty())
+        dynamic.bind(this->specials, values.data());
+    Environment::Frame frame(lex_env, *this->scope, values.data());
+
+    for (size_t i = count; i < arguments.size() - 1; i++)
+        Object::eval(arguments[i], lex_env);
+
+    return Object::eval(arguments.back(), lex_env);
+}
+
+void resolved_let::trace_impl(Tracer& tracer) const
+{
+    for (const Ref<Symbol>& symbol : this->scope->symbols)
+        tracer.mark(symbol);
+    for (const Ref<Symbol>& special : this->specials)
+        tracer.mark(special);
+}
+
+// --------------------------------------------------------------------------------
+
+Ref<Object> resolved_lambda::apply(
+    Environment& lex_env,
+    std::span<const Ref<Object>> arguments [[maybe_unused]])
+{
+    return make<FunctionUser>("<lambda>", this->code, lex_env.capture(this->code->sources));
+}
+
+void resolved_lambda::trace_impl(Tracer& tracer) const
+{
+    this->code->trace(tracer);
+}
@@ -8,9 +8,9 @@ void intern_special_operators();
 #define declare_special_operator(name)                                       \
     class name : public Procedure {                                          \
     public:                                                                  \
-        virtual std::shared_ptr<Object> apply(                               \
+        virtual Ref<Object> apply(                               \
             Environment& lex_env,                                            \
-            const std::vector<std::shared_ptr<Object>>& arguments) override; \
+            std::span<const Ref<Object>> arguments) override; \
     }
 
 declare_special_operator(progn);
@@ -20,3 +20,44 @@ declare_special_operator(quasiquote);
 declare_special_operator(lambda);
 declare_special_operator(gamma);
 declare_special_operator(branch);
+declare_special_operator(defvar);
+declare_special_operator(defparameter);
+
+// let and lambda forms rewritten by the Resolver, which bind their
+// variables by slot. They take the place of the name of the operator.
+
+// Its arguments are the initial values of the variables, then the body.
+class resolved_let : public Procedure {
+public:
+    Ref<Environment::Scope> scope; // The lexical variables
+    // Per binding, the special variable it binds, or null if it is lexical.
+    // Empty when none is special.
+    std::vector<Ref<Symbol>> specials;
+
+    resolved_let(const Ref<Environment::Scope>& _scope, std::vector<Ref<Symbol>>&& _specials)
+        : scope(_scope)
+        , specials(std::move(_specials))
+    {
+    }
+
+    virtual Ref<Object> apply(
+        Environment& lex_env,
+        std::span<const Ref<Object>> arguments) override;
+    virtual void trace_impl(Tracer& tracer) const override;
+};
+
+// Takes no arguments: its code is resolved already.
+class resolved_lambda : public Procedure {
+public:
+    Ref<LambdaCode> code;
+
+    resolved_lambda(const Ref<LambdaCode>& _code)
+        : code(_code)
+    {
+    }
+
+    virtual Ref<Object> apply(
+        Environment& lex_env,
+        std::span<const Ref<Object>> arguments) override;
+    virtual void trace_impl(Tracer& tracer) const override;
+};
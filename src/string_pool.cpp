@@ -0,0 +1,60 @@
+
+#include "string_pool.hpp"
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+// Texts are packed into chunks that are never freed or moved, so views of
+// them stay valid. Texts too large to pack get a block of their own.
+struct Pool {
+    static constexpr size_t chunk_size = 64 * 1024;
+
+    std::shared_mutex mutex;
+    std::unordered_set<std::string_view> texts;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* free = nullptr;
+    size_t available = 0;
+
+    std::string_view store(std::string_view text)
+    {
+        char* data;
+        if (text.size() > chunk_size / 4) {
+            data = this->blocks.emplace_back(new char[text.size()]).get();
+        } else {
+            if (text.size() > this->available) {
+                this->free = this->blocks.emplace_back(new char[chunk_size]).get();
+                this->available = chunk_size;
+            }
+            data = this->free;
+            this->free += text.size();
+            this->available -= text.size();
+        }
+        std::memcpy(data, text.data(), text.size());
+        return { data, text.size() };
+    }
+};
+
+// The text of pooled strings, whose last users may die at exit.
+Pool& pool = *new Pool;
+
+}
+
+std::string_view StringPool::intern(std::string_view text)
+{
+    {
+        std::shared_lock lock(pool.mutex);
+        auto it = pool.texts.find(text);
+        if (it != pool.texts.end())
+            return *it;
+    }
+    std::unique_lock lock(pool.mutex);
+    auto it = pool.texts.find(text);
+    if (it != pool.texts.end())
+        return *it;
+    return *pool.texts.insert(pool.store(text)).first;
+}
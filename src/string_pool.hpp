@@ -0,0 +1,12 @@
+
+#pragma once
+
+#include <string_view>
+
+// Immutable storage shared by all string objects. Each distinct text is
+// stored once and lives until the program exits.
+namespace StringPool {
+// Returns a view of the stored copy of text, storing it first if needed.
+// Safe to call from several threads at once.
+std::string_view intern(std::string_view text);
+};
@@ -8,12 +8,12 @@ void intern_symbols()
     Package::almaPackage->intern_symbol("unquote");
     Package::almaPackage->intern_symbol("slice-unquote");
 
-    std::shared_ptr<Symbol> current_package_sym = Package::almaPackage->intern_symbol("*current-package*");
-    current_package_sym->values = { Package::currentPackage };
+    Ref<Symbol> current_package_sym = Package::almaPackage->intern_symbol("*current-package*");
+    current_package_sym->value = Package::currentPackage;
 
-    std::shared_ptr<Symbol> t_sym = Package::almaPackage->intern_symbol("t");
-    t_sym->values = { t_sym };
+    Ref<Symbol> t_sym = Package::almaPackage->intern_symbol("t");
+    t_sym->value = t_sym;
 
-    std::shared_ptr<Symbol> nil_sym = Package::almaPackage->intern_symbol("nil");
-    nil_sym->values = { std::make_shared<Nil>() };
+    Ref<Symbol> nil_sym = Package::almaPackage->intern_symbol("nil");
+    nil_sym->value = Object::nil();
 }
@@ -0,0 +1,389 @@
+
+#include "translator.hpp"
+#include "compiler.hpp"
+#include "form_cache.hpp"
+#include "function.hpp"
+#include "jit.hpp"
+#include "macro.hpp"
+#include "package.hpp"
+#include "special_operator.hpp"
+#include "vm.hpp"
+#include <iterator>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string_view>
+
+namespace {
+
+// Calls nested deeper than this are evaluated as read.
+constexpr size_t max_depth = 32;
+
+// text as the contents of a C++ string literal, split into lines.
+std::string literal(std::string_view text)
+{
+    std::string out = "\"";
+    size_t line = 0;
+    for (unsigned char c : text) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+            line += 2;
+        } else if (c >= ' ' && c <= '~' && c != '?') {
+            out += c;
+            line += 1;
+        } else {
+            // Three octal digits, so that no digit after it is taken in.
+            static constexpr char digits[] = "01234567";
+            out += '\\';
+            out += digits[c >> 6];
+            out += digits[(c >> 3) & 7];
+            out += digits[c & 7];
+            line += 4;
+        }
+        if (line >= 96) {
+            out += "\"\n    \"";
+            line = 0;
+        }
+    }
+    return out + "\"";
+}
+
+// Whether form is a call that may be of a function: a proper list headed
+// by a symbol that does not name a special operator or a macro now.
+bool is_call(const Ref<Object>& form)
+{
+    if (!Object::is<Cons>(form) || !Object::as<Cons>(form)->elements())
+        return false;
+    const Ref<Object>& head = Object::as<Cons>(form)->car;
+    if (!Object::is<Symbol>(head))
+        return false;
+    const Ref<Procedure>& function = Object::as<Symbol>(head)->function;
+    return !function || (function->type >= Function::first_type && function->type <= Function::last_type);
+}
+
+// The names of the instructions, in the order of Op.
+constexpr const char* op_names[] = {
+    "Const", "Var", "Captured", "Global", "Function", "Call", "TailCall", "Jump", "JumpIfFalse", "Enter",
+    "Leave", "Closure", "Eval", "List", "Splice", "Append", "Copy", "Return"
+};
+
+const char* name_of(Op op)
+{
+    return op_names[static_cast<size_t>(op)];
+}
+
+// The name of the fast path of builtin in Runtime, or empty for none.
+std::string builtin_name(JIT::Builtin builtin)
+{
+    switch (builtin) {
+    case JIT::Builtin::Sum:
+        return "sum";
+    case JIT::Builtin::Eql:
+        return "eql";
+    case JIT::Builtin::Car:
+        return "car";
+    case JIT::Builtin::Cdr:
+        return "cdr";
+    default:
+        return "";
+    }
+}
+
+// name, fit for a comment: whatever might end or continue the line is
+// replaced.
+std::string printable(std::string_view name)
+{
+    std::string out;
+    for (char c : name)
+        out += c >= ' ' && c <= '~' && c != '\\' ? c : '?';
+    return out;
+}
+
+// The bodies of the functions and macros a program defines at top level,
+// and of the lambda forms in them, compiled as they will be when the
+// program runs.
+class Bodies {
+private:
+    Environment env;
+
+    void add(const Ref<LambdaCode>& code, const std::string& name)
+    {
+        if (!code->bytecode)
+            return;
+        this->found.push_back({ code, name });
+        for (const Ref<Object>& constant : code->bytecode->constants)
+            this->lambdas(constant, name);
+    }
+
+    // Adds the lambda forms obj holds, resolved and compiled by now.
+    void lambdas(const Ref<Object>& obj, const std::string& name)
+    {
+        for (Ref<Object> rest = obj; Object::is<Cons>(rest); rest = Object::as<Cons>(rest)->cdr())
+            this->lambdas(Object::as<Cons>(rest)->car, name);
+        if (!obj || Object::is_fixnum(obj))
+            return;
+        if (const resolved_lambda* lambda = dynamic_cast<const resolved_lambda*>(obj.get()))
+            this->add(lambda->code, "a lambda form in " + name);
+    }
+
+public:
+    struct Body {
+        Ref<LambdaCode> code; // Compiled
+        std::string name;
+    };
+    std::vector<Body> found;
+
+    // Compiles the function or macro form defines, if it is a defun or a
+    // defmacro. As the program will, it also defines the macro and declares
+    // the variables of defvar and defparameter special, which changes how
+    // the bodies after it compile; the values wait for the program.
+    void define(const Ref<Object>& form)
+    {
+        if (!Object::is<Cons>(form))
+            return;
+        std::optional<std::vector<Ref<Object>>> elements = Object::as<Cons>(form)->elements();
+        if (!elements || elements->size() < 2 || !Object::is<Symbol>((*elements)[0])
+            || !Object::is<Symbol>((*elements)[1]))
+            return;
+        const Procedure* head = Object::as<Symbol>((*elements)[0])->function.get();
+        Symbol* symbol = Object::as<Symbol>((*elements)[1]);
+
+        try {
+            if (dynamic_cast<const defvar*>(head) || dynamic_cast<const defparameter*>(head)) {
+                symbol->special = true;
+            } else if (dynamic_cast<const defmacro*>(head)) {
+                Object::eval(form, this->env);
+                if (Object::is<MacroUser>(symbol->function))
+                    this->add(Object::as<MacroUser>(symbol->function)->code, "macro " + symbol->name);
+            } else if (dynamic_cast<const defun*>(head) && elements->size() >= 3) {
+                (*elements)[1] = *Package::almaPackage->find_symbol("lambda");
+                elements->erase(elements->begin());
+                Ref<Object> function = Object::eval(Cons::list(*elements), this->env);
+                if (Object::is<FunctionUser>(function))
+                    this->add(Object::as<FunctionUser>(function)->code, "function " + symbol->name);
+            }
+        } catch (const std::runtime_error&) {
+            // Left for the program to run into.
+        }
+    }
+};
+
+class Translation {
+private:
+    std::ostream& out;
+
+    void indent(size_t depth)
+    {
+        for (size_t i = 0; i <= depth; i++)
+            this->out << "    ";
+    }
+
+    // A Runtime::call of the call form, found by the C++ expression place,
+    // taking its arguments as Runtime::Call c<depth>.
+    void call(const Ref<Object>& form, const std::string& place, size_t depth)
+    {
+        std::vector<Ref<Object>> elements = *Object::as<Cons>(form)->elements();
+        std::string name = "c";
+        name += std::to_string(depth);
+        this->out << "Runtime::call(env, " << place << ", " << elements.size() - 1 << ", [&](Runtime::Call&";
+        if (elements.size() == 1) {
+            this->out << ") {})";
+            return;
+        }
+        this->out << " " << name << ") {\n";
+        for (size_t i = 1; i < elements.size(); i++) {
+            this->indent(depth + 1);
+            if (depth + 1 < max_depth && is_call(elements[i])) {
+                this->out << name << ".push(";
+                this->call(elements[i], name + ".next()", depth + 1);
+                this->out << ");\n";
+            } else {
+                this->out << name << ".evaluate();\n";
+            }
+        }
+        this->indent(depth);
+        this->out << "})";
+    }
+
+    // A call of the Step of instruction i, indented to depth, returning it
+    // to the VM unless it goes on with the next one.
+    static std::string step(const Instruction& in, size_t i, size_t depth)
+    {
+        return "if (step_" + std::string(name_of(in.op)) + "(state, in[" + std::to_string(i)
+            + "]) != VM::Outcome::Next)\n" + std::string(4 * (depth + 1), ' ') + "return " + std::to_string(i) + ";\n";
+    }
+
+    // Instruction i as C++. Those that only move references and jump are
+    // done in place, as are calls of the builtins the JIT inlines, guarded
+    // by the function being the builtin still; the rest call their Step.
+    std::string instruction(const Bytecode& bytecode, size_t i) const
+    {
+        const Instruction& in = bytecode.code[i];
+        std::string a = std::to_string(in.a), b = std::to_string(in.b), c = std::to_string(in.c);
+        switch (in.op) {
+        case Op::Const:
+            return "r[" + a + "] = k[" + b + "];\n";
+        case Op::Var:
+            return "r[" + a + "] = Object::is<Cell>(r[" + b + "]) ? Object::as<Cell>(r[" + b + "])->value : r[" + b
+                + "];\n";
+        case Op::Captured:
+            return "r[" + a + "] = Object::as<Cell>(state.cells[" + b + "])->value;\n";
+        case Op::Function:
+            return "if (step_Function(state, in[" + std::to_string(i) + "]) == VM::Outcome::Branch)\n        goto i" + c
+                + ";\n";
+        case Op::Call:
+        case Op::TailCall: {
+            const Procedure* function = nullptr;
+            std::string builtin = builtin_name(JIT::builtin(bytecode, i, function));
+            if (builtin.empty())
+                return step(in, i, 1);
+            std::string arguments = "r[" + std::to_string(in.b + 1) + "]";
+            if (in.c == 2)
+                arguments += ", r[" + std::to_string(in.b + 2) + "]";
+            return "if (r[" + b + "].get() != Runtime::builtins." + builtin + " || !Runtime::" + builtin + "_of(r[" + a
+                + "], " + arguments + ")) {\n        " + step(in, i, 2) + "    }\n";
+        }
+        case Op::Jump:
+            return "goto i" + a + ";\n";
+        case Op::JumpIfFalse:
+            return "if (!Object::is_true(r[" + a + "]))\n        goto i" + b + ";\n";
+        case Op::Return:
+            return "state.result = std::move(r[" + a + "]);\n    return JIT::returned;\n";
+        default:
+            return step(in, i, 1);
+        }
+    }
+
+    // The code of the body, and a function with the contract of
+    // TranslatedCode that runs it.
+    void body(size_t index, const Bodies::Body& body) const
+    {
+        const std::vector<Instruction>& code = body.code->bytecode->code;
+        std::string n = std::to_string(index);
+
+        this->out << "\n"
+                  << "// " << printable(body.name) << "\n"
+                  << "const Instruction code_" << n << "[] = {\n";
+        for (const Instruction& in : code)
+            this->out << "    { Op::" << name_of(in.op) << ", " << in.a << ", " << in.b << ", " << in.c << " },\n";
+        this->out << "};\n";
+
+        // Where the VM starts it, and resumes it after the calls it makes.
+        std::set<size_t> entries = { 0 };
+        std::set<size_t> labels = { 0 };
+        for (size_t i = 0; i < code.size(); i++) {
+            const Instruction& in = code[i];
+            if ((in.op == Op::Call || in.op == Op::TailCall) && i + 1 < code.size()) {
+                entries.insert(i + 1);
+                labels.insert(i + 1);
+            } else if (in.op == Op::Jump) {
+                labels.insert(in.a);
+            } else if (in.op == Op::JumpIfFalse) {
+                labels.insert(in.b);
+            } else if (in.op == Op::Function) {
+                labels.insert(in.c);
+            }
+        }
+
+        this->out << "\n"
+                  << "uint32_t body_" << n << "(VM::State& state, Ref<Object>* r, uint32_t start)\n"
+                  << "{\n"
+                  << "    [[maybe_unused]] const Instruction* in = state.bytecode.code.data();\n"
+                  << "    [[maybe_unused]] const Ref<Object>* k = state.bytecode.constants.data();\n"
+                  << "    switch (start) {\n";
+        for (size_t entry : entries)
+            this->out << "    case " << entry << ":\n"
+                      << "        goto i" << entry << ";\n";
+        this->out << "    default:\n"
+                  << "        return start;\n"
+                  << "    }\n";
+        for (size_t i = 0; i < code.size(); i++) {
+            if (labels.contains(i))
+                this->out << "i" << i << ":\n";
+            this->out << "    " << this->instruction(*body.code->bytecode, i);
+        }
+        this->out << "}\n";
+    }
+
+public:
+    Translation(std::ostream& _out)
+        : out(_out)
+    {
+    }
+
+    void program(const std::vector<Ref<Object>>& forms, const std::string& source, const std::string& image,
+        const std::vector<Bodies::Body>& bodies)
+    {
+        this->out << "// Translated from " << literal(source) << " by alma --compile-to-cpp.\n"
+                  << "#include \"runtime.hpp\"\n"
+                  << "#include \"vm.hpp\"\n"
+                  << "\n"
+                  << "namespace {\n"
+                  << "\n"
+                  << "const char image[] = " << literal(image) << ";\n"
+                  << "\n";
+        for (size_t op = 0; op < std::size(op_names); op++) {
+            if (VM::step(static_cast<Op>(op)))
+                this->out << "const VM::Step step_" << op_names[op] << " = VM::step(Op::" << op_names[op] << ");\n";
+        }
+
+        for (size_t i = 0; i < bodies.size(); i++)
+            this->body(i, bodies[i]);
+
+        for (size_t i = 0; i < forms.size(); i++) {
+            if (!is_call(forms[i]))
+                continue;
+            this->out << "\n"
+                      << "Ref<Object> form_" << i << "(Environment& env, const Ref<Object>& form)\n"
+                      << "{\n"
+                      << "    return ";
+            this->call(forms[i], "form", 0);
+            this->out << ";\n"
+                      << "}\n";
+        }
+
+        this->out << "\n"
+                  << "const Runtime::Translated translated[] = {\n";
+        for (size_t i = 0; i < forms.size(); i++)
+            this->out << "    " << (is_call(forms[i]) ? "form_" + std::to_string(i) : "nullptr") << ",\n";
+        this->out << "    nullptr, // Keeps the array from being empty\n"
+                  << "};\n"
+                  << "\n"
+                  << "const Runtime::Body bodies[] = {\n";
+        for (size_t i = 0; i < bodies.size(); i++)
+            this->out << "    { code_" << i << ", body_" << i << " },\n";
+        this->out << "    { {}, nullptr }, // Keeps the array from being empty\n"
+                  << "};\n"
+                  << "\n"
+                  << "}\n"
+                  << "\n"
+                  << "// The entry point, for programs built as shared objects.\n"
+                  << "extern \"C\" int alma_main(int argc, char* argv[])\n"
+                  << "{\n"
+                  << "    return Runtime::main(argc, argv, " << literal(source)
+                  << ", std::string_view(image, sizeof(image) - 1),\n"
+                  << "        std::span(translated, " << forms.size() << "), std::span(bodies, " << bodies.size() << "));\n"
+                  << "}\n"
+                  << "\n"
+                  << "#ifndef ALMA_NO_MAIN\n"
+                  << "int main(int argc, char* argv[])\n"
+                  << "{\n"
+                  << "    return alma_main(argc, argv);\n"
+                  << "}\n"
+                  << "#endif\n";
+    }
+};
+
+}
+
+void Translator::translate(const std::vector<Ref<Object>>& forms, const std::string& source, std::ostream& out)
+{
+    std::optional<std::string> image = FormCache::image(forms);
+    if (!image)
+        throw std::runtime_error("The forms of " + source + " cannot be translated.");
+    Bodies bodies;
+    for (const Ref<Object>& form : forms)
+        bodies.define(form);
+    Translation(out).program(forms, source, *image, bodies.found);
+}
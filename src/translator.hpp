@@ -0,0 +1,23 @@
+
+#pragma once
+
+#include "objects.hpp"
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Translates the top-level forms of a program to a C++ program that runs
+// on the Runtime library. The forms are embedded as a FormCache image, so
+// the program reads nothing. Calls of functions, down to their arguments
+// that are calls too, are translated to C++ that evaluates each argument
+// and calls the function directly; everything else, and calls of symbols
+// that turn out not to name a function when they are run, is evaluated as
+// read. The bodies of the functions and macros defined at top level, and
+// of the lambda forms in them, are compiled to bytecode as the program will
+// compile them, and each one is translated to a C++ function the VM runs
+// in its place whenever a body compiles to the same code.
+namespace Translator {
+// Writes the program for forms read from source to out. Throws if they
+// hold objects that cannot be embedded.
+void translate(const std::vector<Ref<Object>>& forms, const std::string& source, std::ostream& out);
+};
@@ -0,0 +1,81 @@
+
+#include "types.hpp"
+#include "package.hpp"
+#include <array>
+#include <bit>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+// For each bit, the bit itself and those of all its supertypes.
+std::array<Types::Mask, 64> supertypes = {};
+std::array<Types::Mask, 256> instances = {};
+unsigned defined = 0;
+
+Types::Mask bit_of(std::string_view name)
+{
+    std::optional<Ref<Symbol>> sym = Package::almaPackage->find_symbol(name);
+    if (!sym || !(*sym)->type_bit)
+        throw std::runtime_error("Unknown type " + std::string(name));
+    return (*sym)->type_bit;
+}
+
+}
+
+Types::Mask Types::define(std::string_view name, std::initializer_list<std::string_view> parents)
+{
+    if (defined == supertypes.size())
+        throw std::runtime_error("Too many types");
+    Mask bit = Mask(1) << defined;
+    Mask mask = bit;
+    for (std::string_view parent : parents)
+        mask |= supertypes[std::countr_zero(bit_of(parent))];
+    supertypes[defined++] = mask;
+    Package::almaPackage->intern_symbol(name)->type_bit = bit;
+    return bit;
+}
+
+void Types::add_instances(Object::Type type, std::string_view name)
+{
+    instances[static_cast<uint8_t>(type)] |= supertypes[std::countr_zero(bit_of(name))];
+}
+
+Types::Mask Types::of(Object::Type type)
+{
+    return instances[static_cast<uint8_t>(type)];
+}
+
+// --------------------------------------------------------------------------------
+
+void intern_types()
+{
+    using Type = Object::Type;
+
+    Types::define("t", {});
+    Types::define("integer", { "t" });
+    Types::define("string", { "t" });
+    Types::define("symbol", { "t" });
+    Types::define("list", { "t" });
+    Types::define("cons", { "list" });
+    Types::define("null", { "list" });
+    Types::define("procedure", { "t" });
+    Types::define("function", { "procedure" });
+    Types::define("function-user", { "function" });
+    Types::define("macro", { "procedure" });
+    Types::define("macro-user", { "macro" });
+    Types::define("package", { "t" });
+
+    Types::add_instances(Type::Fixnum, "integer");
+    Types::add_instances(Type::Integer, "integer");
+    Types::add_instances(Type::String, "string");
+    Types::add_instances(Type::Symbol, "symbol");
+    Types::add_instances(Type::Cons, "cons");
+    Types::add_instances(Type::Nil, "null");
+    Types::add_instances(Type::SpecialOperator, "procedure");
+    Types::add_instances(Type::Function, "function");
+    Types::add_instances(Type::FunctionUser, "function-user");
+    Types::add_instances(Type::Macro, "macro");
+    Types::add_instances(Type::MacroUser, "macro-user");
+    Types::add_instances(Type::Package, "package");
+}
@@ -0,0 +1,24 @@
+
+#pragma once
+
+#include "objects.hpp"
+#include <cstdint>
+#include <initializer_list>
+#include <string_view>
+
+void intern_types();
+
+// Lattice of the types known to typep. Each type designator is a symbol
+// holding one bit, and each kind of object has a precomputed mask with the
+// bits of every type it belongs to, so typep is one lookup and one AND.
+namespace Types {
+using Mask = uint64_t;
+
+// Adds a type below the given ones and returns its bit. Types must be
+// defined after their parents.
+Mask define(std::string_view name, std::initializer_list<std::string_view> parents);
+// Makes the objects of a kind members of the type and all its supertypes.
+void add_instances(Object::Type type, std::string_view name);
+// Every type the objects of a kind belong to.
+Mask of(Object::Type type);
+};
@@ -0,0 +1,584 @@
+
+#include "vm.hpp"
+#include "argument_stack.hpp"
+#include "dynamic_scope.hpp"
+#include "heap.hpp"
+#include "jit.hpp"
+#include "source_map.hpp"
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <ranges>
+
+namespace {
+
+using VM::State;
+
+bool is_function(const Procedure* procedure)
+{
+    return procedure && procedure->type >= Function::first_type && procedure->type <= Function::last_type;
+}
+
+// A new list of the elements of lists, as slice-unquote splices them.
+Ref<Object> append(std::span<const Ref<Object>> lists)
+{
+    std::vector<Ref<Object>> elements;
+    for (const Ref<Object>& list : lists) {
+        if (Object::is<Nil>(list))
+            continue;
+        std::vector<Ref<Object>> spliced = Object::as<Cons>(list)->toList();
+        elements.insert(elements.end(), spliced.begin(), spliced.end());
+    }
+    if (elements.empty())
+        return Object::nil();
+    return Cons::list(elements);
+}
+
+// What each instruction that neither jumps nor returns does, for the VM
+// and for the steps of native code alike.
+
+void run_const(State& state, const Instruction& in)
+{
+    state.registers[in.a] = state.bytecode.constants[in.b];
+}
+
+void run_var(State& state, const Instruction& in)
+{
+    const Ref<Object>& value = state.registers[in.b];
+    state.registers[in.a] = Object::is<Cell>(value) ? Object::as<Cell>(value)->value : value;
+}
+
+void run_captured(State& state, const Instruction& in)
+{
+    state.registers[in.a] = Object::as<Cell>(state.cells[in.b])->value;
+}
+
+void run_global(State& state, const Instruction& in)
+{
+    const Symbol* symbol = Object::as<Symbol>(state.bytecode.constants[in.b]);
+    if (!symbol->value)
+        throw std::runtime_error("Symbol " + symbol->name + " unbound.");
+    state.registers[in.a] = symbol->value;
+}
+
+// False if the symbol has no function, leaving the call to the tree walker.
+bool run_function(State& state, const Instruction& in)
+{
+    const Ref<Procedure>& function = Object::as<Symbol>(state.bytecode.constants[in.b])->function;
+    if (!is_function(function.get()))
+        return false;
+    state.registers[in.a] = function;
+    return true;
+}
+
+void run_call(State& state, const Instruction& in)
+{
+    Ref<Object>* r = state.registers;
+    Function* function = Object::as<Function>(r[in.b]);
+    r[in.a] = function->call(std::span<const Ref<Object>>(r + in.b + 1, in.c), state.env);
+}
+
+void run_enter(State& state, const Instruction& in)
+{
+    state.scopes.enter(state.env, *state.bytecode.scopes[in.a], state.registers + in.b);
+}
+
+void run_leave(State& state, const Instruction& in)
+{
+    state.scopes.leave();
+    for (uint16_t i = 0; i < in.b; i++)
+        state.registers[in.a + i] = nullptr;
+}
+
+void run_closure(State& state, const Instruction& in)
+{
+    state.registers[in.a] = Object::as<Procedure>(state.bytecode.constants[in.b])->apply(state.env, {});
+}
+
+void run_eval(State& state, const Instruction& in)
+{
+    state.registers[in.a] = Object::eval(state.bytecode.constants[in.b], state.env);
+}
+
+void run_list(State& state, const Instruction& in)
+{
+    if (in.c == 0)
+        state.registers[in.a] = Object::nil();
+    else
+        state.registers[in.a] = Cons::list(std::span<const Ref<Object>>(state.registers + in.b, in.c));
+}
+
+void run_splice(State& state, const Instruction& in)
+{
+    const Ref<Object>& list = state.registers[in.a];
+    if (!Object::is<Cons>(list) && !Object::is<Nil>(list))
+        throw std::runtime_error("The result of slice-unquote must be a list.");
+    if (Object::is<Cons>(list) && !Object::as<Cons>(list)->elements())
+        throw std::runtime_error("Error: Not a proper list.");
+}
+
+void run_append(State& state, const Instruction& in)
+{
+    state.registers[in.a] = append(std::span<const Ref<Object>>(state.registers + in.b, in.c));
+}
+
+void run_copy(State& state, const Instruction& in)
+{
+    state.registers[in.a] = VM::copy(state.bytecode.constants[in.b]);
+}
+
+void run_return(State& state, const Instruction& in)
+{
+    state.result = std::move(state.registers[in.a]);
+}
+
+// The Step of an instruction that runs with run, keeping what it throws for
+// the VM.
+template <void (*run)(State&, const Instruction&)>
+VM::Outcome catching(State& state, const Instruction& in) noexcept
+{
+    try {
+        run(state, in);
+        return VM::Outcome::Next;
+    } catch (...) {
+        state.error = std::current_exception();
+        return VM::Outcome::Failed;
+    }
+}
+
+VM::Outcome step_function(State& state, const Instruction& in) noexcept
+{
+    // Only reads and copies, so it cannot throw.
+    return run_function(state, in) ? VM::Outcome::Next : VM::Outcome::Branch;
+}
+
+// Whether calling function runs compiled code, which the VM runs on an
+// Activation of its own.
+bool invokes(const Ref<Object>& function)
+{
+    if (!Object::is<FunctionUser>(function))
+        return false;
+    const LambdaCode& code = *Object::as<FunctionUser>(function)->code;
+    if (code.bytecode && code.bytecode->checked != Compiler::redefinitions)
+        code.refresh();
+    return code.bytecode != nullptr;
+}
+
+VM::Outcome step_call(State& state, const Instruction& in) noexcept
+{
+    if (invokes(state.registers[in.b]))
+        return VM::Outcome::Invoke;
+    return catching<run_call>(state, in);
+}
+
+// A call of compiled code in progress: the frames LambdaCode::call would
+// make for it, and where it is in its bytecode.
+struct Activation {
+    Ref<Object> function; // Keeps the code and cells alive, if the caller does not
+    Environment env;
+    Environment::Frame captured;
+    ArgumentStack::Frame slots;
+    DynamicScope dynamic;
+    Environment::Frame params;
+    State state;
+    const Instruction* pc;
+    uint16_t target = 0; // Register of the caller that takes the result
+    bool binds_specials;
+
+    Activation(Ref<Object> _function, const LambdaCode& code, std::vector<Ref<Object>>& cells,
+        std::span<const Ref<Object>> args)
+        : function(std::move(_function))
+        , captured(env, *code.captures, cells.data())
+        , slots(code.bytecode->registers)
+        , params(env, *code.params, slots.data())
+        , state(*code.bytecode, cells, slots.data(), env)
+        , pc(code.bytecode->code.data())
+        , binds_specials(!code.specials.empty())
+    {
+        for (const Ref<Object>& arg : args)
+            this->slots.push(arg);
+        if (this->binds_specials)
+            this->dynamic.bind(code.specials, this->slots.data());
+
+        Bytecode& bytecode = this->state.bytecode;
+        if (!bytecode.translated && bytecode.calls < JIT::hot_calls && ++bytecode.calls == JIT::hot_calls)
+            bytecode.native = JIT::compile(bytecode);
+    }
+};
+
+// The activations of one VM::call, innermost last. Their memory is kept
+// for the next ones, up to a limit.
+class Stack {
+private:
+    std::vector<Activation*> activations;
+
+    // Memory of activations that have been popped.
+    struct Spare {
+        std::vector<void*> blocks;
+
+        ~Spare()
+        {
+            for (void* block : this->blocks)
+                ::operator delete(block);
+        }
+    };
+    static std::vector<void*>& spare()
+    {
+        static thread_local Spare spare;
+        return spare.blocks;
+    }
+    static constexpr size_t max_spare = 256;
+
+    const Stack* outer;
+
+public:
+    // Arguments of a tail call, moved out of the activation it replaces.
+    std::vector<Ref<Object>> passing;
+
+    // The innermost Stack of the calling thread, whose calls run inside the
+    // ones of the Stacks it links to.
+    static const Stack*& current()
+    {
+        static thread_local const Stack* stack = nullptr;
+        return stack;
+    }
+
+    Stack()
+        : outer(current())
+    {
+        current() = this;
+    }
+    Stack(const Stack&) = delete;
+    Stack& operator=(const Stack&) = delete;
+    ~Stack()
+    {
+        while (!this->activations.empty())
+            this->pop();
+        current() = this->outer;
+    }
+
+    bool empty() const { return this->activations.empty(); }
+    Activation& top() const { return *this->activations.back(); }
+    // From the innermost one out.
+    auto innermost() const { return std::views::reverse(this->activations); }
+
+    Activation& push(Ref<Object> function, const LambdaCode& code, std::vector<Ref<Object>>& cells,
+        std::span<const Ref<Object>> args)
+    {
+        std::vector<void*>& blocks = spare();
+        void* memory;
+        if (blocks.empty()) {
+            memory = ::operator new(sizeof(Activation));
+        } else {
+            memory = blocks.back();
+            blocks.pop_back();
+        }
+        try {
+            this->activations.push_back(new (memory) Activation(std::move(function), code, cells, args));
+        } catch (...) {
+            blocks.push_back(memory);
+            throw;
+        }
+        return *this->activations.back();
+    }
+
+    // Marks what its activations and the ones of the Stacks it links to
+    // hold, except their registers, which are in the ArgumentStack.
+    void trace(Tracer& tracer) const
+    {
+        for (const Stack* it = this; it; it = it->outer) {
+            for (const Activation* activation : it->activations) {
+                tracer.mark(activation->function);
+                activation->env.trace(tracer);
+                tracer.mark(activation->state.result);
+                // The first activation has no function, but its cells are
+                // a member of the closure it runs, which this keeps alive.
+                tracer.mark_within(&activation->state.cells);
+            }
+            for (const Ref<Object>& obj : it->passing)
+                tracer.mark(obj);
+        }
+    }
+
+    void pop()
+    {
+        Activation* activation = this->activations.back();
+        this->activations.pop_back();
+        activation->~Activation();
+        if (spare().size() < max_spare)
+            spare().push_back(activation);
+        else
+            ::operator delete(activation);
+    }
+};
+
+// Why execute stopped running an activation.
+enum class Exit {
+    Return, // It returned state.result
+    Call, // Its pc calls compiled code
+    TailCall, // Its pc calls compiled code and returns the result
+};
+
+// Dispatches with a table of label addresses where the compiler supports
+// them, and with a switch elsewhere.
+#if defined(__GNUC__)
+#define ALMA_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+#ifdef ALMA_COMPUTED_GOTO
+#define CASE(name) op_##name:
+#define DISPATCH() goto* labels[static_cast<size_t>(pc->op)]
+#else
+#define CASE(name) case Op::name:
+#define DISPATCH() continue
+#endif
+#define NEXT() \
+    pc++;      \
+    DISPATCH()
+#define JUMP(target)       \
+    pc = code + (target); \
+    DISPATCH()
+
+// Runs activation from its pc until it returns or calls compiled code.
+Exit execute(Activation& activation)
+{
+#ifdef ALMA_COMPUTED_GOTO
+    // In the order of Op.
+    static const void* const labels[] = {
+        &&op_Const, &&op_Var, &&op_Captured, &&op_Global, &&op_Function, &&op_Call, &&op_TailCall,
+        &&op_Jump, &&op_JumpIfFalse, &&op_Enter, &&op_Leave, &&op_Closure, &&op_Eval, &&op_List,
+        &&op_Splice, &&op_Append, &&op_Copy, &&op_Return
+    };
+#endif
+
+    State& state = activation.state;
+    const Bytecode& bytecode = state.bytecode;
+    Ref<Object>* const r = state.registers;
+    const Instruction* const code = bytecode.code.data();
+    const Instruction* pc = activation.pc;
+
+    // Native code, or the body as translated to C++, runs it up to its end,
+    // or up to an instruction it leaves to the VM.
+    if (bytecode.translated || bytecode.native) {
+        uint32_t exit = bytecode.translated ? bytecode.translated(state, r, pc - code)
+                                            : bytecode.native.run(state, r, pc - code);
+        if (exit == JIT::returned)
+            return Exit::Return;
+        pc = code + exit;
+        if (state.error) {
+            activation.pc = pc;
+            std::rethrow_exception(std::exchange(state.error, nullptr));
+        }
+    }
+
+    try {
+#ifdef ALMA_COMPUTED_GOTO
+        DISPATCH();
+#else
+        for (;;) {
+            switch (pc->op) {
+#endif
+        CASE(Const)
+        {
+            run_const(state, *pc);
+            NEXT();
+        }
+        CASE(Var)
+        {
+            run_var(state, *pc);
+            NEXT();
+        }
+        CASE(Captured)
+        {
+            run_captured(state, *pc);
+            NEXT();
+        }
+        CASE(Global)
+        {
+            run_global(state, *pc);
+            NEXT();
+        }
+        CASE(Function)
+        {
+            if (!run_function(state, *pc)) {
+                JUMP(pc->c);
+            }
+            NEXT();
+        }
+        CASE(Call)
+        {
+            if (invokes(r[pc->b])) {
+                activation.pc = pc;
+                return Exit::Call;
+            }
+            run_call(state, *pc);
+            NEXT();
+        }
+        CASE(TailCall)
+        {
+            if (invokes(r[pc->b])) {
+                activation.pc = pc;
+                return Exit::TailCall;
+            }
+            run_call(state, *pc);
+            NEXT();
+        }
+        CASE(Jump)
+        {
+            JUMP(pc->a);
+        }
+        CASE(JumpIfFalse)
+        {
+            if (!Object::is_true(r[pc->a])) {
+                JUMP(pc->b);
+            }
+            NEXT();
+        }
+        CASE(Enter)
+        {
+            run_enter(state, *pc);
+            NEXT();
+        }
+        CASE(Leave)
+        {
+            run_leave(state, *pc);
+            NEXT();
+        }
+        CASE(Closure)
+        {
+            run_closure(state, *pc);
+            NEXT();
+        }
+        CASE(Eval)
+        {
+            run_eval(state, *pc);
+            NEXT();
+        }
+        CASE(List)
+        {
+            run_list(state, *pc);
+            NEXT();
+        }
+        CASE(Splice)
+        {
+            run_splice(state, *pc);
+            NEXT();
+        }
+        CASE(Append)
+        {
+            run_append(state, *pc);
+            NEXT();
+        }
+        CASE(Copy)
+        {
+            run_copy(state, *pc);
+            NEXT();
+        }
+        CASE(Return)
+        {
+            run_return(state, *pc);
+            return Exit::Return;
+        }
+#ifndef ALMA_COMPUTED_GOTO
+            }
+        }
+#endif
+    } catch (...) {
+        activation.pc = pc;
+        throw;
+    }
+}
+
+#ifdef ALMA_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+}
+
+VM::Step VM::step(Op op)
+{
+    // In the order of Op.
+    static const Step steps[] = {
+        catching<run_const>, catching<run_var>, catching<run_captured>, catching<run_global>, step_function,
+        step_call, step_call, nullptr, nullptr, catching<run_enter>, catching<run_leave>,
+        catching<run_closure>, catching<run_eval>, catching<run_list>, catching<run_splice>,
+        catching<run_append>, catching<run_copy>, catching<run_return>
+    };
+    return steps[static_cast<size_t>(op)];
+}
+
+Ref<Object> VM::copy(const Ref<Object>& obj)
+{
+    if (!Object::is<Cons>(obj))
+        return obj;
+    std::vector<Ref<Object>> elements;
+    for (const Cons* cell = Object::as<Cons>(obj); cell; cell = cell->next())
+        elements.push_back(copy(cell->car));
+    return Cons::list(elements);
+}
+
+Ref<Object> VM::call(const LambdaCode& code, std::vector<Ref<Object>>& cells, std::span<const Ref<Object>> args)
+{
+    code.check_arity(args.size());
+    Stack stack;
+    stack.push(nullptr, code, cells, args);
+
+    try {
+        for (;;) {
+            Heap::safepoint();
+            Activation& top = stack.top();
+            Exit exit = execute(top);
+            if (exit == Exit::Return) {
+                Ref<Object> result = std::move(top.state.result);
+                uint16_t target = top.target;
+                stack.pop();
+                if (stack.empty())
+                    return result;
+                Activation& caller = stack.top();
+                caller.state.registers[target] = std::move(result);
+                caller.pc++;
+                continue;
+            }
+
+            const Instruction& in = *top.pc;
+            Ref<Object>* r = top.state.registers;
+            FunctionUser* function = Object::as<FunctionUser>(r[in.b]);
+            function->code->check_arity(in.c);
+            std::span<const Ref<Object>> arguments(r + in.b + 1, in.c);
+            // Special variables bound by the caller must stay bound until
+            // the callee returns.
+            if (exit == Exit::Call || top.binds_specials) {
+                stack.push(r[in.b], *function->code, function->cells, arguments).target = in.a;
+                continue;
+            }
+
+            Ref<Object> callee = r[in.b];
+            stack.passing.assign(std::make_move_iterator(r + in.b + 1), std::make_move_iterator(r + in.b + 1 + in.c));
+            uint16_t target = top.target;
+            stack.pop();
+            stack.push(std::move(callee), *function->code, function->cells, stack.passing).target = target;
+            stack.passing.clear();
+        }
+    } catch (const LocatedError&) {
+        throw;
+    } catch (const std::runtime_error& e) {
+        // Point at the innermost form that came from a source file, as the
+        // tree walker does: where the error happened, or else the call
+        // that led there.
+        for (Activation* activation : stack.innermost()) {
+            const Bytecode& bytecode = activation->state.bytecode;
+            const Cons* form = bytecode.forms[activation->pc - bytecode.code.data()];
+            if (std::optional<std::string> location = form ? SourceMap::describe(form) : std::nullopt)
+                throw LocatedError(*location + ": " + e.what());
+        }
+        throw;
+    }
+}
+
+void VM::trace(Tracer& tracer)
+{
+    if (const Stack* stack = Stack::current())
+        stack->trace(tracer);
+}
@@ -0,0 +1,90 @@
+
+#pragma once
+
+#include "compiler.hpp"
+#include "environment.hpp"
+#include "objects.hpp"
+#include <exception>
+#include <new>
+#include <span>
+#include <vector>
+
+// Runs Bytecode with a register machine.
+namespace VM {
+
+// The frames of the let forms being run, linked into the Environment as
+// they are entered and unlinked as they are left, or when an error unwinds
+// past them.
+class Scopes {
+private:
+    alignas(Environment::Frame) unsigned char storage[max_scopes][sizeof(Environment::Frame)];
+    size_t count = 0;
+
+public:
+    Scopes() = default;
+    Scopes(const Scopes&) = delete;
+    Scopes& operator=(const Scopes&) = delete;
+    ~Scopes()
+    {
+        while (this->count > 0)
+            this->leave();
+    }
+
+    void enter(Environment& env, const Environment::Scope& scope, Ref<Object>* slots)
+    {
+        new (this->storage[this->count++]) Environment::Frame(env, scope, slots);
+    }
+    void leave()
+    {
+        std::launder(reinterpret_cast<Environment::Frame*>(this->storage[--this->count]))->~Frame();
+    }
+};
+
+// A run of Bytecode in progress, shared by the VM and the native code it
+// hands the run to.
+struct State {
+    Bytecode& bytecode;
+    std::vector<Ref<Object>>& cells;
+    Ref<Object>* registers;
+    Environment& env;
+    Scopes scopes;
+    Ref<Object> result; // Set by Return
+    // Thrown by an instruction run from native code, to be rethrown by the
+    // VM at that instruction.
+    std::exception_ptr error;
+
+    State(Bytecode& _bytecode, std::vector<Ref<Object>>& _cells, Ref<Object>* _registers, Environment& _env)
+        : bytecode(_bytecode)
+        , cells(_cells)
+        , registers(_registers)
+        , env(_env)
+    {
+    }
+};
+
+// How an instruction run by a Step went.
+enum class Outcome : uint32_t {
+    Next, // Continue with the next instruction
+    Branch, // Continue at the instruction it jumps to
+    Failed, // It threw State::error
+    Invoke, // It calls compiled code, which the VM must run
+};
+
+// Runs one instruction for native code. It never throws.
+using Step = Outcome (*)(State& state, const Instruction& instruction);
+
+// The Step of op, or null for Jump and JumpIfFalse, which native code does
+// on its own. Calls of compiled code are left to the VM.
+Step step(Op op);
+
+// Calls code, which has Bytecode, for a closure with the given cells. The
+// calls it makes to other compiled code run on a stack of activations kept
+// on the heap rather than on the C++ stack, and tail calls replace the
+// activation of their caller, so they run in constant space.
+Ref<Object> call(const LambdaCode& code, std::vector<Ref<Object>>& cells, std::span<const Ref<Object>> args);
+// Marks what the calls run by the VM on the calling thread hold.
+void trace(Tracer& tracer);
+// A fresh copy of a constant quasiquote template, as quasiquote expands it:
+// every list in it is copied.
+Ref<Object> copy(const Ref<Object>& obj);
+};
@@ -0,0 +1,40 @@
+# Runs ALMA on INPUT with an empty cache in DIR, then again after damaging
+# the entry it wrote in each of several ways, and checks that it prints the
+# same every time: a damaged entry is a miss, and is written again. ALMA
+# may only map 256 MB, so that sizes it trusted from the entry would fail.
+file(REMOVE_RECURSE ${DIR})
+function(run)
+  execute_process(COMMAND sh -c "ulimit -v 262144 && exec \"$@\"" sh ${ALMA} --cache-dir ${DIR} ${INPUT}
+    OUTPUT_VARIABLE output
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${INPUT} exited with ${result}")
+  endif()
+  set(output "${output}" PARENT_SCOPE)
+endfunction()
+
+run()
+set(expected "${output}")
+file(GLOB entries ${DIR}/*.almc)
+list(LENGTH entries count)
+if(NOT count EQUAL 1)
+  message(FATAL_ERROR "${DIR} holds ${count} entries, expected 1")
+endif()
+
+# The entry header is 72 bytes, followed by the counts of symbols and forms
+# of the image.
+foreach(damage
+    "printf '\\377\\377\\377\\377' | dd of=\"$0\" bs=1 seek=76 conv=notrunc"
+    "printf '\\377\\377\\377\\377' | dd of=\"$0\" bs=1 seek=72 conv=notrunc"
+    "dd if=/dev/zero of=\"$0\" bs=1 seek=80 count=64 conv=notrunc"
+    "head -c 84 \"$0\" > \"$0.part\" && mv \"$0.part\" \"$0\""
+    ": > \"$0\"")
+  execute_process(COMMAND sh -c "${damage}" ${entries} ERROR_QUIET RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Could not damage ${entries} with ${damage}")
+  endif()
+  run()
+  if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "${INPUT} printed:\n${output}\nafter ${damage}, expected:\n${expected}")
+  endif()
+endforeach()
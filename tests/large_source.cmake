@@ -0,0 +1,25 @@
+# Writes a program of COUNT defuns, each calling the one before it, to
+# OUTPUT, then checks that ALMA loads and runs it.
+file(WRITE ${OUTPUT} "(defun f0 (x) x)\n")
+math(EXPR last "${COUNT} - 1")
+set(chunk "")
+foreach(i RANGE 1 ${last})
+  math(EXPR previous "${i} - 1")
+  string(APPEND chunk "(defun f${i} (x) (f${previous} (+ x 1)))\n")
+  math(EXPR flush "${i} % 1000")
+  if(flush EQUAL 0)
+    file(APPEND ${OUTPUT} "${chunk}")
+    set(chunk "")
+  endif()
+endforeach()
+file(APPEND ${OUTPUT} "${chunk}(print (f${last} 0))\n")
+
+execute_process(COMMAND ${ALMA} ${OUTPUT}
+  OUTPUT_VARIABLE output
+  RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "${OUTPUT} exited with ${result}")
+endif()
+if(NOT output STREQUAL "${last}\n")
+  message(FATAL_ERROR "${OUTPUT} printed ${output}, expected ${last}")
+endif()
@@ -0,0 +1,37 @@
+# Writes a program of COUNT blocks of top-level strings, comments and
+# quoted atoms whose parentheses and quotes do not balance on their own
+# to OUTPUT, with ERROR in place of block ERROR_AT, then checks that ALMA
+# prints the same, up to the error and where it is, read with --jobs 1 and
+# split between the threads of --jobs 4.
+file(WRITE ${OUTPUT} "")
+math(EXPR last "${COUNT} - 1")
+set(chunk "")
+foreach(i RANGE ${last})
+  if(i EQUAL ERROR_AT)
+    string(APPEND chunk "${ERROR}\n")
+  else()
+    string(APPEND chunk "\"top-level (string ; ${i}\"\n"
+      "; comment ) with ( parens and a \" ${i}\n"
+      "'atom${i}\n"
+      "(defun f${i} (x) (+ x ${i})) ; (\n"
+      "(print '(${i} \"s)\" atom${i} \"; (\"))\n")
+  endif()
+  math(EXPR flush "${i} % 1000")
+  if(flush EQUAL 0)
+    file(APPEND ${OUTPUT} "${chunk}")
+    set(chunk "")
+  endif()
+endforeach()
+file(APPEND ${OUTPUT} "${chunk}")
+
+foreach(jobs 1 4)
+  execute_process(COMMAND ${ALMA} --jobs ${jobs} ${OUTPUT}
+    OUTPUT_VARIABLE output_${jobs}
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${OUTPUT} exited with ${result} with --jobs ${jobs}")
+  endif()
+endforeach()
+if(NOT output_1 STREQUAL output_4)
+  message(FATAL_ERROR "${OUTPUT} printed:\n${output_4}\nwith --jobs 4, but with --jobs 1:\n${output_1}")
+endif()
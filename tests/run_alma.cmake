@@ -0,0 +1,53 @@
+# Runs ALMA on INPUT, with the options in ARGS, and checks that it exits
+# cleanly and prints what the file EXPECTED holds, what the program PROGRAM
+# translated from INPUT prints, what ALMA prints run on INPUT with the
+# options in REFERENCE or, for output too large to keep, what has the MD5
+# MD5. With MEMORY, ALMA may only map that many KB. With STDIN, INPUT is
+# piped to ALMA, which is left to find it from ARGS.
+if(STDIN)
+  set(command ${ALMA} ${ARGS})
+  set(feed COMMAND cat ${INPUT})
+else()
+  set(command ${ALMA} ${ARGS} ${INPUT})
+  set(feed "")
+endif()
+if(DEFINED MEMORY)
+  set(command sh -c "ulimit -v ${MEMORY} && exec \"$@\"" sh ${command})
+endif()
+execute_process(${feed} COMMAND ${command}
+  OUTPUT_VARIABLE output
+  RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "${INPUT} exited with ${result}")
+endif()
+if(DEFINED PROGRAM)
+  execute_process(COMMAND ${PROGRAM}
+    OUTPUT_VARIABLE expected
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${PROGRAM} exited with ${result}")
+  endif()
+  if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "${INPUT} printed:\n${output}\n${PROGRAM} printed:\n${expected}")
+  endif()
+elseif(DEFINED REFERENCE)
+  execute_process(COMMAND ${ALMA} ${REFERENCE} ${INPUT}
+    OUTPUT_VARIABLE expected
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${INPUT} exited with ${result} with ${REFERENCE}")
+  endif()
+  if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "${INPUT} printed:\n${output}\nwith ${REFERENCE}:\n${expected}")
+  endif()
+elseif(DEFINED EXPECTED)
+  file(READ ${EXPECTED} expected)
+  if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "${INPUT} printed:\n${output}\nexpected:\n${expected}")
+  endif()
+else()
+  string(MD5 hash "${output}")
+  if(NOT hash STREQUAL MD5)
+    message(FATAL_ERROR "${INPUT} printed output with MD5 ${hash}, expected ${MD5}")
+  endif()
+endif()